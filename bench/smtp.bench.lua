@@ -0,0 +1,231 @@
+#!/usr/bin/env tarantool
+
+-- Throughput and latency benchmark of the SMTP client.
+--
+-- Messages are sent to a local sink server, so the benchmark runs
+-- offline. The sink accepts any message and replies at once, it
+-- handles pipelined commands (PIPELINING is advertised).
+--
+-- Usage:
+--
+--  tarantool bench/smtp.bench.lua [options]
+--
+--  --duration SECONDS - the duration of one case (defaults to 2);
+--  --quick - run a short sweep;
+--  --url URL - send to the given server instead of the built-in
+--      sink, e.g. a sink started in another process;
+--  --tls-url URL - repeat every case over TLS, e.g. 'smtps://...' of
+--      a TLS terminator in front of the sink (stunnel, haproxy),
+--      certificates are not verified;
+--  --sink PORT - run the sink only.
+--
+-- For every case the number of messages per second, the p50 and
+-- p99 latency of a request, the RSS of the process and the number
+-- of its threads (the TX one and coio ones) are printed. With the
+-- built-in sink the RSS includes the sink as well.
+
+local clock = require('clock')
+local fiber = require('fiber')
+local fio = require('fio')
+local socket = require('socket')
+local smtp = require('smtp')
+
+local KB = 1024
+
+-- {{{ Options
+
+local options = {
+    duration = 2,
+    quick = false,
+}
+
+local i = 1
+while i <= #arg do
+    local a = arg[i]
+    if a == '--quick' then
+        options.quick = true
+    elseif a == '--duration' or a == '--url' or a == '--tls-url' or
+            a == '--sink' then
+        options[a:sub(3):gsub('-', '_')] = arg[i + 1]
+        i = i + 1
+    else
+        io.stderr:write(('Unknown option %s\n'):format(a))
+        os.exit(1)
+    end
+    i = i + 1
+end
+options.duration = tonumber(options.duration)
+
+-- }}} Options
+
+-- {{{ Sink
+
+local function sink_h(s)
+    s:write('220 localhost ESMTP sink\r\n')
+    while true do
+        local l = s:read('\r\n')
+        if l == nil or l == '' then
+            return
+        end
+        local cmd = l:sub(1, 4):upper()
+        if cmd == 'EHLO' then
+            s:write('250-localhost\r\n250-PIPELINING\r\n' ..
+                    '250-8BITMIME\r\n250 SIZE 104857600\r\n')
+        elseif cmd == 'DATA' then
+            s:write('354 Go ahead\r\n')
+            if s:read('\r\n.\r\n') == nil then
+                return
+            end
+            s:write('250 OK\r\n')
+        elseif cmd == 'QUIT' then
+            s:write('221 Bye\r\n')
+            return
+        else
+            s:write('250 OK\r\n')
+        end
+    end
+end
+
+local function sink_start(port)
+    local server = socket.tcp_server('127.0.0.1', port or 0, sink_h)
+    return server, server:name().port
+end
+
+if options.sink ~= nil then
+    local _, port = sink_start(tonumber(options.sink))
+    print(('SMTP sink is listening on 127.0.0.1:%d'):format(port))
+    while true do
+        fiber.sleep(3600)
+    end
+end
+
+-- }}} Sink
+
+-- {{{ Metrics
+
+local page_size = 4096
+
+-- Resident set size of the process in megabytes.
+local function rss_mb()
+    local f = fio.open('/proc/self/statm')
+    if f == nil then
+        return 0
+    end
+    local statm = f:read(256)
+    f:close()
+    local rss = tonumber(statm:match('^%d+%s+(%d+)')) or 0
+    return rss * page_size / KB / KB
+end
+
+-- The number of threads of the process.
+local function threads()
+    local tasks = fio.listdir('/proc/self/task')
+    return tasks ~= nil and #tasks or 0
+end
+
+local function percentile(sorted, p)
+    if #sorted == 0 then
+        return 0
+    end
+    return sorted[math.max(1, math.ceil(#sorted * p))]
+end
+
+-- }}} Metrics
+
+local function run_case(client, url, case)
+    local body = string.rep('x', case.body_size - 1) .. '\n'
+    local opts = {
+        subject = 'Benchmark',
+        timeout = 30,
+        verify_peer = false,
+        verify_host = false,
+    }
+    if case.attachments > 0 then
+        opts.attachments = {}
+        local attachment = string.rep('y', 16 * KB)
+        for n = 1, case.attachments do
+            opts.attachments[n] = {
+                body = attachment,
+                content_type = 'application/octet-stream',
+                filename = ('file%d.bin'):format(n),
+            }
+        end
+    end
+
+    local latencies = {}
+    local failed = 0
+    local deadline = clock.monotonic() + options.duration
+    local done = fiber.channel(case.concurrency)
+    local started = clock.monotonic()
+    for _ = 1, case.concurrency do
+        fiber.create(function()
+            while clock.monotonic() < deadline do
+                local t = clock.monotonic()
+                local ok, r = pcall(client.request, client, url,
+                                    'sender@example.org',
+                                    'receiver@example.org', body, opts)
+                if ok and r.status == 250 then
+                    latencies[#latencies + 1] = clock.monotonic() - t
+                else
+                    failed = failed + 1
+                end
+            end
+            done:put(true)
+        end)
+    end
+    for _ = 1, case.concurrency do
+        done:get()
+    end
+    local elapsed = clock.monotonic() - started
+    table.sort(latencies)
+    return {
+        rate = #latencies / elapsed,
+        p50 = percentile(latencies, 0.5) * 1000,
+        p99 = percentile(latencies, 0.99) * 1000,
+        failed = failed,
+    }
+end
+
+local function sweep()
+    if options.quick then
+        return {1, 16}, {KB, 256 * KB}, {0, 2}
+    end
+    return {1, 8, 32, 128}, {KB, 64 * KB, 1024 * KB}, {0, 1, 4}
+end
+
+local url = options.url
+if url == nil then
+    local _, port = sink_start()
+    url = ('smtp://127.0.0.1:%d'):format(port)
+end
+local urls = {{url = url, tls = 'off'}}
+if options.tls_url ~= nil then
+    urls[2] = {url = options.tls_url, tls = 'on'}
+end
+
+print(('libcurl %s, %s s per case'):format(smtp._CURL_VERSION,
+                                          options.duration))
+print(('%5s %8s %4s %4s %10s %9s %9s %8s %8s %7s'):format(
+    'conc', 'body', 'att', 'tls', 'msg/s', 'p50 ms', 'p99 ms', 'rss MB',
+    'threads', 'failed'))
+
+local concurrency, body_sizes, attachments = sweep()
+for _, target in ipairs(urls) do
+    for _, c in ipairs(concurrency) do
+        for _, size in ipairs(body_sizes) do
+            for _, att in ipairs(attachments) do
+                local client = smtp.new({max_connections = c})
+                local case = {concurrency = c, body_size = size,
+                              attachments = att}
+                local r = run_case(client, target.url, case)
+                print(('%5d %7dK %4d %4s %10.1f %9.2f %9.2f %8.1f %8d %7d')
+                      :format(c, size / KB, att, target.tls, r.rate, r.p50,
+                              r.p99, rss_mb(), threads(), r.failed))
+                collectgarbage()
+            end
+        end
+    end
+end
+
+os.exit(0)
+-- vim: ts=4 sts=4 sw=4 et
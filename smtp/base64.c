@@ -0,0 +1,256 @@
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "base64.h"
+
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BASE64_X86 1
+#include <immintrin.h>
+#endif
+
+/** Input bytes per encoded line. */
+#define BASE64_LINE_BYTES (SMTPC_BASE64_LINE_LEN / 4 * 3)
+
+static const char base64_alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Vectorized encoder. It encodes the longest prefix of @a size
+ * bytes it can, reading at most @a avail bytes from @a in, and
+ * returns the number of consumed bytes, which is a multiple of 3.
+ */
+typedef size_t
+(*base64_encode_block_f)(const uint8_t *in, size_t size, size_t avail,
+			 char *out);
+
+/* {{{ Scalar */
+
+/**
+ * Encode the data. The size must be a multiple of 3 unless it is
+ * the end of the input, which is padded with '='.
+ */
+static size_t
+base64_encode_scalar(const uint8_t *in, size_t size, char *out)
+{
+	char *p = out;
+	for (; size >= 3; size -= 3, in += 3) {
+		uint32_t v = in[0] << 16 | in[1] << 8 | in[2];
+		*p++ = base64_alphabet[v >> 18];
+		*p++ = base64_alphabet[(v >> 12) & 0x3f];
+		*p++ = base64_alphabet[(v >> 6) & 0x3f];
+		*p++ = base64_alphabet[v & 0x3f];
+	}
+	if (size > 0) {
+		uint32_t v = in[0] << 16 | (size > 1 ? in[1] << 8 : 0);
+		*p++ = base64_alphabet[v >> 18];
+		*p++ = base64_alphabet[(v >> 12) & 0x3f];
+		*p++ = size > 1 ? base64_alphabet[(v >> 6) & 0x3f] : '=';
+		*p++ = '=';
+	}
+	return p - out;
+}
+
+/* Scalar }}} */
+
+#ifdef BASE64_X86
+
+/* {{{ SSSE3 */
+
+/*
+ * The algorithm is described by Wojciech Muła in "Base64 encoding
+ * with SIMD instructions": every 3 input bytes are spread over a
+ * 32-bit lane, the 6-bit indices are moved into separate bytes by
+ * multiplications and translated into ASCII with a small lookup
+ * table indexed by the index range.
+ */
+
+__attribute__((target("ssse3")))
+static inline __m128i
+base64_reshuffle_ssse3(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					       4, 5, 3, 4, 1, 2, 0, 1));
+	__m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	__m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i
+base64_translate_ssse3(__m128i in)
+{
+	const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+					  -4, -4, -4, -4, -19, -16, 0, 0);
+	__m128i idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+	idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+}
+
+/** Encode 12 bytes per iteration, 16 bytes are loaded. */
+__attribute__((target("ssse3")))
+static size_t
+base64_encode_ssse3(const uint8_t *in, size_t size, size_t avail, char *out)
+{
+	size_t done = 0;
+	while (size - done >= 12 && avail - done >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+		v = base64_translate_ssse3(base64_reshuffle_ssse3(v));
+		_mm_storeu_si128((__m128i *)out, v);
+		out += 16;
+		done += 12;
+	}
+	return done;
+}
+
+/* SSSE3 }}} */
+
+/* {{{ AVX2 */
+
+__attribute__((target("avx2")))
+static inline __m256i
+base64_reshuffle_avx2(__m256i in)
+{
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	__m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	return _mm256_or_si256(t1, t3);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+base64_translate_avx2(__m256i in)
+{
+	const __m256i lut = _mm256_setr_epi8(
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m256i idx = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+	idx = _mm256_sub_epi8(idx,
+			      _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+	return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, idx));
+}
+
+/**
+ * Encode 24 bytes per iteration: each 128-bit lane gets 12 bytes
+ * of input, 28 bytes are loaded.
+ */
+__attribute__((target("avx2")))
+static size_t
+base64_encode_avx2(const uint8_t *in, size_t size, size_t avail, char *out)
+{
+	size_t done = 0;
+	while (size - done >= 24 && avail - done >= 28) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(in + done));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(in + done + 12));
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),
+						    hi, 1);
+		v = base64_translate_avx2(base64_reshuffle_avx2(v));
+		_mm256_storeu_si256((__m256i *)out, v);
+		out += 32;
+		done += 24;
+	}
+	return done + base64_encode_ssse3(in + done, size - done,
+					  avail - done, out);
+}
+
+/* AVX2 }}} */
+
+#endif /* BASE64_X86 */
+
+/** Encoder without vector instructions. */
+static size_t
+base64_encode_block_none(const uint8_t *in, size_t size, size_t avail,
+			 char *out)
+{
+	(void)in;
+	(void)size;
+	(void)avail;
+	(void)out;
+	return 0;
+}
+
+/**
+ * Choose the best encoder supported by the CPU.
+ */
+static base64_encode_block_f
+base64_select(void)
+{
+#ifdef BASE64_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return base64_encode_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return base64_encode_ssse3;
+#endif
+	return base64_encode_block_none;
+}
+
+size_t
+smtpc_base64_encoded_size(size_t size)
+{
+	size_t len = (size + 2) / 3 * 4;
+	if (len == 0)
+		return 0;
+	return len + (len - 1) / SMTPC_BASE64_LINE_LEN * 2;
+}
+
+size_t
+smtpc_base64_encode(const char *in, size_t size, char *out)
+{
+	static base64_encode_block_f encode_block = NULL;
+	if (encode_block == NULL)
+		encode_block = base64_select();
+
+	const uint8_t *src = (const uint8_t *)in;
+	char *p = out;
+	size_t left = size;
+	while (left > 0) {
+		if (p != out) {
+			*p++ = '\r';
+			*p++ = '\n';
+		}
+		size_t line = left < BASE64_LINE_BYTES ?
+			      left : BASE64_LINE_BYTES;
+		size_t done = encode_block(src, line, left, p);
+		p += done / 3 * 4;
+		p += base64_encode_scalar(src + done, line - done, p);
+		src += line;
+		left -= line;
+	}
+	return p - out;
+}
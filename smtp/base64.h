@@ -0,0 +1,64 @@
+#ifndef TARANTOOL_SMTP_BASE64_H_INCLUDED
+#define TARANTOOL_SMTP_BASE64_H_INCLUDED 1
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+/**
+ * Base64 encoder for message bodies (RFC 2045): the output is
+ * split into lines of SMTPC_BASE64_LINE_LEN characters separated
+ * by CRLF. There is no line break after the last line.
+ *
+ * Vectorized SSSE3 and AVX2 encoders are used when the CPU
+ * supports them, the choice is made at the first call.
+ */
+
+/** Maximum length of an encoded line. */
+#define SMTPC_BASE64_LINE_LEN 76
+
+/**
+ * Size of the encoded data including line breaks.
+ */
+size_t
+smtpc_base64_encoded_size(size_t size);
+
+/**
+ * Encode the data.
+ * @param in data to encode
+ * @param size size of the data
+ * @param out output buffer of smtpc_base64_encoded_size(size) bytes
+ * @return the number of bytes written
+ */
+size_t
+smtpc_base64_encode(const char *in, size_t size, char *out);
+
+#endif /* TARANTOOL_SMTP_BASE64_H_INCLUDED */
@@ -0,0 +1,764 @@
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "dkim.h"
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <module.h>
+
+#include "base64.h"
+#include "mime.h"
+
+/* {{{ libcrypto */
+
+/** EVP_PKEY_RSA, the type of an RSA key. */
+#define SMTPC_DKIM_PKEY_RSA 6
+
+/**
+ * libcrypto functions. The OpenSSL headers are not used, the
+ * objects are opaque.
+ */
+static struct {
+	const void *(*EVP_sha256)(void);
+	void *(*EVP_MD_CTX_new)(void);
+	void (*EVP_MD_CTX_free)(void *ctx);
+	int (*EVP_DigestInit_ex)(void *ctx, const void *md, void *engine);
+	int (*EVP_DigestUpdate)(void *ctx, const void *data, size_t size);
+	int (*EVP_DigestFinal_ex)(void *ctx, unsigned char *md,
+				  unsigned int *size);
+	int (*EVP_DigestSignInit)(void *ctx, void **pctx, const void *md,
+				  void *engine, void *pkey);
+	int (*EVP_DigestSign)(void *ctx, unsigned char *sig, size_t *sig_size,
+			      const unsigned char *data, size_t size);
+	void *(*BIO_new_mem_buf)(const void *buf, int size);
+	int (*BIO_free)(void *bio);
+	void *(*PEM_read_bio_PrivateKey)(void *bio, void **pkey,
+					 int (*cb)(char *, int, int, void *),
+					 void *arg);
+	int (*EVP_PKEY_base_id)(const void *pkey);
+	void (*EVP_PKEY_free)(void *pkey);
+} crypto;
+
+/** Set when all the libcrypto functions are bound. */
+static bool crypto_loaded;
+
+/**
+ * dlopen() handle of the system libcrypto. The library is never
+ * unloaded: the parsed keys refer to it.
+ */
+static void *libcrypto_handle;
+
+#define load_func(handle, func, name) do {				\
+	*(void **)&crypto.func = dlsym((handle), (name));		\
+	if (crypto.func == NULL)					\
+		return -1;						\
+} while (0)
+
+static int
+smtpc_dkim_bind(void *handle)
+{
+	load_func(handle, EVP_sha256, "EVP_sha256");
+	load_func(handle, EVP_MD_CTX_new, "EVP_MD_CTX_new");
+	load_func(handle, EVP_MD_CTX_free, "EVP_MD_CTX_free");
+	load_func(handle, EVP_DigestInit_ex, "EVP_DigestInit_ex");
+	load_func(handle, EVP_DigestUpdate, "EVP_DigestUpdate");
+	load_func(handle, EVP_DigestFinal_ex, "EVP_DigestFinal_ex");
+	load_func(handle, EVP_DigestSignInit, "EVP_DigestSignInit");
+	load_func(handle, EVP_DigestSign, "EVP_DigestSign");
+	load_func(handle, BIO_new_mem_buf, "BIO_new_mem_buf");
+	load_func(handle, BIO_free, "BIO_free");
+	load_func(handle, PEM_read_bio_PrivateKey, "PEM_read_bio_PrivateKey");
+	load_func(handle, EVP_PKEY_free, "EVP_PKEY_free");
+	/* The function is renamed in OpenSSL 3.0. */
+	*(void **)&crypto.EVP_PKEY_base_id =
+		dlsym(handle, "EVP_PKEY_get_base_id");
+	if (crypto.EVP_PKEY_base_id == NULL)
+		load_func(handle, EVP_PKEY_base_id, "EVP_PKEY_base_id");
+	return 0;
+}
+
+#undef load_func
+
+/**
+ * Bind libcrypto functions: the ones exported by tarantool if
+ * there are all of them or the ones of the system library.
+ */
+static int
+smtpc_dkim_init(void)
+{
+	if (crypto_loaded)
+		return 0;
+	if (smtpc_dkim_bind(RTLD_DEFAULT) == 0) {
+		crypto_loaded = true;
+		return 0;
+	}
+	static const char *libnames[] = {
+#ifdef __APPLE__
+		"libcrypto.3.dylib", "libcrypto.1.1.dylib", "libcrypto.dylib",
+#else
+		"libcrypto.so.3", "libcrypto.so.1.1", "libcrypto.so",
+#endif
+	};
+	for (size_t i = 0; i < sizeof(libnames) / sizeof(libnames[0]); i++) {
+		void *handle = dlopen(libnames[i], RTLD_NOW | RTLD_LOCAL);
+		if (handle == NULL)
+			continue;
+		if (smtpc_dkim_bind(handle) == 0) {
+			libcrypto_handle = handle;
+			crypto_loaded = true;
+			return 0;
+		}
+		dlclose(handle);
+	}
+	box_error_set(__FILE__, __LINE__, ER_SYSTEM,
+		      "Unable to load libcrypto for DKIM signing");
+	return -1;
+}
+
+/* libcrypto }}} */
+
+/* {{{ Buffer */
+
+/** A growing text buffer. */
+struct smtpc_dkim_buf {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static char *
+smtpc_dkim_buf_reserve(struct smtpc_dkim_buf *b, size_t size)
+{
+	if (b->size + size <= b->capacity)
+		return b->data + b->size;
+	size_t capacity = b->capacity > 0 ? b->capacity : 512;
+	while (capacity < b->size + size)
+		capacity *= 2;
+	char *data = realloc(b->data, capacity);
+	if (data == NULL) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc DKIM buffer");
+		return NULL;
+	}
+	b->data = data;
+	b->capacity = capacity;
+	return b->data + b->size;
+}
+
+static int
+smtpc_dkim_buf_append(struct smtpc_dkim_buf *b, const char *data,
+		      size_t size)
+{
+	char *p = smtpc_dkim_buf_reserve(b, size);
+	if (p == NULL)
+		return -1;
+	memcpy(p, data, size);
+	b->size += size;
+	return 0;
+}
+
+static int
+smtpc_dkim_buf_printf(struct smtpc_dkim_buf *b, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int size = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	char *p = smtpc_dkim_buf_reserve(b, size + 1);
+	if (p == NULL)
+		return -1;
+	va_start(ap, format);
+	vsnprintf(p, size + 1, format, ap);
+	va_end(ap);
+	b->size += size;
+	return 0;
+}
+
+/* Buffer }}} */
+
+/* {{{ Keys */
+
+/** Encrypted keys are not supported, never ask for a password. */
+static int
+smtpc_dkim_no_password(char *buf, int size, int rwflag, void *arg)
+{
+	(void)buf;
+	(void)size;
+	(void)rwflag;
+	(void)arg;
+	return -1;
+}
+
+struct smtpc_dkim_key *
+smtpc_dkim_key_new(const char *pem, size_t pem_size)
+{
+	if (smtpc_dkim_init() != 0)
+		return NULL;
+	struct smtpc_dkim_key *key = calloc(1, sizeof(*key));
+	if (key == NULL || (key->pem = malloc(pem_size)) == NULL) {
+		free(key);
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc DKIM key");
+		return NULL;
+	}
+	memcpy(key->pem, pem, pem_size);
+	key->pem_size = pem_size;
+	void *bio = crypto.BIO_new_mem_buf(pem, (int)pem_size);
+	if (bio != NULL) {
+		key->pkey = crypto.PEM_read_bio_PrivateKey(
+			bio, NULL, smtpc_dkim_no_password, NULL);
+		crypto.BIO_free(bio);
+	}
+	if (key->pkey == NULL) {
+		smtpc_dkim_key_delete(key);
+		box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+			      "Can't parse DKIM key");
+		return NULL;
+	}
+	if (crypto.EVP_PKEY_base_id(key->pkey) != SMTPC_DKIM_PKEY_RSA) {
+		smtpc_dkim_key_delete(key);
+		box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+			      "DKIM key must be an RSA key");
+		return NULL;
+	}
+	return key;
+}
+
+void
+smtpc_dkim_key_delete(struct smtpc_dkim_key *key)
+{
+	if (key->pkey != NULL)
+		crypto.EVP_PKEY_free(key->pkey);
+	free(key->pem);
+	free(key);
+}
+
+int
+smtpc_dkim_check(const char *domain, const char *selector)
+{
+	/* The values must not break the tag list of the header. */
+	const char *reject = " \t\r\n;=";
+	if (*domain == '\0' || domain[strcspn(domain, reject)] != '\0') {
+		box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+			      "Invalid DKIM domain");
+		return -1;
+	}
+	if (*selector == '\0' || selector[strcspn(selector, reject)] != '\0') {
+		box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+			      "Invalid DKIM selector");
+		return -1;
+	}
+	return 0;
+}
+
+/* Keys }}} */
+
+/* {{{ Body hash */
+
+/** A position in a message. */
+struct smtpc_dkim_pos {
+	/** Segment index. */
+	int seg;
+	/** Offset in the segment. */
+	size_t offset;
+};
+
+/**
+ * Find the start of the body: the position after the empty line,
+ * which ends the header. The header is always generated text.
+ */
+static int
+smtpc_dkim_find_body(const struct smtpc_mime *mime,
+		     struct smtpc_dkim_pos *pos)
+{
+	static const char separator[] = "\r\n\r\n";
+	int match = 0;
+	for (int i = 0; i < mime->seg_count; ++i) {
+		const struct smtpc_mime_seg *seg = &mime->segs[i];
+		if (seg->type != SMTPC_MIME_SEG_TEXT &&
+		    seg->type != SMTPC_MIME_SEG_REF)
+			break;
+		const char *data = smtpc_mime_seg_data(mime, seg);
+		for (size_t j = 0; j < seg->size; ++j) {
+			if (data[j] == separator[match])
+				++match;
+			else
+				match = data[j] == '\r' ? 1 : 0;
+			if (match == 4) {
+				pos->seg = i;
+				pos->offset = j + 1;
+				return 0;
+			}
+		}
+	}
+	box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+		      "Can't find the end of the message header");
+	return -1;
+}
+
+/** Size of the buffer of canonical body text. */
+#define SMTPC_DKIM_CANON_BUF_SIZE 4096
+
+/**
+ * Relaxed body canonicalization (RFC 6376, 3.4.4): whitespace
+ * runs are reduced to one space, whitespace at the end of a line
+ * and empty lines at the end of the body are dropped. The state
+ * is kept between chunks. A bare LF is a line break as well: it
+ * is CRLF by the time the message is verified.
+ */
+struct smtpc_dkim_canon {
+	/** Hash context, EVP_MD_CTX. */
+	void *ctx;
+	/** Canonical text, which is not hashed yet. */
+	char buf[SMTPC_DKIM_CANON_BUF_SIZE];
+	size_t size;
+	/** Line breaks, which are dropped at the end of the body. */
+	size_t line_breaks;
+	/** Set after whitespace, which is dropped at a line end. */
+	bool wsp;
+	/** Set after CR, which may start a line break. */
+	bool cr;
+	/** Set when the body has content. */
+	bool content;
+};
+
+static void
+smtpc_dkim_canon_put(struct smtpc_dkim_canon *c, char ch)
+{
+	if (c->size == sizeof(c->buf)) {
+		crypto.EVP_DigestUpdate(c->ctx, c->buf, c->size);
+		c->size = 0;
+	}
+	c->buf[c->size++] = ch;
+}
+
+/** Put a character, which is neither whitespace nor a line break. */
+static void
+smtpc_dkim_canon_content(struct smtpc_dkim_canon *c, char ch)
+{
+	for (; c->line_breaks > 0; --c->line_breaks) {
+		smtpc_dkim_canon_put(c, '\r');
+		smtpc_dkim_canon_put(c, '\n');
+	}
+	if (c->wsp) {
+		smtpc_dkim_canon_put(c, ' ');
+		c->wsp = false;
+	}
+	smtpc_dkim_canon_put(c, ch);
+	c->content = true;
+}
+
+static void
+smtpc_dkim_canon_update(struct smtpc_dkim_canon *c, const char *data,
+			size_t size)
+{
+	for (size_t i = 0; i < size; ++i) {
+		char ch = data[i];
+		if (c->cr) {
+			c->cr = false;
+			if (ch != '\n')
+				smtpc_dkim_canon_content(c, '\r');
+		}
+		switch (ch) {
+		case '\r':
+			c->cr = true;
+			break;
+		case '\n':
+			c->wsp = false;
+			++c->line_breaks;
+			break;
+		case ' ':
+		case '\t':
+			c->wsp = true;
+			break;
+		default:
+			smtpc_dkim_canon_content(c, ch);
+		}
+	}
+}
+
+static int
+smtpc_dkim_canon_finish(struct smtpc_dkim_canon *c,
+			unsigned char hash[SMTPC_DKIM_HASH_SIZE])
+{
+	if (c->cr)
+		smtpc_dkim_canon_content(c, '\r');
+	/* A non-empty body ends with exactly one line break. */
+	if (c->content) {
+		smtpc_dkim_canon_put(c, '\r');
+		smtpc_dkim_canon_put(c, '\n');
+	}
+	unsigned int size = 0;
+	if (crypto.EVP_DigestUpdate(c->ctx, c->buf, c->size) != 1 ||
+	    crypto.EVP_DigestFinal_ex(c->ctx, hash, &size) != 1 ||
+	    size != SMTPC_DKIM_HASH_SIZE) {
+		box_error_set(__FILE__, __LINE__, ER_SYSTEM,
+			      "Can't hash DKIM body");
+		return -1;
+	}
+	return 0;
+}
+
+/** Canonicalize a file segment, the file is read by chunks. */
+static int
+smtpc_dkim_canon_file(struct smtpc_dkim_canon *c,
+		      struct smtpc_mime_file *file,
+		      const struct smtpc_mime_seg *seg)
+{
+	smtpc_mime_file_open(file, seg);
+	while (true) {
+		const char *data;
+		size_t size;
+		if (smtpc_mime_file_read(file, &data, &size) != 0)
+			return -1;
+		if (size == 0)
+			return 0;
+		smtpc_dkim_canon_update(c, data, size);
+	}
+}
+
+int
+smtpc_dkim_body_hash(const struct smtpc_mime *mime,
+		     unsigned char hash[SMTPC_DKIM_HASH_SIZE])
+{
+	if (smtpc_dkim_init() != 0)
+		return -1;
+	if (smtpc_mime_has_stream(mime)) {
+		box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+			      "DKIM can't sign a streamed body");
+		return -1;
+	}
+	struct smtpc_dkim_pos pos;
+	if (smtpc_dkim_find_body(mime, &pos) != 0)
+		return -1;
+	struct smtpc_dkim_canon *c = calloc(1, sizeof(*c));
+	if (c == NULL || (c->ctx = crypto.EVP_MD_CTX_new()) == NULL ||
+	    crypto.EVP_DigestInit_ex(c->ctx, crypto.EVP_sha256(),
+				     NULL) != 1) {
+		if (c != NULL && c->ctx != NULL)
+			crypto.EVP_MD_CTX_free(c->ctx);
+		free(c);
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc DKIM hash");
+		return -1;
+	}
+	struct smtpc_mime_file file;
+	smtpc_mime_file_create(&file);
+	int rc = 0;
+	for (int i = pos.seg; i < mime->seg_count && rc == 0; ++i) {
+		const struct smtpc_mime_seg *seg = &mime->segs[i];
+		size_t offset = i == pos.seg ? pos.offset : 0;
+		if (seg->type == SMTPC_MIME_SEG_FILE)
+			rc = smtpc_dkim_canon_file(c, &file, seg);
+		else
+			smtpc_dkim_canon_update(
+				c, smtpc_mime_seg_data(mime, seg) + offset,
+				seg->size - offset);
+	}
+	smtpc_mime_file_destroy(&file);
+	if (rc == 0)
+		rc = smtpc_dkim_canon_finish(c, hash);
+	crypto.EVP_MD_CTX_free(c->ctx);
+	free(c);
+	return rc;
+}
+
+/* Body hash }}} */
+
+/* {{{ Signature */
+
+/**
+ * Header fields to sign, the ones recommended by RFC 6376, 5.4.1
+ * and the MIME ones.
+ */
+static const char *const smtpc_dkim_signed_headers[] = {
+	"from", "sender", "reply-to", "subject", "date", "message-id",
+	"to", "cc", "mime-version", "content-type",
+	"content-transfer-encoding", "in-reply-to", "references",
+	"list-id", "list-help", "list-unsubscribe", "list-post",
+};
+
+/** A header field: the name, the colon and the folded value. */
+struct smtpc_dkim_field {
+	const char *data;
+	size_t size;
+	/** Length of the name without trailing whitespace. */
+	size_t name_len;
+};
+
+/**
+ * Split the header into fields. Lines starting with whitespace
+ * continue the previous field.
+ * @return the number of fields or -1 on error
+ */
+static int
+smtpc_dkim_parse_header(const char *header, size_t size,
+			struct smtpc_dkim_field **fields)
+{
+	int count = 0;
+	int capacity = 0;
+	*fields = NULL;
+	const char *p = header;
+	const char *end = header + size;
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		const char *next = eol != NULL ? eol + 1 : end;
+		if (eol == NULL)
+			eol = end;
+		if (eol > p && eol[-1] == '\r')
+			--eol;
+		if ((*p == ' ' || *p == '\t') && count > 0) {
+			struct smtpc_dkim_field *field = &(*fields)[count - 1];
+			field->size = eol - field->data;
+		} else if (memchr(p, ':', eol - p) != NULL) {
+			if (count == capacity) {
+				capacity = capacity > 0 ? capacity * 2 : 16;
+				struct smtpc_dkim_field *f =
+					realloc(*fields,
+						capacity * sizeof(**fields));
+				if (f == NULL) {
+					box_error_set(__FILE__, __LINE__,
+						      ER_MEMORY_ISSUE,
+						      "Can't alloc DKIM buffer");
+					return -1;
+				}
+				*fields = f;
+			}
+			struct smtpc_dkim_field *field = &(*fields)[count++];
+			field->data = p;
+			field->size = eol - p;
+			const char *colon = memchr(p, ':', eol - p);
+			while (colon > p && (colon[-1] == ' ' ||
+					     colon[-1] == '\t'))
+				--colon;
+			field->name_len = colon - p;
+		}
+		p = next;
+	}
+	return count;
+}
+
+/**
+ * Append a header field in the relaxed canonical form (RFC 6376,
+ * 3.4.2) without CRLF: the name in lower case, the value unfolded
+ * with whitespace runs reduced to one space and trimmed.
+ */
+static int
+smtpc_dkim_canon_header(struct smtpc_dkim_buf *b, const char *data,
+			size_t size)
+{
+	char *p = smtpc_dkim_buf_reserve(b, size);
+	if (p == NULL)
+		return -1;
+	const char *end = data + size;
+	const char *colon = memchr(data, ':', size);
+	const char *name_end = colon;
+	while (name_end > data && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+		--name_end;
+	for (const char *s = data; s < name_end; ++s)
+		*p++ = tolower((unsigned char)*s);
+	*p++ = ':';
+	bool wsp = false;
+	bool value = false;
+	for (const char *s = colon + 1; s < end; ++s) {
+		switch (*s) {
+		case '\r':
+		case '\n':
+			break;
+		case ' ':
+		case '\t':
+			wsp = true;
+			break;
+		default:
+			if (wsp && value)
+				*p++ = ' ';
+			wsp = false;
+			value = true;
+			*p++ = *s;
+		}
+	}
+	b->size = p - b->data;
+	return 0;
+}
+
+/**
+ * Copy the header of the message, which precedes the body, into
+ * the buffer.
+ */
+static int
+smtpc_dkim_copy_header(const struct smtpc_mime *mime,
+		       struct smtpc_dkim_buf *b)
+{
+	struct smtpc_dkim_pos pos;
+	if (smtpc_dkim_find_body(mime, &pos) != 0)
+		return -1;
+	for (int i = 0; i <= pos.seg; ++i) {
+		const struct smtpc_mime_seg *seg = &mime->segs[i];
+		size_t size = i == pos.seg ? pos.offset : seg->size;
+		if (smtpc_dkim_buf_append(b, smtpc_mime_seg_data(mime, seg),
+					  size) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Append the signed header fields in the canonical form to the
+ * data to sign and their names to the h= tag. Several instances
+ * of a field are signed from the last one (RFC 6376, 5.4.2).
+ */
+static int
+smtpc_dkim_sign_fields(const struct smtpc_dkim_field *fields, int count,
+		       struct smtpc_dkim_buf *data, struct smtpc_dkim_buf *h)
+{
+	size_t names = sizeof(smtpc_dkim_signed_headers) /
+		       sizeof(smtpc_dkim_signed_headers[0]);
+	for (size_t i = 0; i < names; ++i) {
+		const char *name = smtpc_dkim_signed_headers[i];
+		size_t name_len = strlen(name);
+		for (int j = count - 1; j >= 0; --j) {
+			const struct smtpc_dkim_field *f = &fields[j];
+			if (f->name_len != name_len ||
+			    strncasecmp(f->data, name, name_len) != 0)
+				continue;
+			if ((h->size > 0 &&
+			     smtpc_dkim_buf_append(h, ":", 1) != 0) ||
+			    smtpc_dkim_buf_append(h, name, name_len) != 0 ||
+			    smtpc_dkim_canon_header(data, f->data,
+						    f->size) != 0 ||
+			    smtpc_dkim_buf_append(data, "\r\n", 2) != 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/** The maximum size of a signature, of an 8192 bit key. */
+#define SMTPC_DKIM_SIGNATURE_MAX 1024
+
+/**
+ * Append the base64 encoded signature to the header. The encoded
+ * lines are folded.
+ */
+static int
+smtpc_dkim_append_signature(struct smtpc_dkim_buf *header,
+			    const unsigned char *signature, size_t size)
+{
+	char encoded[SMTPC_DKIM_SIGNATURE_MAX * 2];
+	size_t len = smtpc_base64_encode((const char *)signature, size,
+					 encoded);
+	char *p = smtpc_dkim_buf_reserve(header, len + len / 2 + 2);
+	if (p == NULL)
+		return -1;
+	for (size_t i = 0; i < len; ++i) {
+		*p++ = encoded[i];
+		if (encoded[i] == '\n')
+			*p++ = '\t';
+	}
+	*p++ = '\r';
+	*p++ = '\n';
+	header->size = p - header->data;
+	return 0;
+}
+
+int
+smtpc_dkim_sign(const struct smtpc_dkim_key *key, const char *domain,
+		const char *selector, struct smtpc_mime *mime,
+		const unsigned char body_hash[SMTPC_DKIM_HASH_SIZE])
+{
+	struct smtpc_dkim_buf header = {NULL, 0, 0};
+	struct smtpc_dkim_buf data = {NULL, 0, 0};
+	struct smtpc_dkim_buf h = {NULL, 0, 0};
+	struct smtpc_dkim_field *fields = NULL;
+	void *ctx = NULL;
+	int rc = -1;
+
+	if (smtpc_dkim_copy_header(mime, &header) != 0)
+		goto out;
+	int count = smtpc_dkim_parse_header(header.data, header.size,
+					    &fields);
+	if (count < 0 ||
+	    smtpc_dkim_sign_fields(fields, count, &data, &h) != 0)
+		goto out;
+
+	char bh[SMTPC_DKIM_HASH_SIZE * 2];
+	size_t bh_len = smtpc_base64_encode((const char *)body_hash,
+					    SMTPC_DKIM_HASH_SIZE, bh);
+	/* The buffer of the message header is reused. */
+	header.size = 0;
+	if (smtpc_dkim_buf_printf(&header,
+				  "DKIM-Signature: v=1; a=rsa-sha256; "
+				  "c=relaxed/relaxed; d=%s; s=%s;\r\n"
+				  "\tt=%lld; h=%.*s;\r\n"
+				  "\tbh=%.*s;\r\n"
+				  "\tb=", domain, selector,
+				  (long long)fiber_time(), (int)h.size, h.data,
+				  (int)bh_len, bh) != 0 ||
+	    smtpc_dkim_canon_header(&data, header.data, header.size) != 0)
+		goto out;
+
+	unsigned char signature[SMTPC_DKIM_SIGNATURE_MAX];
+	size_t signature_size = sizeof(signature);
+	ctx = crypto.EVP_MD_CTX_new();
+	if (ctx == NULL ||
+	    crypto.EVP_DigestSignInit(ctx, NULL, crypto.EVP_sha256(), NULL,
+				      key->pkey) != 1 ||
+	    crypto.EVP_DigestSign(ctx, signature, &signature_size,
+				  (const unsigned char *)data.data,
+				  data.size) != 1) {
+		box_error_set(__FILE__, __LINE__, ER_SYSTEM,
+			      "Can't sign the message by DKIM key");
+		goto out;
+	}
+	if (smtpc_dkim_append_signature(&header, signature,
+					signature_size) != 0 ||
+	    smtpc_mime_prepend(mime, header.data, header.size) != 0)
+		goto out;
+	rc = 0;
+out:
+	if (ctx != NULL)
+		crypto.EVP_MD_CTX_free(ctx);
+	free(fields);
+	free(h.data);
+	free(data.data);
+	free(header.data);
+	return rc;
+}
+
+/* Signature }}} */
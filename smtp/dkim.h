@@ -0,0 +1,117 @@
+#ifndef TARANTOOL_SMTP_DKIM_H_INCLUDED
+#define TARANTOOL_SMTP_DKIM_H_INCLUDED 1
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+
+/**
+ * DKIM signing (RFC 6376): rsa-sha256 with relaxed/relaxed
+ * canonicalization.
+ *
+ * libcrypto is loaded at the first use: the functions exported
+ * by tarantool are used if there are all of them, the system
+ * library otherwise, so the module does not depend on OpenSSL
+ * at build time.
+ */
+
+struct smtpc_mime;
+
+/** Size of a SHA-256 hash. */
+#define SMTPC_DKIM_HASH_SIZE 32
+
+/**
+ * A parsed private key.
+ */
+struct smtpc_dkim_key {
+	/** PEM text of the key to find a parsed key by. */
+	char *pem;
+	size_t pem_size;
+	/** libcrypto key, EVP_PKEY. */
+	void *pkey;
+	/** Next key in the cache of the environment. */
+	struct smtpc_dkim_key *next;
+};
+
+/**
+ * Parse a PEM encoded RSA private key.
+ * @retval key on success
+ * @retval NULL on error, check diag
+ */
+struct smtpc_dkim_key *
+smtpc_dkim_key_new(const char *pem, size_t pem_size);
+
+/**
+ * Free the key.
+ */
+void
+smtpc_dkim_key_delete(struct smtpc_dkim_key *key);
+
+/**
+ * Check the signing domain and selector: they must be valid tag
+ * values of the signature header.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_dkim_check(const char *domain, const char *selector);
+
+/**
+ * Hash the relaxed canonical body of a composed message. Files
+ * are read once for that, the function yields then; a streamed
+ * body can't be signed.
+ * @param mime message
+ * @param[out] hash the body hash
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_dkim_body_hash(const struct smtpc_mime *mime,
+		     unsigned char hash[SMTPC_DKIM_HASH_SIZE]);
+
+/**
+ * Sign the message and prepend the DKIM-Signature header to it.
+ * The function does not yield.
+ * @param key private key
+ * @param domain signing domain (d=)
+ * @param selector selector (s=)
+ * @param mime message
+ * @param body_hash hash from smtpc_dkim_body_hash()
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_dkim_sign(const struct smtpc_dkim_key *key, const char *domain,
+		const char *selector, struct smtpc_mime *mime,
+		const unsigned char body_hash[SMTPC_DKIM_HASH_SIZE]);
+
+#endif /* TARANTOOL_SMTP_DKIM_H_INCLUDED */
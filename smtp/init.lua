@@ -30,16 +30,69 @@
 --
 
 local driver = require('smtp.lib')
+local spool = require('smtp.spool')
 local digest = require('digest')
+local fiber = require('fiber')
 
 local curl_mt
 
+local function check_dkim(dkim, method)
+    if type(dkim) ~= 'table' or type(dkim.domain) ~= 'string' or
+            type(dkim.selector) ~= 'string' or type(dkim.key) ~= 'string' then
+        error(method .. ': dkim must be a table with domain, selector ' ..
+              'and key strings')
+    end
+end
+
 --
 --  <smtp> - create a new curl instance.
 --
 --  Parameters:
 --
---  max_connections -  Maximum number of entries in the connection cache */
+--  max_connections - Maximum number of idle connections kept for reuse by
+--      subsequent requests with the same URL, credentials and TLS settings
+--      (defaults to 5)
+--
+--  max_inflight - Maximum number of requests in progress, the others wait
+--      for a free slot in the arrival order at most the request timeout
+--      (defaults to unlimited)
+--
+--  queue_size - Maximum number of requests waiting for a free slot, the
+--      others fail at once with "SMTP send queue is full" (defaults to
+--      unlimited)
+--
+--  relay_rate - Maximum number of requests per second to one relay URL,
+--      a request exceeding it is delayed before connecting (defaults to
+--      unlimited)
+--
+--  relay_burst - Number of requests, which may be sent to one relay at
+--      once (defaults to relay_rate, at least 1)
+--
+--  domain_rate, domain_burst - the same for one recipient domain; a
+--      request waits for the limits of all domains of its recipients
+--
+--  ca_file, ca_path - a CA bundle and a CA directory for the requests,
+--      which don't set their own; the parsed CA store is cached by the
+--      client (requires libcurl 7.87.0+), see reload_tls()
+--
+--  relays - an array of relay URLs or tables {url = URL, weight = NUMBER}
+--      (the weight defaults to 1); requests with url = nil are spread over
+--      the relays by their weights, which are lowered for slow and failing
+--      relays; a request without a reply or with a 4xx one is sent again
+--      to another relay if the body is a string
+--
+--  eject_failures - Number of failed requests in a row (no reply or a 421
+--      one), which ejects a relay; requests to an ejected relay fail at
+--      once (defaults to 5 with relays and to never without them)
+--
+--  eject_time - For how long a relay is ejected, in seconds (defaults to
+--      30); after that the relay is tried again and ejected by the first
+--      failure
+--
+--  dkim - a table {domain = STRING, selector = STRING, key = STRING} to
+--      sign the messages by DKIM (rsa-sha256, relaxed/relaxed), where key
+--      is a PEM encoded RSA private key; the key is parsed once and kept
+--      by the client; a request may set its own dkim option
 --
 --  Returns:
 --  curl object or raise error()
@@ -51,8 +104,40 @@ local smtp_new = function(opts)
 
     opts.max_connections = opts.max_connections or 5
 
-    local curl = driver.new(opts.max_connections)
-    return setmetatable({ curl = curl, }, curl_mt )
+    local curl = driver.new(opts.max_connections, opts.max_inflight,
+                            opts.queue_size)
+    if opts.relay_rate or opts.domain_rate then
+        curl:set_rate_limit(opts.relay_rate, opts.relay_burst,
+                            opts.domain_rate, opts.domain_burst)
+    end
+    if opts.ca_file or opts.ca_path then
+        curl:set_ca(opts.ca_file, opts.ca_path)
+    end
+    local relays
+    if opts.relays ~= nil then
+        if type(opts.relays) ~= 'table' or #opts.relays == 0 then
+            error('smtp.new: relays must be a non-empty array')
+        end
+        local weights = {}
+        relays = {}
+        for i, relay in ipairs(opts.relays) do
+            if type(relay) == 'table' then
+                relays[i], weights[i] = relay.url, relay.weight or 1
+            else
+                relays[i], weights[i] = relay, 1
+            end
+        end
+        curl:set_relays(relays, weights)
+    end
+    local eject_failures = opts.eject_failures or (relays and 5)
+    if eject_failures then
+        curl:set_breaker(eject_failures, opts.eject_time or 30)
+    end
+    if opts.dkim ~= nil then
+        check_dkim(opts.dkim, 'smtp.new')
+    end
+    return setmetatable({ curl = curl, relays = relays, dkim = opts.dkim },
+                        curl_mt)
 end
 
 --
@@ -60,10 +145,15 @@ end
 --
 --  Parameters:
 --
---  url     - smtp url, like smtps://imap.tarantool.org
+--  url     - smtp url, like smtps://imap.tarantool.org, or nil to choose
+--            one of the relays of the client
 --  from    - email sender
 --  to      - email recipients
---  body    - this parameter is optional, you may use it for passing
+--  body    - a string or a source of body chunks: a function returning the
+--      next chunk or nil at the end, an iterator (e.g. fun.iter(...) or
+--      {gen, param, state}) or a fiber.channel (the body ends when it is
+--      closed); chunks are sent as they are produced, so the whole body
+--      never has to be kept in memory
 --  options - this is a table of options.
 --      cc - a string or a list to send email copy;
 --
@@ -97,7 +187,18 @@ end
 --
 --      timeout - Time-out the read operation and
 --          waiting for the curl api request
---          after this amount of seconds;
+--          after this amount of seconds (fractions are honoured up to a
+--          millisecond, no timeout by default or if 0);
+--
+--      connect_timeout - Time-out connecting to the server, including
+--          name resolution and TLS handshake, after this amount of seconds;
+--
+--      low_speed_limit, low_speed_time - abort the request if it is
+--          slower than low_speed_limit bytes per second for low_speed_time
+--          seconds;
+--
+--      deadline - an absolute time (see fiber.time()) the request must be
+--          finished by, including waiting for a rate limit or a free slot;
 --
 --      verbose - set on/off verbose mode;
 --
@@ -105,19 +206,50 @@ end
 --
 --      password - a password for server authorization;
 --
+--      max_recipients - the maximum number of recipients of one SMTP
+--          transaction; a longer list is split into chunks grouped by the
+--          recipient domain, which are sent by up to 4 concurrent
+--          sessions (the body must be a string then);
+--
+--      dkim - a table {domain = STRING, selector = STRING, key = STRING}
+--          to sign the message by DKIM instead of the one of the client;
+--          the body must not be streamed, attached files are read once
+--          more to hash them;
+--
+--      engine - an SMTP protocol engine: 'curl' (default) or 'native', a
+--          built-in one, which pipelines the commands (PIPELINING) and
+--          sends the body by BDAT chunks (CHUNKING) when the server
+--          supports them; it supports smtp:// URLs without TLS only, a
+--          connection is reused by the messages of a batch only,
+--          verbose and low_speed_* are ignored; request_async() does
+--          not support it;
+--
 --      attachments - a table with array of attachments
 --
 --          body - attachment body
 --
+--          path - a path to a file to attach instead of body, the file is
+--              read and encoded by chunks while the message is sent
+--
 --          content_type - set a content type (part of a Content-Type header,
 --              defaults to 'text/plain'), MIME type according to RFC2045
 --
 --          charset - set a charset (part of a Content-Type header, defaults to
 --          'UTF-8')
 --
---          filename - a string with filename will be shown in e-mail
+--          filename - a string with filename will be shown in e-mail,
+--              defaults to the base name of path
 --
 --          base64_encode - a boolean to base64 encode attachment content or not, defaults to true
+--              unless transfer_encoding is set
+--
+--      transfer_encoding - 'auto' to choose the Content-Transfer-Encoding
+--          of the body and of the attachments without base64_encode by
+--          their content: 7bit text with CRLF line breaks is sent as is,
+--          otherwise the shorter of quoted-printable (text only, a bare
+--          LF becomes CRLF) and base64 is used; files are
+--          base64 encoded and a streamed body is sent as is; 'auto_8bit'
+--          sends 8bit text as is as well, the relay must support 8BITMIME
 --
 --
 --  Returns:
@@ -125,10 +257,109 @@ end
 --          status=NUMBER,
 --          reason=ERRMSG
 --      }
+--      With max_recipients the status and the reason are the ones of the
+--      first failed chunk or of the first chunk if all of them have been
+--      sent; the response also has:
+--          recipients={ [ADDRESS]={status=NUMBER, reason=ERRMSG}, ... }
+--      A chunk, which has raised an error, gets the status -1 and the
+--      error as the reason; if no chunk has got a reply, the error is
+--      raised.
+--
+--  Raises error() on invalid arguments and OOM
+--
+
+--
+--  <request_async> This function starts an SMTP request and returns
+--      without waiting for it (though it waits for a free slot if
+--      max_inflight requests are in progress)
+--
+--  Parameters: the same as request(), the body must be a string.
+--      options.channel - a fiber.channel, the request handle is put to it
+--          when the request is finished
+--
+--  Returns a request handle:
+--      handle:wait([timeout]) - wait until the request is finished, returns
+--          false on timeout
+--      handle:cancel() - stop the request, its status is -1 then; returns
+--          false if the request is already finished
+--      handle:result() - the request() result or nil if the request is in
+--          progress; raises error() if the request has failed
 --
 --  Raises error() on invalid arguments and OOM
 --
 
+--
+--  <send_batch> This function sends several messages to one SMTP server
+--      over one connection
+--
+--  Parameters:
+--
+--  url      - smtp url, like smtps://imap.tarantool.org
+--  messages - an array of messages, each is a table with fields:
+--      from - email sender;
+--
+--      to - email recipients;
+--
+--      body - message body;
+--
+--      cc, bcc, subject, content_type, charset, headers, attachments,
+--          transfer_encoding, dkim - the same as request() options.
+--
+--  options - a table of options: ca_path, ca_file, verify_host,
+--      verify_peer, ssl_key, ssl_cert, use_ssl, timeout, verbose, username,
+--      password, dkim, see request(). The timeout is applied to each
+--      message.
+--
+--  Returns an array with a result for each message:
+--      {
+--          {
+--              status=NUMBER,
+--              reason=ERRMSG
+--          },
+--          ...
+--      }
+--      A message, which fails with an error, gets status -1 and the
+--      error message as the reason, the rest of the batch is sent.
+--
+--  Raises error() on invalid arguments, OOM while composing the messages
+--  and when the fiber is cancelled
+--
+
+--
+--  <send_merge> This function sends a personalized message to each of
+--      the recipients: {{name}} placeholders in the subject, the headers
+--      and the body are replaced with the values of the recipient; the
+--      message is composed and attachments are encoded once
+--
+--  Parameters:
+--
+--  url        - smtp url, like smtps://imap.tarantool.org, or nil to choose
+--      one of the relays of the client
+--  from       - email sender
+--  body       - message body template, a string
+--  recipients - an array of tables with the variables of each recipient,
+--      `to` is the recipient address and is put to the To header, e.g.
+--      {to = 'a@example.org', name = 'Alice'}; numbers are converted to
+--      strings in place
+--  options    - subject, content_type, charset, headers, attachments, dkim,
+--      transfer_encoding (it is applied to the attachments only) and the
+--      connection options, see request(); each message is signed
+--      by DKIM after the placeholders are replaced; cc and bcc are not
+--      supported. Placeholders in a subject with non-ASCII characters are
+--      not replaced: such a subject is encoded
+--
+--  The messages are sent by batches over one connection, like
+--  send_batch() does. A value put to a header must not contain line
+--  breaks, and every placeholder must have a value.
+--
+--  Returns an array with a result for each recipient, see send_batch().
+--
+--  Raises error() on invalid arguments and OOM
+--
+
+-- The number of merged messages kept in memory at once.
+local MERGE_BATCH = 100
+
 local function add_recipients(list, recipients)
     if recipients == nil then
         return ''
@@ -172,6 +403,319 @@ local function encode_subject(subj)
     return subj
 end
 
+local channel_mt = getmetatable(fiber.channel(0))
+
+-- Make a reader function from a body source: a function, an iterator
+-- (a table with gen, param and state fields, e.g. made by fun.iter(), or
+-- an array {gen, param, state}) or a fiber.channel. The reader returns
+-- the next chunk of the body or nil at the end.
+local function body_reader(source)
+    if type(source) == 'function' then
+        return source
+    end
+    if getmetatable(source) == channel_mt then
+        return function()
+            return source:get()
+        end
+    end
+    if type(source) == 'table' then
+        local gen, param, state = source.gen, source.param, source.state
+        if gen == nil then
+            gen, param, state = source[1], source[2], source[3]
+        end
+        if type(gen) ~= 'function' then
+            return nil
+        end
+        -- The initial state may be nil, e.g. of pairs(), the end is
+        -- the nil state returned by gen.
+        local finished = false
+        return function()
+            if finished then
+                return nil
+            end
+            local chunk
+            state, chunk = gen(param, state)
+            if state == nil then
+                finished = true
+                return nil
+            end
+            return chunk
+        end
+    end
+    return nil
+end
+
+-- Build a message and the envelope (sender and recipient addresses) from
+-- request() arguments.
+--
+-- The message is composed by the driver: headers, multipart boundaries
+-- and base64 encoded attachments are written into one buffer, while the
+-- body and the other attachments are referenced without copying. If the
+-- body is a source of chunks (see body_reader()), it is streamed by the
+-- reader. The body of a template (see send_merge()) is not encoded to keep
+-- its placeholders.
+local function compose(from, to, body, opts, template)
+    local recipients = {}
+    local parts = {
+        from = from,
+        to = add_recipients(recipients, to),
+        content_type = opts.content_type,
+        charset = opts.charset,
+        transfer_encoding = opts.transfer_encoding,
+        template = template,
+    }
+    if opts.cc then
+        parts.cc = add_recipients(recipients, opts.cc)
+    end
+    if opts.subject then
+        parts.subject = encode_subject(opts.subject)
+    end
+    add_recipients(recipients, opts.bcc)
+    if opts.headers and #opts.headers > 0 then
+        parts.headers = {}
+        for i, header in ipairs(opts.headers) do
+            parts.headers[i] = header
+        end
+    end
+
+    -- multipart content according to https://tools.ietf.org/html/rfc1341
+    if opts.attachments and #opts.attachments > 0 then
+        parts.attachments = {}
+        for i, attachment in ipairs(opts.attachments) do
+            local base64 = attachment.base64_encode
+            local auto_encoding = opts.transfer_encoding ~= nil and
+                                  base64 == nil
+            if base64 == nil then
+                base64 = true
+            end
+            parts.attachments[i] = {
+                body = attachment.body,
+                path = attachment.path,
+                content_type = attachment.content_type,
+                charset = attachment.charset,
+                filename = attachment.filename or
+                           attachment.path and attachment.path:match('[^/]*$'),
+                base64 = base64,
+                auto_encoding = auto_encoding,
+            }
+        end
+    end
+
+    local reader
+    if type(body) == 'string' or type(body) == 'number' then
+        parts.body = body
+    else
+        reader = body_reader(body)
+        if reader == nil then
+            error('body must be a string, a function, an iterator or ' ..
+                  'a fiber.channel')
+        end
+    end
+    local message = driver.message(parts, reader)
+
+    local from_addr = addr_spec(from)
+    local recipients_addr = {}
+    for _, recipient in ipairs(recipients) do
+        recipients_addr[#recipients_addr + 1] = addr_spec(recipient)
+    end
+    return message, from_addr, recipients_addr
+end
+
+-- Sign a composed message by the DKIM key of the request or of the
+-- client.
+local function sign(self, message, dkim, method)
+    dkim = dkim or self.dkim
+    if dkim == nil then
+        return
+    end
+    check_dkim(dkim, method)
+    self.curl:dkim_sign(message, dkim.domain, dkim.selector, dkim.key)
+end
+
+-- Choose a relay of the client if the url is not given.
+local function relay_url(self, url, method)
+    if url ~= nil then
+        return url
+    end
+    if self.relays == nil then
+        error(method .. ': url is required for a client without relays')
+    end
+    return self.relays[self.curl:pick_relay()]
+end
+
+-- Whether another relay may take the message. Any 4xx is, though
+-- only a request without a reply or with 421 counts against the
+-- health of the relay (see smtpc_health_update()).
+local function relay_failed(resp)
+    return resp.status < 200 or (resp.status >= 400 and resp.status < 500)
+end
+
+-- Send the request to the relays of the client, until one of them
+-- takes the message or all of them have failed it. The ejected
+-- relays are not retried. Return the last response or raise the
+-- last error if no relay has replied.
+local function failover(self, from, recipients, message, opts)
+    local tried = {}
+    local resp, err
+    for _ = 1, #self.relays do
+        local i = self.curl:pick_relay(tried, next(tried) ~= nil)
+        if i == nil then
+            break
+        end
+        tried[i] = true
+        local ok, r = pcall(self.curl.request, self.curl, self.relays[i],
+                            from, recipients, message, opts)
+        if ok then
+            resp = r
+            if not relay_failed(resp) then
+                break
+            end
+        else
+            err = r
+            fiber.testcancel()
+        end
+    end
+    if resp == nil then
+        error(err)
+    end
+    return resp
+end
+
+-- Send the composed message to the given relay or to the relays
+-- of the client.
+local function send(self, url, from, recipients, message, opts, retry)
+    if url == nil and retry then
+        return failover(self, from, recipients, message, opts)
+    end
+    url = relay_url(self, url, 'request')
+    return self.curl:request(url, from, recipients, message, opts)
+end
+
+-- Split the recipients into chunks of at most max recipients: the
+-- recipients of one domain are put to as few chunks as possible.
+local function chunk_recipients(recipients, max)
+    local domains = {}
+    local order = {}
+    for _, rcpt in ipairs(recipients) do
+        local domain = (rcpt:match('@([^@]*)$') or ''):lower()
+        if domains[domain] == nil then
+            domains[domain] = {}
+            order[#order + 1] = domain
+        end
+        table.insert(domains[domain], rcpt)
+    end
+    local chunks = {}
+    local chunk = {}
+    for _, domain in ipairs(order) do
+        local list = domains[domain]
+        -- Don't split a domain, which fits a chunk.
+        if #chunk > 0 and #chunk + #list > max and #list <= max then
+            chunks[#chunks + 1] = chunk
+            chunk = {}
+        end
+        for _, rcpt in ipairs(list) do
+            if #chunk == max then
+                chunks[#chunks + 1] = chunk
+                chunk = {}
+            end
+            chunk[#chunk + 1] = rcpt
+        end
+    end
+    if #chunk > 0 then
+        chunks[#chunks + 1] = chunk
+    end
+    return chunks
+end
+
+-- The maximum number of chunks of recipients sent concurrently.
+local FAN_OUT_WORKERS = 4
+
+-- Send the message to the chunks of the recipients by a few
+-- concurrent workers and merge the responses. An error of a chunk
+-- is raised if no chunk has got a reply, otherwise it is reported
+-- as the status -1 of the chunk.
+local function fan_out(self, url, from, recipients, message, opts)
+    local chunks = chunk_recipients(recipients, opts.max_recipients)
+    local responses = {}
+    local errors = {}
+    local next_chunk = 0
+    local count = math.min(FAN_OUT_WORKERS, #chunks)
+    local done = fiber.channel(count)
+    local function worker()
+        while next_chunk < #chunks do
+            next_chunk = next_chunk + 1
+            local i = next_chunk
+            local ok, resp = pcall(send, self, url, from, chunks[i],
+                                   message, opts, true)
+            fiber.testcancel()
+            if ok then
+                responses[i] = resp
+            else
+                errors[i] = resp
+            end
+        end
+        done:put(true)
+    end
+    local workers = {}
+    for i = 1, count do
+        workers[i] = fiber.new(worker)
+        workers[i]:set_joinable(true)
+    end
+    for _ = 1, count do
+        -- fiber:join() can't be cancelled, a channel can.
+        if done:get() == nil then
+            for _, f in ipairs(workers) do
+                if f:status() ~= 'dead' then
+                    f:cancel()
+                end
+            end
+            for _, f in ipairs(workers) do
+                f:join()
+            end
+            fiber.testcancel()
+        end
+    end
+    for _, f in ipairs(workers) do
+        f:join()
+    end
+    local result = {recipients = {}}
+    local replied = false
+    local first_error
+    for i, chunk in ipairs(chunks) do
+        local resp = responses[i]
+        if resp == nil then
+            first_error = first_error or errors[i]
+            resp = {status = -1, reason = tostring(errors[i])}
+        elseif resp.status > 0 then
+            replied = true
+        end
+        if result.status == nil or (result.status >= 200 and
+                                    result.status < 300) then
+            result.status, result.reason = resp.status, resp.reason
+        end
+        for _, rcpt in ipairs(chunk) do
+            result.recipients[rcpt] = {status = resp.status,
+                                       reason = resp.reason}
+        end
+    end
+    if first_error ~= nil and not replied then
+        error(first_error)
+    end
+    return result
+end
+
+-- Put finished asynchronous requests to their completion channels.
+local function dispatch(self)
+    while true do
+        local handle, channel = self.curl:next_completed()
+        if handle == nil then
+            break
+        end
+        channel:put(handle)
+    end
+    self.dispatcher = nil
+end
+
 curl_mt = {
     __index = {
         --
@@ -180,76 +724,131 @@ curl_mt = {
         request = function(self, url, from, to, body, opts)
             opts = opts or {}
             to = to or {}
-            if not body or not url or not from then
+            if not body or not from or (not url and not self.relays) then
                 error('request(url, from, to, body [, options]])')
             end
-            local header
-            local recipients = {}
-            header = 'From: ' .. from .. '\r\n' ..
-                     'To: ' .. add_recipients(recipients, to) .. '\r\n'
-            if opts.cc then
-                header = header .. 'Cc: ' .. add_recipients(recipients, opts.cc) .. '\r\n'
+            if opts.max_recipients ~= nil and
+                    (type(opts.max_recipients) ~= 'number' or
+                     opts.max_recipients < 1) then
+                error('request: max_recipients must be a positive number')
+            end
+            local from_addr, recipients_addr, message
+            message, from_addr, recipients_addr = compose(from, to, body, opts)
+            sign(self, message, opts.dkim, 'request')
+            -- A streamed body can't be sent again.
+            local reusable = type(body) == 'string' or type(body) == 'number'
+            if opts.max_recipients ~= nil and
+                    #recipients_addr > opts.max_recipients then
+                if not reusable then
+                    error('request: body must be a string to split ' ..
+                          'recipients')
+                end
+                return fan_out(self, url, from_addr, recipients_addr,
+                               message, opts)
+            end
+            return send(self, url, from_addr, recipients_addr, message,
+                        opts, reusable)
+        end,
+
+        --
+        --  <request_async> see above <request_async>
+        --
+        request_async = function(self, url, from, to, body, opts)
+            opts = opts or {}
+            to = to or {}
+            if not body or not from or (not url and not self.relays) then
+                error('request_async(url, from, to, body [, options]])')
+            end
+            url = relay_url(self, url, 'request_async')
+            if type(body) ~= 'string' and type(body) ~= 'number' then
+                error('request_async: body must be a string')
             end
-            if opts.subject then
-                header = header .. 'Subject: ' .. encode_subject(opts.subject) .. '\r\n'
+            local channel = opts.channel
+            if channel ~= nil and getmetatable(channel) ~= channel_mt then
+                error('request_async: channel must be a fiber.channel')
             end
-            add_recipients(recipients, opts.bcc)
-            if opts.headers and #opts.headers > 0 then
-                header = header .. table.concat(opts.headers, '\r\n') .. '\r\n'
+            local from_addr, recipients_addr
+            body, from_addr, recipients_addr = compose(from, to, body, opts)
+            sign(self, body, opts.dkim, 'request_async')
+            local handle = self.curl:request_async(url, from_addr,
+                recipients_addr, body, opts, channel)
+            if channel ~= nil and self.dispatcher == nil then
+                self.dispatcher = fiber.new(dispatch, self)
+                self.dispatcher:name('smtp.dispatcher')
             end
-            local content_type = 'Content-Type: ' .. (opts.content_type or 'text/plain') ..
-            '; charset=' .. (opts.charset or  'UTF-8') ..';\r\n'
+            return handle
+        end,
 
-            if not opts.attachments or #opts.attachments == 0 then
-                body = header .. content_type ..'\r\n' .. body
-            else
-                -- multipart content according to https://tools.ietf.org/html/rfc1341
-                local MULTIPART_CONTENT_TYPE = 'Content-Type: multipart/mixed; boundary=MULTIPART-MIXED-BOUNDARY;\r\n'
-                local MULTIPART_SEPARATOR = '\r\n--MULTIPART-MIXED-BOUNDARY\r\n'
-                local MULTIPART_END = '\r\n--MULTIPART-MIXED-BOUNDARY--\r\n'
-                local attachments = ''
-
-                for _, attachment in ipairs(opts.attachments) do
-                    if attachment.base64_encode == nil then attachment.base64_encode = true end
-                    local attachment_content_type = 'Content-Type: ' ..
-                                         (attachment.content_type or 'text/plain') ..
-                                         '; charset=' ..
-                                         (attachment.charset or  'UTF-8') ..
-                                         ';\r\n'
-                    local content_transfer_encoding = attachment.base64_encode
-                                                      and 'Content-Transfer-Encoding: base64\r\n\r\n'
-                                                      or ''
-                    local content_disposition = 'Content-Disposition: inline; filename="' ..
-                                                attachment.filename ..
-                                                '";\r\n'
-                    local attachment_body = attachment.base64_encode
-                                            and digest.base64_encode(attachment.body)
-                                            or attachment.body
-                    attachments = attachments ..
-                                  MULTIPART_SEPARATOR ..
-                                  attachment_content_type ..
-                                  content_disposition ..
-                                  content_transfer_encoding ..
-                                  attachment_body
+        --
+        --  <send_batch> see above <send_batch>
+        --
+        send_batch = function(self, url, messages, opts)
+            opts = opts or {}
+            if (not url and not self.relays) or type(messages) ~= 'table' then
+                error('send_batch(url, messages [, options]])')
+            end
+            url = relay_url(self, url, 'send_batch')
+            local batch = {}
+            for i, message in ipairs(messages) do
+                if not message.body or not message.from then
+                    error(('send_batch: message #%d must have from and body'):format(i))
                 end
-
-                body = MULTIPART_CONTENT_TYPE ..
-                       header ..
-                       MULTIPART_SEPARATOR ..
-                       content_type ..
-                       '\r\n' ..
-                       body ..
-                       attachments ..
-                       MULTIPART_END
+                if type(message.body) ~= 'string' then
+                    error(('send_batch: message #%d body must be a string'):format(i))
+                end
+                local body, from_addr, recipients_addr = compose(
+                    message.from, message.to or {}, message.body, message)
+                sign(self, body, message.dkim or opts.dkim, 'send_batch')
+                batch[i] = {
+                    from = from_addr,
+                    recipients = recipients_addr,
+                    body = body,
+                }
             end
+            return self.curl:request_batch(url, batch, opts)
+        end,
 
-            local from_addr = addr_spec(from)
-            local recipients_addr = {}
-            for _, recipient in ipairs(recipients) do
-                recipients_addr[#recipients_addr + 1] = addr_spec(recipient)
+        --
+        --  <send_merge> see above <send_merge>
+        --
+        send_merge = function(self, url, from, body, recipients, opts)
+            opts = opts or {}
+            if (not url and not self.relays) or not from or not body or
+                    type(recipients) ~= 'table' then
+                error('send_merge(url, from, body, recipients [, options]])')
+            end
+            if type(body) ~= 'string' and type(body) ~= 'number' then
+                error('send_merge: body must be a string')
+            end
+            if opts.cc or opts.bcc then
+                error('send_merge: cc and bcc are not supported')
             end
-            local resp = self.curl:request(url, from_addr, recipients_addr, body, opts or {})
-            return resp
+            local message, from_addr = compose(from, '{{to}}', body, opts,
+                                              true)
+            local template = driver.message_template(message)
+            url = relay_url(self, url, 'send_merge')
+            local results = {}
+            for first = 1, #recipients, MERGE_BATCH do
+                local batch = {}
+                local last = math.min(first + MERGE_BATCH - 1, #recipients)
+                for i = first, last do
+                    local vars = recipients[i]
+                    if type(vars) ~= 'table' or type(vars.to) ~= 'string' then
+                        error(('send_merge: recipient #%d must have to'):format(i))
+                    end
+                    local message = driver.message_render(template, vars)
+                    sign(self, message, opts.dkim, 'send_merge')
+                    batch[#batch + 1] = {
+                        from = from_addr,
+                        recipients = {addr_spec(vars.to)},
+                        body = message,
+                    }
+                end
+                for _, r in ipairs(self.curl:request_batch(url, batch, opts)) do
+                    results[#results + 1] = r
+                end
+            end
+            return results
         end,
 
         --
@@ -264,6 +863,29 @@ curl_mt = {
         --  failed_requests - this is a total number of requests which have
         --      failed (included system errors, curl errors, SMTP
         --      errors and so on)
+        --
+        --  queued_requests - this is a number of requests waiting for a free
+        --      slot (see max_inflight)
+        --
+        --  rejected_requests - this is a total number of requests rejected
+        --      because the wait queue was full (see queue_size)
+        --
+        --  throttled_requests - this is a total number of requests delayed
+        --      by a rate limit (see relay_rate and domain_rate)
+        --
+        --  latency - durations of request phases: dns, connect, tls (only
+        --      for requests that open a new connection), first_byte (the
+        --      first server reply after connecting) and total; each is a
+        --      table {count = <...>, p50 = <...>, p90 = <...>, p99 = <...>}
+        --      with percentiles in seconds
+        --
+        --  destinations - statistics by relay URL: {[url] = {requests = <...>,
+        --      status = {['2xx'] = <...>, ['3xx'] = <...>, ['4xx'] = <...>,
+        --      ['5xx'] = <...>}, errors = {timeout = <...>, resolve = <...>,
+        --      connect = <...>, ssl = <...>, send_recv = <...>,
+        --      no_response = <...>, aborted = <...>, other = <...>}}}, where
+        --      status counts requests by the SMTP reply class and errors
+        --      counts requests failed without a reply
         --  }
         --  or error()
         --
@@ -271,6 +893,30 @@ curl_mt = {
             return self.curl:stat()
         end,
 
+        --
+        --  <reload_tls> - drop the cached CA store, so the CA bundle is
+        --      read again by the next connection (within a second).
+        --
+        reload_tls = function(self)
+            self.curl:reload_tls()
+        end,
+
+        --
+        --  <spool> - create an outbound spool sending messages with retries,
+        --      see smtp/spool.lua.
+        --
+        spool = function(self, opts)
+            return spool.new(self, function(from, to, body, message_opts)
+                local message, from_addr, recipients_addr =
+                    compose(from, to, body, message_opts)
+                sign(self, message, message_opts.dkim, 'spool')
+                return message, from_addr, recipients_addr
+            end, function(url, from, recipients, text, message_opts)
+                return send(self, url, from, recipients, text, message_opts,
+                            true)
+            end, opts)
+        end,
+
     },
 }
 
@@ -33,12 +33,19 @@
  * Unique name for userdata metatables
  */
 #define DRIVER_LUA_UDATA_NAME	"smtpc"
+#define MESSAGE_LUA_UDATA_NAME	"smtpc.message"
+#define TEMPLATE_LUA_UDATA_NAME	"smtpc.template"
+#define REQUEST_LUA_UDATA_NAME	"smtpc.request"
+
+#include <stdlib.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "module.h"
 #include "smtpc.h"
+#include "mime.h"
 
 /** Internal util functions
  * {{{
@@ -64,84 +71,50 @@ lua_add_key_u64(lua_State *L, const char *key, uint64_t value)
 /** lib Lua API {{{
  */
 
-static int
-luaT_smtpc_request(lua_State *L)
+/**
+ * Apply request options from a table at the given index.
+ *
+ * Return NULL on success, otherwise an error message.
+ */
+static const char *
+luaT_smtpc_request_set_options(lua_State *L, int idx,
+			       struct smtpc_request *req, double *timeout)
 {
-	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
-	if (ctx == NULL)
-		return luaL_error(L, "can't get smtpc environment");
-
-	const char *url = luaL_checkstring(L, 2);
-	const char *from = luaL_checkstring(L, 3);
-
-	struct smtpc_request *req = smtpc_request_new(ctx, url, from);
-	if (req == NULL)
-		return luaT_error(L);
-
-	double timeout = 365 * 24 * 3600;
-
-	if (!lua_istable(L, 4)) {
-		smtpc_request_delete(req);
-		return luaL_error(L, "fifth argument must be a table");
-	}
-	lua_pushnil(L);
-	while (lua_next(L, 4) != 0) {
-		smtpc_add_recipient(req, lua_tostring(L, -1));
-		lua_pop(L, 1);
-	}
-
-	if (lua_isstring(L, 5)) {
-		size_t len = 0;
-		const char *body = lua_tolstring(L, 5, &len);
-		if (len > 0 && smtpc_set_body(req, body, len) != 0) {
-			smtpc_request_delete(req);
-			return luaT_error(L);
-		}
-	} else if (!lua_isnil(L, 5)) {
-		smtpc_request_delete(req);
-		return luaL_error(L, "fourth argument must be a string");
-	}
-
-	if (!lua_istable(L, 6)) {
-		smtpc_request_delete(req);
-		return luaL_error(L, "fifth argument must be a table");
-	}
-
-	lua_getfield(L, 6, "ca_path");
+	lua_getfield(L, idx, "ca_path");
 	if (!lua_isnil(L, -1))
 		smtpc_set_ca_path(req, lua_tostring(L, -1));
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "ca_file");
+	lua_getfield(L, idx, "ca_file");
 	if (!lua_isnil(L, -1))
 		smtpc_set_ca_file(req, lua_tostring(L, -1));
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "verify_host");
+	lua_getfield(L, idx, "verify_host");
 	if (!lua_isnil(L, -1))
 		smtpc_set_verify_host(req, lua_toboolean(L, -1) == 1 ? 2 : 0);
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "verify_peer");
+	lua_getfield(L, idx, "verify_peer");
 	if (!lua_isnil(L, -1))
 		smtpc_set_verify_peer(req, lua_toboolean(L, -1));
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "ssl_key");
+	lua_getfield(L, idx, "ssl_key");
 	if (!lua_isnil(L, -1))
 		smtpc_set_ssl_key(req, lua_tostring(L, -1));
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "ssl_cert");
+	lua_getfield(L, idx, "ssl_cert");
 	if (!lua_isnil(L, -1))
 		smtpc_set_ssl_cert(req, lua_tostring(L, -1));
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "use_ssl");
+	lua_getfield(L, idx, "use_ssl");
 	if (!lua_isnil(L, -1)) {
 		if (!lua_isnumber(L, -1)) {
-			smtpc_request_delete(req);
-			return luaL_error(L, "use_ssl option must be a number");
+			lua_pop(L, 1);
+			return "use_ssl option must be a number";
 		}
 		long use_ssl_in = lua_tonumber(L, -1);
 		long use_ssl_curl = 0;
@@ -159,39 +132,93 @@ luaT_smtpc_request(lua_State *L)
 			use_ssl_curl = CURLUSESSL_ALL;
 			break;
 		default:
-			smtpc_request_delete(req);
-			return luaL_error(
-				L, "use_ssl option must be >= 0 and <= 3");
+			lua_pop(L, 1);
+			return "use_ssl option must be >= 0 and <= 3";
 		}
 		smtpc_set_use_ssl(req, use_ssl_curl);
 	}
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "timeout");
+	lua_getfield(L, idx, "timeout");
 	if (!lua_isnil(L, -1))
-		timeout = lua_tonumber(L, -1);
+		*timeout = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "connect_timeout");
+	if (!lua_isnil(L, -1))
+		smtpc_set_connect_timeout(req, lua_tonumber(L, -1));
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "low_speed_limit");
+	lua_getfield(L, idx, "low_speed_time");
+	if (!lua_isnil(L, -2)) {
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 2);
+			return "low_speed_time option must be set with "
+			       "low_speed_limit";
+		}
+		smtpc_set_low_speed(req, lua_tointeger(L, -2),
+				    lua_tointeger(L, -1));
+	}
+	lua_pop(L, 2);
+
+	lua_getfield(L, idx, "deadline");
+	if (!lua_isnil(L, -1))
+		smtpc_set_deadline(req, lua_tonumber(L, -1));
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "engine");
+	if (!lua_isnil(L, -1)) {
+		const char *engine = lua_tostring(L, -1);
+		if (engine != NULL && strcmp(engine, "curl") == 0) {
+			smtpc_set_engine(req, SMTPC_ENGINE_CURL);
+		} else if (engine != NULL && strcmp(engine, "native") == 0) {
+			smtpc_set_engine(req, SMTPC_ENGINE_NATIVE);
+		} else {
+			lua_pop(L, 1);
+			return "engine option must be 'curl' or 'native'";
+		}
+	}
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "verbose");
+	lua_getfield(L, idx, "verbose");
 	if (!lua_isnil(L, -1) && lua_isboolean(L, -1))
 		smtpc_set_verbose(req, lua_toboolean(L, -1));
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "username");
+	lua_getfield(L, idx, "username");
 	if (!lua_isnil(L, -1))
 		smtpc_set_username(req, lua_tostring(L, -1));
 	lua_pop(L, 1);
 
-	lua_getfield(L, 6, "password");
+	lua_getfield(L, idx, "password");
 	if (!lua_isnil(L, -1))
 		smtpc_set_password(req, lua_tostring(L, -1));
 	lua_pop(L, 1);
 
-	if (smtpc_execute(req, timeout) != 0) {
-		smtpc_request_delete(req);
-		return luaT_error(L);
+	return NULL;
+}
+
+/**
+ * Add recipients from a table at the given index.
+ */
+static void
+luaT_smtpc_request_add_recipients(lua_State *L, int idx,
+				  struct smtpc_request *req)
+{
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		smtpc_add_recipient(req, lua_tostring(L, -1));
+		lua_pop(L, 1);
 	}
+}
 
+/**
+ * Push a {status = <...>, reason = <...>} table.
+ */
+static void
+luaT_smtpc_push_response(lua_State *L, struct smtpc_request *req)
+{
 	lua_newtable(L);
 
 	lua_pushstring(L, "status");
@@ -201,9 +228,823 @@ luaT_smtpc_request(lua_State *L)
 	lua_pushstring(L, "reason");
 	lua_pushstring(L, req->reason);
 	lua_settable(L, -3);
+}
 
-	/* clean up */
+/**
+ * Body of a request made from a Lua string or a Lua reader
+ * function.
+ */
+struct luaT_smtpc_body {
+	lua_State *L;
+	/** Stack index of the reader function. */
+	int reader_idx;
+	/**
+	 * Reference to the string the request refers to: the
+	 * whole body or the current chunk of the reader.
+	 */
+	int ref;
+};
+
+/**
+ * Pin a body string at the given index for the request lifetime:
+ * the request refers to the string memory directly.
+ */
+static int
+luaT_smtpc_request_pin_body(lua_State *L, int idx, struct smtpc_request *req)
+{
+	size_t len = 0;
+	const char *body = lua_tolstring(L, idx, &len);
+	smtpc_set_body(req, body, len);
+	lua_pushvalue(L, idx);
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Body reader that calls a Lua function. The function returns
+ * the next chunk or nil at the end of the body.
+ */
+static int
+luaT_smtpc_read_body(struct smtpc_request *req, void *arg)
+{
+	struct luaT_smtpc_body *body = (struct luaT_smtpc_body *) arg;
+	lua_State *L = body->L;
+
+	luaL_unref(L, LUA_REGISTRYINDEX, body->ref);
+	body->ref = LUA_NOREF;
+	while (true) {
+		lua_pushvalue(L, body->reader_idx);
+		if (lua_pcall(L, 0, 1, 0) != 0) {
+			const char *err = lua_tostring(L, -1);
+			box_error_set(__FILE__, __LINE__, ER_PROC_LUA, "%s",
+				      err != NULL ? err : "body reader failed");
+			lua_pop(L, 1);
+			return -1;
+		}
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			smtpc_set_body(req, NULL, 0);
+			return 0;
+		}
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			lua_pop(L, 1);
+			box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+				      "body reader must return a string or nil");
+			return -1;
+		}
+		/* An empty chunk is not the end of the body. */
+		if (lua_objlen(L, -1) == 0) {
+			lua_pop(L, 1);
+			continue;
+		}
+		body->ref = luaT_smtpc_request_pin_body(L, lua_gettop(L), req);
+		lua_pop(L, 1);
+		return 0;
+	}
+}
+
+/**
+ * Get a composed message at the given index or NULL if the value
+ * is not a message.
+ */
+static struct smtpc_mime *
+luaT_smtpc_tomessage(lua_State *L, int idx)
+{
+	void *p = lua_touserdata(L, idx);
+	if (p == NULL || !lua_getmetatable(L, idx))
+		return NULL;
+	luaL_getmetatable(L, MESSAGE_LUA_UDATA_NAME);
+	bool is_message = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return is_message ? (struct smtpc_mime *) p : NULL;
+}
+
+/**
+ * Set the body of the request from a value at the given index:
+ * a string or a composed message. The reader of a message with a
+ * streamed body is pushed onto the stack and its index is stored
+ * to @a reader_idx, 0 is stored if there is no reader.
+ *
+ * Return a reference pinning the value for the request lifetime
+ * or LUA_NOREF if the value is neither a string nor a message.
+ */
+static int
+luaT_smtpc_request_set_body(lua_State *L, int idx, struct smtpc_request *req,
+			    int *reader_idx)
+{
+	*reader_idx = 0;
+	if (lua_isstring(L, idx))
+		return luaT_smtpc_request_pin_body(L, idx, req);
+	struct smtpc_mime *mime = luaT_smtpc_tomessage(L, idx);
+	if (mime == NULL)
+		return LUA_NOREF;
+	smtpc_set_body_mime(req, mime);
+	if (smtpc_mime_has_stream(mime)) {
+		lua_getfenv(L, idx);
+		lua_rawgeti(L, -1, 2);
+		lua_remove(L, -2);
+		*reader_idx = lua_gettop(L);
+	}
+	lua_pushvalue(L, idx);
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Delete the request and unpin its body.
+ */
+static void
+luaT_smtpc_request_delete(lua_State *L, struct smtpc_request *req,
+			  int body_ref)
+{
 	smtpc_request_delete(req);
+	luaL_unref(L, LUA_REGISTRYINDEX, body_ref);
+}
+
+static int
+luaT_smtpc_request(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	if (ctx == NULL)
+		return luaL_error(L, "can't get smtpc environment");
+
+	const char *url = luaL_checkstring(L, 2);
+	const char *from = luaL_checkstring(L, 3);
+
+	struct smtpc_request *req = smtpc_request_new(ctx, url, from);
+	if (req == NULL)
+		return luaT_error(L);
+
+	double timeout = TIMEOUT_INFINITY;
+
+	if (!lua_istable(L, 4)) {
+		smtpc_request_delete(req);
+		return luaL_error(L, "fifth argument must be a table");
+	}
+	luaT_smtpc_request_add_recipients(L, 4, req);
+
+	/*
+	 * The message reference is kept apart from the body one:
+	 * the latter pins chunks of the reader.
+	 */
+	struct luaT_smtpc_body body = {L, 0, LUA_NOREF};
+	int body_ref = LUA_NOREF;
+	if (lua_isfunction(L, 5)) {
+		body.reader_idx = 5;
+	} else if (!lua_isnil(L, 5)) {
+		body_ref = luaT_smtpc_request_set_body(L, 5, req,
+							  &body.reader_idx);
+		if (body_ref == LUA_NOREF) {
+			smtpc_request_delete(req);
+			return luaL_error(L, "fourth argument must be a string, "
+					  "a message or a function");
+		}
+	}
+	if (body.reader_idx != 0) {
+		if (!lua_isfunction(L, body.reader_idx)) {
+			luaT_smtpc_request_delete(L, req, body_ref);
+			return luaL_error(L, "message body reader must be "
+					  "a function");
+		}
+		smtpc_set_body_reader(req, luaT_smtpc_read_body, &body);
+	}
+
+	if (!lua_istable(L, 6)) {
+		luaT_smtpc_request_delete(L, req, body.ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, body_ref);
+		return luaL_error(L, "fifth argument must be a table");
+	}
+
+	const char *err = luaT_smtpc_request_set_options(L, 6, req, &timeout);
+	if (err != NULL) {
+		luaT_smtpc_request_delete(L, req, body.ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, body_ref);
+		return luaL_error(L, "%s", err);
+	}
+
+	if (smtpc_execute(req, timeout) != 0) {
+		luaT_smtpc_request_delete(L, req, body.ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, body_ref);
+		return luaT_error(L);
+	}
+
+	luaT_smtpc_push_response(L, req);
+
+	/* clean up */
+	luaT_smtpc_request_delete(L, req, body.ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, body_ref);
+	return 1;
+}
+
+/**
+ * Handle of an asynchronous request. The userdata environment
+ * keeps the body, the client and the completion channel.
+ */
+struct luaT_smtpc_async {
+	struct smtpc_request *req;
+	/**
+	 * Reference pinning the handle while the request is in
+	 * progress or waits in the completion queue.
+	 */
+	int ref;
+};
+
+static inline struct luaT_smtpc_async *
+luaT_smtpc_checkasync(lua_State *L)
+{
+	return (struct luaT_smtpc_async *)
+			luaL_checkudata(L, 1, REQUEST_LUA_UDATA_NAME);
+}
+
+/**
+ * Completion callback of an asynchronous request. It is called
+ * by the client fibers, so the main Lua state is used.
+ */
+static void
+luaT_smtpc_async_done(struct smtpc_request *req, void *arg)
+{
+	struct luaT_smtpc_async *async = (struct luaT_smtpc_async *) arg;
+	/* The handle is unpinned when it is taken from the queue. */
+	if (req->notify)
+		return;
+	luaL_unref(luaT_state(), LUA_REGISTRYINDEX, async->ref);
+	async->ref = LUA_NOREF;
+}
+
+/**
+ * request_async(url, from, recipients, body, options[, channel])
+ *
+ * The body is a string or a message without a streamed body. If
+ * the channel is set, the handle is put to the completion queue
+ * of the client, see next_completed().
+ */
+static int
+luaT_smtpc_request_async(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	if (ctx == NULL)
+		return luaL_error(L, "can't get smtpc environment");
+
+	const char *url = luaL_checkstring(L, 2);
+	const char *from = luaL_checkstring(L, 3);
+	luaL_checktype(L, 4, LUA_TTABLE);
+	luaL_checktype(L, 6, LUA_TTABLE);
+	lua_settop(L, 7);
+
+	struct smtpc_mime *mime = luaT_smtpc_tomessage(L, 5);
+	size_t len = 0;
+	const char *body = NULL;
+	if (mime == NULL && lua_isstring(L, 5))
+		body = lua_tolstring(L, 5, &len);
+	if ((mime == NULL && body == NULL) ||
+	    (mime != NULL && smtpc_mime_has_stream(mime)))
+		return luaL_error(L, "asynchronous request body must be "
+				  "a string or a message");
+
+	struct luaT_smtpc_async *async = (struct luaT_smtpc_async *)
+		lua_newuserdata(L, sizeof(*async));
+	async->req = NULL;
+	async->ref = LUA_NOREF;
+	luaL_getmetatable(L, REQUEST_LUA_UDATA_NAME);
+	lua_setmetatable(L, -2);
+	/* Keep the body, the client and the channel. */
+	lua_createtable(L, 3, 0);
+	lua_pushvalue(L, 5);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 2);
+	lua_pushvalue(L, 7);
+	lua_rawseti(L, -2, 3);
+	lua_setfenv(L, -2);
+
+	/* The request is deleted with the handle. */
+	struct smtpc_request *req = smtpc_request_new(ctx, url, from);
+	if (req == NULL)
+		return luaT_error(L);
+	async->req = req;
+	luaT_smtpc_request_add_recipients(L, 4, req);
+	if (mime != NULL)
+		smtpc_set_body_mime(req, mime);
+	else
+		smtpc_set_body(req, body, len);
+
+	double timeout = TIMEOUT_INFINITY;
+	const char *err = luaT_smtpc_request_set_options(L, 6, req, &timeout);
+	if (err != NULL)
+		return luaL_error(L, "%s", err);
+	smtpc_set_notify(req, !lua_isnil(L, 7));
+	if (smtpc_request_start_async(req, timeout, luaT_smtpc_async_done,
+				      async) != 0)
+		return luaT_error(L);
+	lua_pushvalue(L, -1);
+	async->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+/**
+ * wait([timeout]) - wait until the request is finished.
+ * Return false on timeout.
+ */
+static int
+luaT_smtpc_async_wait(lua_State *L)
+{
+	struct luaT_smtpc_async *async = luaT_smtpc_checkasync(L);
+	double timeout = luaL_optnumber(L, 2, TIMEOUT_INFINITY);
+	if (smtpc_request_wait(async->req, timeout) != 0) {
+		if (fiber_is_cancelled())
+			return luaT_error(L);
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+/**
+ * cancel() - stop the request. Return false if it is finished.
+ */
+static int
+luaT_smtpc_async_cancel(lua_State *L)
+{
+	struct luaT_smtpc_async *async = luaT_smtpc_checkasync(L);
+	lua_pushboolean(L, smtpc_request_cancel(async->req));
+	return 1;
+}
+
+/**
+ * result() - the response of the finished request or nil if it
+ * is in progress. Raise the error the request has failed with.
+ */
+static int
+luaT_smtpc_async_result(lua_State *L)
+{
+	struct luaT_smtpc_async *async = luaT_smtpc_checkasync(L);
+	if (!async->req->finished) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if (smtpc_request_result(async->req) != 0)
+		return luaT_error(L);
+	luaT_smtpc_push_response(L, async->req);
+	return 1;
+}
+
+static int
+luaT_smtpc_async_gc(lua_State *L)
+{
+	struct luaT_smtpc_async *async = luaT_smtpc_checkasync(L);
+	/* A request in progress pins the handle. */
+	if (async->req != NULL)
+		smtpc_request_delete(async->req);
+	return 0;
+}
+
+/**
+ * next_completed() - take the next finished request, which has a
+ * completion channel, waiting for it if needed. Return the handle
+ * and the channel or nothing if there are no such requests.
+ */
+static int
+luaT_smtpc_next_completed(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	struct smtpc_request *req = smtpc_env_next_completed(ctx);
+	if (req == NULL)
+		return 0;
+	struct luaT_smtpc_async *async =
+		(struct luaT_smtpc_async *) req->on_done_arg;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, async->ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, async->ref);
+	async->ref = LUA_NOREF;
+	lua_getfenv(L, -1);
+	lua_rawgeti(L, -1, 3);
+	lua_remove(L, -2);
+	return 2;
+}
+
+static void
+luaT_smtpc_batch_delete(lua_State *L, struct smtpc_request **reqs, int *body_refs,
+		   int count)
+{
+	for (int i = 0; i < count; ++i) {
+		if (reqs[i] != NULL)
+			luaT_smtpc_request_delete(L, reqs[i], body_refs[i]);
+	}
+	free(reqs);
+	free(body_refs);
+}
+
+/**
+ * request_batch(url, {{from = <...>, recipients = {<...>},
+ *                      body = <...>}, ...}, options)
+ */
+static int
+luaT_smtpc_request_batch(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	if (ctx == NULL)
+		return luaL_error(L, "can't get smtpc environment");
+
+	const char *url = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	luaL_checktype(L, 4, LUA_TTABLE);
+
+	int count = lua_objlen(L, 3);
+	lua_createtable(L, count, 0);
+	if (count == 0)
+		return 1;
+
+	struct smtpc_request **reqs = calloc(count, sizeof(*reqs));
+	int *body_refs = malloc(count * sizeof(*body_refs));
+	if (reqs == NULL || body_refs == NULL) {
+		free(reqs);
+		free(body_refs);
+		return luaL_error(L, "Can't alloc smtp batch");
+	}
+	for (int i = 0; i < count; ++i)
+		body_refs[i] = LUA_NOREF;
+
+	double timeout = TIMEOUT_INFINITY;
+	for (int i = 0; i < count; ++i) {
+		lua_rawgeti(L, 3, i + 1);
+		if (!lua_istable(L, -1)) {
+			luaT_smtpc_batch_delete(L, reqs, body_refs, count);
+			return luaL_error(L, "batch message must be a table");
+		}
+		int msg_idx = lua_gettop(L);
+
+		lua_getfield(L, msg_idx, "from");
+		const char *from = lua_tostring(L, -1);
+		if (from == NULL) {
+			luaT_smtpc_batch_delete(L, reqs, body_refs, count);
+			return luaL_error(L, "batch message sender must be "
+					  "a string");
+		}
+		reqs[i] = smtpc_request_new(ctx, url, from);
+		lua_pop(L, 1);
+		if (reqs[i] == NULL) {
+			luaT_smtpc_batch_delete(L, reqs, body_refs, count);
+			return luaT_error(L);
+		}
+
+		lua_getfield(L, msg_idx, "recipients");
+		if (!lua_istable(L, -1)) {
+			luaT_smtpc_batch_delete(L, reqs, body_refs, count);
+			return luaL_error(L, "batch message recipients must be "
+					  "a table");
+		}
+		luaT_smtpc_request_add_recipients(L, lua_gettop(L), reqs[i]);
+		lua_pop(L, 1);
+
+		lua_getfield(L, msg_idx, "body");
+		int reader_idx = 0;
+		body_refs[i] = luaT_smtpc_request_set_body(L, lua_gettop(L),
+							   reqs[i], &reader_idx);
+		if (body_refs[i] == LUA_NOREF || reader_idx != 0) {
+			luaT_smtpc_batch_delete(L, reqs, body_refs, count);
+			return luaL_error(L, "batch message body must be "
+					  "a string or a message");
+		}
+		lua_pop(L, 2);
+
+		const char *err = luaT_smtpc_request_set_options(L, 4, reqs[i],
+								 &timeout);
+		if (err != NULL) {
+			luaT_smtpc_batch_delete(L, reqs, body_refs, count);
+			return luaL_error(L, "%s", err);
+		}
+	}
+
+	if (smtpc_execute_batch(reqs, count, timeout) != 0) {
+		luaT_smtpc_batch_delete(L, reqs, body_refs, count);
+		return luaT_error(L);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		luaT_smtpc_push_response(L, reqs[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	luaT_smtpc_batch_delete(L, reqs, body_refs, count);
+	return 1;
+}
+
+/**
+ * Get a string field of a message part table at the given index.
+ * A number is converted to a string, which is stored back to the
+ * table: the table keeps the string alive while the message refers
+ * to it.
+ *
+ * Return NULL if the field is nil, raise an error if it is neither
+ * a string nor a number.
+ */
+static const char *
+luaT_smtpc_message_field(lua_State *L, int idx, const char *name,
+			 size_t *len, const char *what)
+{
+	size_t size = 0;
+	lua_getfield(L, idx, name);
+	int type = lua_type(L, -1);
+	if (type == LUA_TNIL) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	if (type != LUA_TSTRING && type != LUA_TNUMBER)
+		luaL_error(L, "message %s must be a string", what);
+	const char *str = lua_tolstring(L, -1, &size);
+	if (type == LUA_TNUMBER) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, idx, name);
+	}
+	lua_pop(L, 1);
+	if (len != NULL)
+		*len = size;
+	return str;
+}
+
+/**
+ * Get a required string field of a message part table.
+ */
+static const char *
+luaT_smtpc_message_checkfield(lua_State *L, int idx, const char *name,
+			      size_t *len, const char *what)
+{
+	const char *str = luaT_smtpc_message_field(L, idx, name, len, what);
+	if (str == NULL)
+		luaL_error(L, "message %s must be a string", what);
+	return str;
+}
+
+/**
+ * Read header lines of a message from an array at the given index.
+ * The array is allocated on the Lua stack as a userdata.
+ */
+static void
+luaT_smtpc_message_headers(lua_State *L, int idx,
+			   struct smtpc_mime_message *msg)
+{
+	msg->header_count = lua_objlen(L, idx);
+	msg->headers = (const char **)
+		lua_newuserdata(L, msg->header_count * sizeof(*msg->headers));
+	for (int i = 0; i < msg->header_count; ++i) {
+		lua_rawgeti(L, idx, i + 1);
+		int type = lua_type(L, -1);
+		if (type != LUA_TSTRING && type != LUA_TNUMBER)
+			luaL_error(L, "message header must be a string");
+		msg->headers[i] = lua_tostring(L, -1);
+		if (type == LUA_TNUMBER) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, idx, i + 1);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/**
+ * Read attachments of a message from an array at the given index.
+ * The array is allocated on the Lua stack as a userdata.
+ */
+static void
+luaT_smtpc_message_attachments(lua_State *L, int idx,
+			       struct smtpc_mime_message *msg)
+{
+	msg->attachment_count = lua_objlen(L, idx);
+	msg->attachments = (struct smtpc_mime_attachment *)
+		lua_newuserdata(L, msg->attachment_count *
+				   sizeof(*msg->attachments));
+	for (int i = 0; i < msg->attachment_count; ++i) {
+		struct smtpc_mime_attachment *a = &msg->attachments[i];
+		lua_rawgeti(L, idx, i + 1);
+		if (!lua_istable(L, -1))
+			luaL_error(L, "message attachment must be a table");
+		int a_idx = lua_gettop(L);
+		a->body = luaT_smtpc_message_field(L, a_idx, "body",
+						   &a->body_size,
+						   "attachment body");
+		a->path = luaT_smtpc_message_field(L, a_idx, "path", NULL,
+						   "attachment path");
+		if (a->body == NULL && a->path == NULL)
+			luaL_error(L, "message attachment body or path "
+				   "must be set");
+		a->content_type = luaT_smtpc_message_field(
+			L, a_idx, "content_type", NULL,
+			"attachment content_type");
+		a->charset = luaT_smtpc_message_field(
+			L, a_idx, "charset", NULL, "attachment charset");
+		a->filename = luaT_smtpc_message_checkfield(
+			L, a_idx, "filename", NULL, "attachment filename");
+		lua_getfield(L, a_idx, "base64");
+		a->base64 = lua_toboolean(L, -1);
+		lua_getfield(L, a_idx, "auto_encoding");
+		a->auto_encoding = lua_toboolean(L, -1);
+		lua_pop(L, 3);
+	}
+}
+
+/**
+ * message({from = <...>, to = <...>, cc = <...>, subject = <...>,
+ *          headers = {<...>}, content_type = <...>, charset = <...>,
+ *          body = <...>, attachments = {{body = <...>, path = <...>,
+ *          content_type = <...>, charset = <...>, filename = <...>,
+ *          base64 = <...>, auto_encoding = <...>}, ...},
+ *          transfer_encoding = <...>, template = <...>}[, reader])
+ *
+ * Compose a message. Attachments with base64 set are encoded into
+ * the message, the body and other attachments are referenced
+ * without copying: the part table is kept by the message for this
+ * purpose. Attachments with a path are read while the message is
+ * sent. If there is no body, it is streamed by the reader.
+ *
+ * With transfer_encoding 'auto' or 'auto_8bit' the encoding of the
+ * body (unless the message is a template) and of the attachments
+ * with auto_encoding set is chosen by their content, 'auto_8bit'
+ * allows to send 8bit text as is.
+ */
+static int
+luaT_smtpc_message(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+
+	struct smtpc_mime_message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.from = luaT_smtpc_message_checkfield(L, 1, "from", NULL,
+						 "sender");
+	msg.to = luaT_smtpc_message_checkfield(L, 1, "to", NULL,
+					       "recipients");
+	msg.cc = luaT_smtpc_message_field(L, 1, "cc", NULL, "cc");
+	msg.subject = luaT_smtpc_message_field(L, 1, "subject", NULL,
+					       "subject");
+	msg.content_type = luaT_smtpc_message_field(L, 1, "content_type",
+						    NULL, "content_type");
+	msg.charset = luaT_smtpc_message_field(L, 1, "charset", NULL,
+					       "charset");
+	msg.body = luaT_smtpc_message_field(L, 1, "body", &msg.body_size,
+					    "body");
+	if (msg.body == NULL && lua_isnil(L, 2))
+		return luaL_error(L, "message body or reader must be set");
+	const char *encoding = luaT_smtpc_message_field(
+		L, 1, "transfer_encoding", NULL, "transfer_encoding");
+	if (encoding != NULL) {
+		msg.allow_8bit = strcmp(encoding, "auto_8bit") == 0;
+		if (!msg.allow_8bit && strcmp(encoding, "auto") != 0)
+			return luaL_error(L, "message transfer_encoding must "
+					  "be 'auto' or 'auto_8bit'");
+		lua_getfield(L, 1, "template");
+		msg.auto_encoding = !lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	lua_getfield(L, 1, "headers");
+	if (lua_istable(L, -1))
+		luaT_smtpc_message_headers(L, lua_gettop(L), &msg);
+	lua_getfield(L, 1, "attachments");
+	if (lua_istable(L, -1))
+		luaT_smtpc_message_attachments(L, lua_gettop(L), &msg);
+
+	struct smtpc_mime *mime = (struct smtpc_mime *)
+		lua_newuserdata(L, sizeof(*mime));
+	smtpc_mime_create(mime);
+	luaL_getmetatable(L, MESSAGE_LUA_UDATA_NAME);
+	lua_setmetatable(L, -2);
+	/* Keep the part table and the reader. */
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 2);
+	lua_setfenv(L, -2);
+
+	if (smtpc_mime_compose(mime, &msg) != 0)
+		return luaT_error(L);
+	return 1;
+}
+
+static int
+luaT_smtpc_message_gc(lua_State *L)
+{
+	struct smtpc_mime *mime = (struct smtpc_mime *)
+		luaL_checkudata(L, 1, MESSAGE_LUA_UDATA_NAME);
+	smtpc_mime_destroy(mime);
+	return 0;
+}
+
+/**
+ * message_text(message) - the composed message as a string. Files
+ * and streamed bodies are read while a message is sent, so such a
+ * message has no text.
+ */
+static int
+luaT_smtpc_message_text(lua_State *L)
+{
+	struct smtpc_mime *mime = (struct smtpc_mime *)
+		luaL_checkudata(L, 1, MESSAGE_LUA_UDATA_NAME);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	for (int i = 0; i < mime->seg_count; ++i) {
+		const struct smtpc_mime_seg *seg = &mime->segs[i];
+		if (seg->type == SMTPC_MIME_SEG_STREAM ||
+		    seg->type == SMTPC_MIME_SEG_FILE)
+			return luaL_error(L, "message with a streamed body or "
+					  "a file attachment has no text");
+		luaL_addlstring(&b, smtpc_mime_seg_data(mime, seg),
+				seg->size);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/**
+ * message_template(message) - parse a composed message with
+ * {{name}} placeholders in the headers and the body.
+ */
+static int
+luaT_smtpc_message_template(lua_State *L)
+{
+	struct smtpc_mime *mime = (struct smtpc_mime *)
+		luaL_checkudata(L, 1, MESSAGE_LUA_UDATA_NAME);
+	struct smtpc_mime_tpl *tpl = (struct smtpc_mime_tpl *)
+		lua_newuserdata(L, sizeof(*tpl));
+	memset(tpl, 0, sizeof(*tpl));
+	luaL_getmetatable(L, TEMPLATE_LUA_UDATA_NAME);
+	lua_setmetatable(L, -2);
+	/* The pieces refer to the message. */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+	if (smtpc_mime_tpl_create(tpl, mime) != 0)
+		return luaT_error(L);
+	return 1;
+}
+
+static int
+luaT_smtpc_template_gc(lua_State *L)
+{
+	struct smtpc_mime_tpl *tpl = (struct smtpc_mime_tpl *)
+		luaL_checkudata(L, 1, TEMPLATE_LUA_UDATA_NAME);
+	smtpc_mime_tpl_destroy(tpl);
+	return 0;
+}
+
+struct luaT_smtpc_vars {
+	lua_State *L;
+	/** Index of the variable table. */
+	int idx;
+};
+
+/**
+ * Get a template variable from the table. A number is converted
+ * to a string, which is stored back to the table to keep it
+ * alive.
+ */
+static const char *
+luaT_smtpc_template_var(const char *name, size_t name_len, size_t *size,
+			void *arg)
+{
+	struct luaT_smtpc_vars *vars = (struct luaT_smtpc_vars *) arg;
+	lua_State *L = vars->L;
+	lua_pushlstring(L, name, name_len);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, vars->idx);
+	int type = lua_type(L, -1);
+	const char *value = NULL;
+	if (type == LUA_TSTRING || type == LUA_TNUMBER) {
+		value = lua_tolstring(L, -1, size);
+		if (type == LUA_TNUMBER) {
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, vars->idx);
+		}
+	}
+	lua_pop(L, 2);
+	return value;
+}
+
+/**
+ * message_render(template, vars) - render a message from the
+ * template with the values of the variables from the table.
+ */
+static int
+luaT_smtpc_message_render(lua_State *L)
+{
+	struct smtpc_mime_tpl *tpl = (struct smtpc_mime_tpl *)
+		luaL_checkudata(L, 1, TEMPLATE_LUA_UDATA_NAME);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	struct smtpc_mime *mime = (struct smtpc_mime *)
+		lua_newuserdata(L, sizeof(*mime));
+	smtpc_mime_create(mime);
+	luaL_getmetatable(L, MESSAGE_LUA_UDATA_NAME);
+	lua_setmetatable(L, -2);
+	/* The static parts are referenced from the template. */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+	struct luaT_smtpc_vars vars = {L, 2};
+	if (smtpc_mime_tpl_render(tpl, mime, luaT_smtpc_template_var,
+				  &vars) != 0)
+		return luaT_error(L);
 	return 1;
 }
 
@@ -221,18 +1062,200 @@ luaT_smtpc_stat(lua_State *L)
 			ctx->stat.total_requests);
 	lua_add_key_u64(L, "failed_requests",
 			ctx->stat.failed_requests);
+	lua_add_key_u64(L, "queued_requests",
+			ctx->stat.queued_requests);
+	lua_add_key_u64(L, "rejected_requests",
+			ctx->stat.rejected_requests);
+	lua_add_key_u64(L, "throttled_requests",
+			ctx->stat.throttled_requests);
+
+	/* Percentiles of the phase durations in seconds. */
+	static const double percentiles[] = {50, 90, 99};
+	static const char *percentile_keys[] = {"p50", "p90", "p99"};
+	lua_createtable(L, 0, smtpc_phase_MAX);
+	for (int i = 0; i < smtpc_phase_MAX; ++i) {
+		const struct smtpc_histogram *hist = &ctx->stat.latency[i];
+		lua_createtable(L, 0, 4);
+		lua_add_key_u64(L, "count", hist->count);
+		for (int j = 0; j < 3; ++j) {
+			uint64_t usec = smtpc_histogram_percentile(
+				hist, percentiles[j]);
+			lua_pushnumber(L, (double)usec / 1e6);
+			lua_setfield(L, -2, percentile_keys[j]);
+		}
+		lua_setfield(L, -2, smtpc_phase_strs[i]);
+	}
+	lua_setfield(L, -2, "latency");
+
+	const struct smtpc_dest_stats *dests = &ctx->stat.dests;
+	lua_createtable(L, 0, dests->count);
+	for (uint32_t i = 0; i < dests->capacity; ++i) {
+		const struct smtpc_dest_stat *dest = &dests->slots[i];
+		if (dest->url == NULL)
+			continue;
+		lua_createtable(L, 0, 4);
+		lua_add_key_u64(L, "requests", dest->requests);
+		lua_createtable(L, 0, smtpc_status_class_MAX);
+		for (int j = 0; j < smtpc_status_class_MAX; ++j)
+			lua_add_key_u64(L, smtpc_status_class_strs[j],
+					dest->status[j]);
+		lua_setfield(L, -2, "status");
+		lua_createtable(L, 0, smtpc_error_class_MAX);
+		for (int j = 0; j < smtpc_error_class_MAX; ++j)
+			lua_add_key_u64(L, smtpc_error_class_strs[j],
+					dest->errors[j]);
+		lua_setfield(L, -2, "errors");
+		const struct smtpc_health *health = &dest->health;
+		lua_createtable(L, 0, 4);
+		lua_pushnumber(L, health->latency);
+		lua_setfield(L, -2, "latency");
+		lua_pushnumber(L, health->error_rate);
+		lua_setfield(L, -2, "error_rate");
+		lua_pushboolean(L, health->ejected_until > fiber_clock());
+		lua_setfield(L, -2, "ejected");
+		lua_add_key_u64(L, "ejections", health->ejections);
+		lua_setfield(L, -2, "health");
+		lua_setfield(L, -2, dest->url);
+	}
+	lua_setfield(L, -2, "destinations");
+	return 1;
+}
+
+/**
+ * set_rate_limit(relay_rate, relay_burst, domain_rate, domain_burst)
+ */
+static int
+luaT_smtpc_set_rate_limit(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	smtpc_env_set_rate_limit(ctx, luaL_optnumber(L, 2, 0),
+				 luaL_optnumber(L, 3, 0),
+				 luaL_optnumber(L, 4, 0),
+				 luaL_optnumber(L, 5, 0));
+	return 0;
+}
+
+/**
+ * set_relays(urls, weights)
+ */
+static int
+luaT_smtpc_set_relays(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int count = lua_objlen(L, 2);
+	if (count > SMTPC_RELAYS_MAX)
+		return luaL_error(L, "too many relays, the limit is %d",
+				  SMTPC_RELAYS_MAX);
+	/* The strings are kept alive by the table. */
+	const char *urls[SMTPC_RELAYS_MAX];
+	double weights[SMTPC_RELAYS_MAX];
+	for (int i = 0; i < count; ++i) {
+		lua_rawgeti(L, 2, i + 1);
+		urls[i] = lua_tostring(L, -1);
+		lua_pop(L, 1);
+		if (urls[i] == NULL)
+			return luaL_error(L, "relay url must be a string");
+		lua_rawgeti(L, 3, i + 1);
+		weights[i] = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	if (smtpc_env_set_relays(ctx, urls, weights, count) != 0)
+		return luaT_error(L);
+	return 0;
+}
+
+/**
+ * set_breaker(failures, eject_time)
+ */
+static int
+luaT_smtpc_set_breaker(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	smtpc_env_set_breaker(ctx, luaL_optinteger(L, 2, 0),
+			      luaL_optnumber(L, 3, 0));
+	return 0;
+}
+
+/**
+ * pick_relay([tried[, healthy]]) - choose a relay, which index is
+ * not set in the tried table, and not an ejected one if healthy is
+ * set. Return the index or nothing.
+ */
+static int
+luaT_smtpc_pick_relay(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	uint64_t skip = 0;
+	if (lua_istable(L, 2)) {
+		for (int i = 0; i < ctx->relay_count; ++i) {
+			lua_rawgeti(L, 2, i + 1);
+			if (lua_toboolean(L, -1))
+				skip |= 1ULL << i;
+			lua_pop(L, 1);
+		}
+	}
+	int i = smtpc_env_pick_relay(ctx, skip, !lua_toboolean(L, 3));
+	if (i < 0)
+		return 0;
+	lua_pushinteger(L, i + 1);
 	return 1;
 }
 
+/**
+ * set_ca(ca_file, ca_path)
+ */
+static int
+luaT_smtpc_set_ca(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	if (smtpc_env_set_ca(ctx, luaL_optstring(L, 2, NULL),
+			     luaL_optstring(L, 3, NULL)) != 0)
+		return luaT_error(L);
+	return 0;
+}
+
+static int
+luaT_smtpc_reload_tls(lua_State *L)
+{
+	smtpc_env_reload_tls(luaT_smtpc_checkenv(L));
+	return 0;
+}
+
+/**
+ * dkim_sign(message, domain, selector, key) - sign a composed
+ * message by DKIM.
+ */
+static int
+luaT_smtpc_dkim_sign(lua_State *L)
+{
+	struct smtpc_env *ctx = luaT_smtpc_checkenv(L);
+	struct smtpc_mime *mime = (struct smtpc_mime *)
+		luaL_checkudata(L, 2, MESSAGE_LUA_UDATA_NAME);
+	const char *domain = luaL_checkstring(L, 3);
+	const char *selector = luaL_checkstring(L, 4);
+	size_t key_size;
+	const char *key = luaL_checklstring(L, 5, &key_size);
+	if (smtpc_env_dkim_sign(ctx, key, key_size, domain, selector,
+				mime) != 0)
+		return luaT_error(L);
+	return 0;
+}
+
 static int
 luaT_smtpc_new(lua_State *L)
 {
+	int max_conns = luaL_optint(L, 1, 5);
+	int max_inflight = luaL_optint(L, 2, 0);
+	int queue_size = luaL_optint(L, 3, -1);
+
 	struct smtpc_env *ctx = (struct smtpc_env *)
 			lua_newuserdata(L, sizeof(struct smtpc_env));
 	if (ctx == NULL)
 		return luaL_error(L, "lua_newuserdata failed: smtpc_env");
 
-	if (smtpc_env_create(ctx) != 0)
+	if (smtpc_env_create(ctx, max_conns, max_inflight, queue_size) != 0)
 		return luaT_error(L);
 
 	luaL_getmetatable(L, DRIVER_LUA_UDATA_NAME);
@@ -274,16 +1297,48 @@ luaT_smtpc_version(lua_State *L)
 
 static const struct luaL_Reg Module[] = {
 	{"new", luaT_smtpc_new},
+	{"message", luaT_smtpc_message},
+	{"message_text", luaT_smtpc_message_text},
+	{"message_template", luaT_smtpc_message_template},
+	{"message_render", luaT_smtpc_message_render},
 	{NULL, NULL}
 };
 
 static const struct luaL_Reg Client[] = {
 	{"request", luaT_smtpc_request},
+	{"request_batch", luaT_smtpc_request_batch},
+	{"request_async", luaT_smtpc_request_async},
+	{"next_completed", luaT_smtpc_next_completed},
+	{"set_rate_limit", luaT_smtpc_set_rate_limit},
+	{"set_relays", luaT_smtpc_set_relays},
+	{"set_breaker", luaT_smtpc_set_breaker},
+	{"pick_relay", luaT_smtpc_pick_relay},
+	{"set_ca", luaT_smtpc_set_ca},
+	{"reload_tls", luaT_smtpc_reload_tls},
+	{"dkim_sign", luaT_smtpc_dkim_sign},
 	{"stat", luaT_smtpc_stat},
 	{"__gc", luaT_smtpc_cleanup},
 	{NULL, NULL}
 };
 
+static const struct luaL_Reg Message[] = {
+	{"__gc", luaT_smtpc_message_gc},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg Template[] = {
+	{"__gc", luaT_smtpc_template_gc},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg Request[] = {
+	{"wait", luaT_smtpc_async_wait},
+	{"cancel", luaT_smtpc_async_cancel},
+	{"result", luaT_smtpc_async_result},
+	{"__gc", luaT_smtpc_async_gc},
+	{NULL, NULL}
+};
+
 /*
  * Lib initializer
  */
@@ -300,6 +1355,23 @@ luaopen_smtp_lib(lua_State *L)
 	lua_setfield(L, -2, "__metatable");
 	luaL_register(L, NULL, Client);
 	lua_pop(L, 1);
+	luaL_newmetatable(L, MESSAGE_LUA_UDATA_NAME);
+	lua_pushstring(L, MESSAGE_LUA_UDATA_NAME);
+	lua_setfield(L, -2, "__metatable");
+	luaL_register(L, NULL, Message);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, TEMPLATE_LUA_UDATA_NAME);
+	lua_pushstring(L, TEMPLATE_LUA_UDATA_NAME);
+	lua_setfield(L, -2, "__metatable");
+	luaL_register(L, NULL, Template);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, REQUEST_LUA_UDATA_NAME);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pushstring(L, REQUEST_LUA_UDATA_NAME);
+	lua_setfield(L, -2, "__metatable");
+	luaL_register(L, NULL, Request);
+	lua_pop(L, 1);
 	luaL_register(L, "smtp.client.driver", Module);
 
 	lua_pushliteral(L, "_CURL_VERSION");
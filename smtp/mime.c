@@ -0,0 +1,744 @@
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mime.h"
+#include "qp.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <module.h>
+
+/* {{{ Message */
+
+void
+smtpc_mime_create(struct smtpc_mime *mime)
+{
+	memset(mime, 0, sizeof(*mime));
+}
+
+void
+smtpc_mime_destroy(struct smtpc_mime *mime)
+{
+	free(mime->buf);
+	free(mime->segs);
+	memset(mime, 0, sizeof(*mime));
+}
+
+/**
+ * Allocate a new segment at the end of the message.
+ */
+static struct smtpc_mime_seg *
+smtpc_mime_new_seg(struct smtpc_mime *mime, enum smtpc_mime_seg_type type)
+{
+	if (mime->seg_count == mime->seg_capacity) {
+		int capacity = mime->seg_capacity > 0 ?
+			       mime->seg_capacity * 2 : 16;
+		struct smtpc_mime_seg *segs =
+			realloc(mime->segs, capacity * sizeof(*segs));
+		if (segs == NULL) {
+			box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+				      "Can't alloc smtp message segments");
+			return NULL;
+		}
+		mime->segs = segs;
+		mime->seg_capacity = capacity;
+	}
+	struct smtpc_mime_seg *seg = &mime->segs[mime->seg_count++];
+	memset(seg, 0, sizeof(*seg));
+	seg->type = type;
+	return seg;
+}
+
+/**
+ * Make room for @a size more bytes of text in the buffer.
+ */
+static int
+smtpc_mime_grow(struct smtpc_mime *mime, size_t size)
+{
+	if (mime->buf_size + size <= mime->buf_capacity)
+		return 0;
+	size_t capacity = mime->buf_capacity > 0 ? mime->buf_capacity : 256;
+	while (capacity < mime->buf_size + size)
+		capacity *= 2;
+	char *buf = realloc(mime->buf, capacity);
+	if (buf == NULL) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc smtp message buffer");
+		return -1;
+	}
+	mime->buf = buf;
+	mime->buf_capacity = capacity;
+	return 0;
+}
+
+/**
+ * Reserve space for text at the end of the message.
+ * Return a pointer to the space or NULL on error.
+ */
+static char *
+smtpc_mime_reserve(struct smtpc_mime *mime, size_t size)
+{
+	if (smtpc_mime_grow(mime, size) != 0)
+		return NULL;
+	/* Text that follows text goes to the same segment. */
+	struct smtpc_mime_seg *seg = mime->seg_count > 0 ?
+				     &mime->segs[mime->seg_count - 1] : NULL;
+	if (seg == NULL || seg->type != SMTPC_MIME_SEG_TEXT) {
+		seg = smtpc_mime_new_seg(mime, SMTPC_MIME_SEG_TEXT);
+		if (seg == NULL)
+			return NULL;
+		seg->offset = mime->buf_size;
+	}
+	return mime->buf + mime->buf_size;
+}
+
+/**
+ * Account text written to the reserved space.
+ */
+static void
+smtpc_mime_commit(struct smtpc_mime *mime, size_t size)
+{
+	mime->buf_size += size;
+	mime->segs[mime->seg_count - 1].size += size;
+}
+
+int
+smtpc_mime_append(struct smtpc_mime *mime, const char *data, size_t size)
+{
+	if (size == 0)
+		return 0;
+	char *p = smtpc_mime_reserve(mime, size);
+	if (p == NULL)
+		return -1;
+	memcpy(p, data, size);
+	smtpc_mime_commit(mime, size);
+	return 0;
+}
+
+int
+smtpc_mime_append_base64(struct smtpc_mime *mime, const char *data,
+			 size_t size)
+{
+	if (size == 0)
+		return 0;
+	char *p = smtpc_mime_reserve(mime, smtpc_base64_encoded_size(size));
+	if (p == NULL)
+		return -1;
+	smtpc_mime_commit(mime, smtpc_base64_encode(data, size, p));
+	return 0;
+}
+
+int
+smtpc_mime_append_str(struct smtpc_mime *mime, const char *str)
+{
+	return smtpc_mime_append(mime, str, strlen(str));
+}
+
+int
+smtpc_mime_append_ref(struct smtpc_mime *mime, const char *data,
+		      size_t size)
+{
+	if (size == 0)
+		return 0;
+	struct smtpc_mime_seg *seg =
+		smtpc_mime_new_seg(mime, SMTPC_MIME_SEG_REF);
+	if (seg == NULL)
+		return -1;
+	seg->data = data;
+	seg->size = size;
+	return 0;
+}
+
+int
+smtpc_mime_append_stream(struct smtpc_mime *mime)
+{
+	if (smtpc_mime_new_seg(mime, SMTPC_MIME_SEG_STREAM) == NULL)
+		return -1;
+	return 0;
+}
+
+int
+smtpc_mime_append_file(struct smtpc_mime *mime, const char *path,
+		       bool base64)
+{
+	struct smtpc_mime_seg *seg =
+		smtpc_mime_new_seg(mime, SMTPC_MIME_SEG_FILE);
+	if (seg == NULL)
+		return -1;
+	seg->path = path;
+	seg->base64 = base64;
+	return 0;
+}
+
+int
+smtpc_mime_prepend(struct smtpc_mime *mime, const char *data, size_t size)
+{
+	if (smtpc_mime_grow(mime, size) != 0 ||
+	    smtpc_mime_new_seg(mime, SMTPC_MIME_SEG_TEXT) == NULL)
+		return -1;
+	struct smtpc_mime_seg seg = mime->segs[mime->seg_count - 1];
+	seg.offset = mime->buf_size;
+	seg.size = size;
+	memcpy(mime->buf + mime->buf_size, data, size);
+	mime->buf_size += size;
+	memmove(&mime->segs[1], &mime->segs[0],
+		(mime->seg_count - 1) * sizeof(seg));
+	mime->segs[0] = seg;
+	++mime->head_seg_count;
+	return 0;
+}
+
+bool
+smtpc_mime_has_stream(const struct smtpc_mime *mime)
+{
+	for (int i = 0; i < mime->seg_count; ++i) {
+		if (mime->segs[i].type == SMTPC_MIME_SEG_STREAM)
+			return true;
+	}
+	return false;
+}
+
+/* Message }}} */
+
+/* {{{ File reader */
+
+/**
+ * Size of the reader buffer: a raw chunk followed by the encoded
+ * one, each encoded line takes up to LINE_LEN + CRLF bytes.
+ */
+#define SMTPC_MIME_FILE_BUF_SIZE \
+	(SMTPC_MIME_FILE_CHUNK + \
+	 SMTPC_MIME_FILE_LINES * (SMTPC_BASE64_LINE_LEN + 2))
+
+void
+smtpc_mime_file_create(struct smtpc_mime_file *file)
+{
+	memset(file, 0, sizeof(*file));
+	file->fd = -1;
+}
+
+void
+smtpc_mime_file_destroy(struct smtpc_mime_file *file)
+{
+	if (file->fd >= 0)
+		close(file->fd);
+	free(file->buf);
+	smtpc_mime_file_create(file);
+}
+
+void
+smtpc_mime_file_open(struct smtpc_mime_file *file,
+		     const struct smtpc_mime_seg *seg)
+{
+	assert(seg->type == SMTPC_MIME_SEG_FILE);
+	if (file->fd >= 0)
+		close(file->fd);
+	file->fd = -1;
+	file->seg = seg;
+	file->pos = 0;
+	file->chunk_size = 0;
+	file->error = 0;
+}
+
+/**
+ * Read and encode the next chunk of the file.
+ * It is executed in a coio thread.
+ */
+static ssize_t
+smtpc_mime_file_read_f(va_list ap)
+{
+	struct smtpc_mime_file *file = va_arg(ap, struct smtpc_mime_file *);
+	if (file->fd < 0) {
+		file->fd = open(file->seg->path, O_RDONLY | O_CLOEXEC);
+		if (file->fd < 0) {
+			file->error = errno;
+			return -1;
+		}
+	}
+	/* Encoded lines must not be split between chunks. */
+	size_t size = 0;
+	while (size < SMTPC_MIME_FILE_CHUNK) {
+		ssize_t rc = pread(file->fd, file->buf + size,
+				   SMTPC_MIME_FILE_CHUNK - size,
+				   file->pos + size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			file->error = errno;
+			return -1;
+		}
+		if (rc == 0)
+			break;
+		size += rc;
+	}
+	bool first = file->pos == 0;
+	file->pos += size;
+	if (!file->seg->base64 || size == 0) {
+		file->chunk_size = size;
+		return 0;
+	}
+	char *out = file->buf + SMTPC_MIME_FILE_CHUNK;
+	char *p = out;
+	if (!first) {
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	p += smtpc_base64_encode(file->buf, size, p);
+	file->chunk_size = p - out;
+	return 0;
+}
+
+int
+smtpc_mime_file_read(struct smtpc_mime_file *file, const char **data,
+		     size_t *size)
+{
+	assert(file->seg != NULL);
+	if (file->buf == NULL) {
+		file->buf = malloc(SMTPC_MIME_FILE_BUF_SIZE);
+		if (file->buf == NULL) {
+			box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+				      "Can't alloc smtp file buffer");
+			return -1;
+		}
+	}
+	if (coio_call(smtpc_mime_file_read_f, file) != 0) {
+		box_error_set(__FILE__, __LINE__, ER_SYSTEM,
+			      "Can't read attachment %s: %s",
+			      file->seg->path, strerror(file->error));
+		return -1;
+	}
+	*data = file->buf;
+	if (file->seg->base64 && file->chunk_size > 0)
+		*data += SMTPC_MIME_FILE_CHUNK;
+	*size = file->chunk_size;
+	return 0;
+}
+
+/* File reader }}} */
+
+/* {{{ Composer */
+
+#define MULTIPART_BOUNDARY "MULTIPART-MIXED-BOUNDARY"
+#define MULTIPART_CONTENT_TYPE \
+	"Content-Type: multipart/mixed; boundary=" MULTIPART_BOUNDARY ";\r\n"
+#define MULTIPART_SEPARATOR "\r\n--" MULTIPART_BOUNDARY "\r\n"
+#define MULTIPART_END "\r\n--" MULTIPART_BOUNDARY "--\r\n"
+
+/**
+ * Append a header line: the name, the value and CRLF.
+ */
+static int
+smtpc_mime_append_header(struct smtpc_mime *mime, const char *name,
+			 const char *value)
+{
+	if (smtpc_mime_append_str(mime, name) != 0 ||
+	    smtpc_mime_append_str(mime, value) != 0 ||
+	    smtpc_mime_append_str(mime, "\r\n") != 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Append the Content-Type header.
+ */
+static int
+smtpc_mime_append_content_type(struct smtpc_mime *mime,
+			       const char *content_type, const char *charset)
+{
+	if (content_type == NULL)
+		content_type = "text/plain";
+	if (charset == NULL)
+		charset = "UTF-8";
+	if (smtpc_mime_append_str(mime, "Content-Type: ") != 0 ||
+	    smtpc_mime_append_str(mime, content_type) != 0 ||
+	    smtpc_mime_append_str(mime, "; charset=") != 0 ||
+	    smtpc_mime_append_str(mime, charset) != 0 ||
+	    smtpc_mime_append_str(mime, ";\r\n") != 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Content-Transfer-Encoding of a part.
+ */
+enum smtpc_mime_cte {
+	SMTPC_MIME_CTE_7BIT,
+	SMTPC_MIME_CTE_8BIT,
+	SMTPC_MIME_CTE_QP,
+	SMTPC_MIME_CTE_BASE64,
+};
+
+/** Header of a part, 7bit is the default one (RFC 2045). */
+static const char *const smtpc_mime_cte_headers[] = {
+	[SMTPC_MIME_CTE_7BIT] = "",
+	[SMTPC_MIME_CTE_8BIT] = "Content-Transfer-Encoding: 8bit\r\n",
+	[SMTPC_MIME_CTE_QP] =
+		"Content-Transfer-Encoding: quoted-printable\r\n",
+	[SMTPC_MIME_CTE_BASE64] = "Content-Transfer-Encoding: base64\r\n",
+};
+
+/**
+ * Choose the smallest transfer encoding, which keeps the data
+ * intact. Data is sent as is only if its lines fit SMTP and end
+ * with CRLF: a relay may change a bare CR or LF. Otherwise text
+ * is sent in the shorter of quoted-printable, which turns a bare
+ * LF into CRLF, and base64. Other data is never quoted-printable
+ * encoded.
+ */
+static enum smtpc_mime_cte
+smtpc_mime_choose_cte(const char *content_type, const char *data,
+		      size_t size, bool allow_8bit, struct smtpc_qp_scan *scan)
+{
+	bool text = content_type == NULL ||
+		    strncasecmp(content_type, "text/", 5) == 0;
+	smtpc_qp_scan(data, size, scan);
+	if (scan->nul == 0 && scan->bare_cr == 0 && scan->bare_lf == 0 &&
+	    scan->max_line <= SMTPC_QP_MAX_LINE) {
+		if (scan->high == 0)
+			return SMTPC_MIME_CTE_7BIT;
+		if (allow_8bit)
+			return SMTPC_MIME_CTE_8BIT;
+	}
+	if (text && smtpc_qp_encoded_size(size, scan) <=
+		    smtpc_base64_encoded_size(size))
+		return SMTPC_MIME_CTE_QP;
+	return SMTPC_MIME_CTE_BASE64;
+}
+
+/**
+ * Append data in the transfer encoding, which is chosen with the
+ * scan of the data.
+ */
+static int
+smtpc_mime_append_encoded(struct smtpc_mime *mime, const char *data,
+			  size_t size, enum smtpc_mime_cte cte,
+			  const struct smtpc_qp_scan *scan)
+{
+	if (cte == SMTPC_MIME_CTE_BASE64)
+		return smtpc_mime_append_base64(mime, data, size);
+	if (cte != SMTPC_MIME_CTE_QP)
+		return smtpc_mime_append_ref(mime, data, size);
+	if (size == 0)
+		return 0;
+	char *p = smtpc_mime_reserve(mime, smtpc_qp_encoded_size(size, scan));
+	if (p == NULL)
+		return -1;
+	smtpc_mime_commit(mime, smtpc_qp_encode(data, size, p));
+	return 0;
+}
+
+/**
+ * Append an attachment part of a multipart message.
+ */
+static int
+smtpc_mime_append_attachment(struct smtpc_mime *mime,
+			     const struct smtpc_mime_attachment *attachment,
+			     bool allow_8bit)
+{
+	if (smtpc_mime_append_str(mime, MULTIPART_SEPARATOR) != 0 ||
+	    smtpc_mime_append_content_type(mime, attachment->content_type,
+					   attachment->charset) != 0 ||
+	    smtpc_mime_append_str(mime, "Content-Disposition: inline; "
+				  "filename=\"") != 0 ||
+	    smtpc_mime_append_str(mime, attachment->filename) != 0 ||
+	    smtpc_mime_append_str(mime, "\";\r\n") != 0)
+		return -1;
+	if (attachment->auto_encoding && attachment->body == NULL) {
+		/* The content of a file is not known beforehand. */
+		if (smtpc_mime_append_str(mime, smtpc_mime_cte_headers[
+					  SMTPC_MIME_CTE_BASE64]) != 0 ||
+		    smtpc_mime_append_str(mime, "\r\n") != 0)
+			return -1;
+		return smtpc_mime_append_file(mime, attachment->path, true);
+	}
+	if (attachment->auto_encoding) {
+		struct smtpc_qp_scan scan;
+		enum smtpc_mime_cte cte = smtpc_mime_choose_cte(
+			attachment->content_type, attachment->body,
+			attachment->body_size, allow_8bit, &scan);
+		if (smtpc_mime_append_str(mime,
+					  smtpc_mime_cte_headers[cte]) != 0 ||
+		    smtpc_mime_append_str(mime, "\r\n") != 0)
+			return -1;
+		return smtpc_mime_append_encoded(mime, attachment->body,
+						 attachment->body_size, cte,
+						 &scan);
+	}
+	if (attachment->base64 &&
+	    smtpc_mime_append_str(mime, "Content-Transfer-Encoding: "
+				  "base64\r\n\r\n") != 0)
+		return -1;
+	if (attachment->body == NULL)
+		return smtpc_mime_append_file(mime, attachment->path,
+					      attachment->base64);
+	if (!attachment->base64)
+		return smtpc_mime_append_ref(mime, attachment->body,
+					     attachment->body_size);
+	return smtpc_mime_append_base64(mime, attachment->body,
+					attachment->body_size);
+}
+
+int
+smtpc_mime_compose(struct smtpc_mime *mime,
+		   const struct smtpc_mime_message *msg)
+{
+	bool multipart = msg->attachment_count > 0;
+	if (multipart &&
+	    smtpc_mime_append_str(mime, MULTIPART_CONTENT_TYPE) != 0)
+		return -1;
+	if (smtpc_mime_append_header(mime, "From: ", msg->from) != 0 ||
+	    smtpc_mime_append_header(mime, "To: ", msg->to) != 0)
+		return -1;
+	if (msg->cc != NULL &&
+	    smtpc_mime_append_header(mime, "Cc: ", msg->cc) != 0)
+		return -1;
+	if (msg->subject != NULL &&
+	    smtpc_mime_append_header(mime, "Subject: ", msg->subject) != 0)
+		return -1;
+	for (int i = 0; i < msg->header_count; ++i) {
+		if (smtpc_mime_append_header(mime, "", msg->headers[i]) != 0)
+			return -1;
+	}
+	if (multipart &&
+	    smtpc_mime_append_str(mime, MULTIPART_SEPARATOR) != 0)
+		return -1;
+	struct smtpc_qp_scan scan;
+	enum smtpc_mime_cte cte = SMTPC_MIME_CTE_7BIT;
+	if (msg->body != NULL && msg->auto_encoding)
+		cte = smtpc_mime_choose_cte(msg->content_type, msg->body,
+					    msg->body_size, msg->allow_8bit,
+					    &scan);
+	if (smtpc_mime_append_content_type(mime, msg->content_type,
+					   msg->charset) != 0 ||
+	    smtpc_mime_append_str(mime, smtpc_mime_cte_headers[cte]) != 0 ||
+	    smtpc_mime_append_str(mime, "\r\n") != 0)
+		return -1;
+	if (msg->body == NULL) {
+		if (smtpc_mime_append_stream(mime) != 0)
+			return -1;
+	} else if (smtpc_mime_append_encoded(mime, msg->body, msg->body_size,
+					     cte, &scan) != 0) {
+		return -1;
+	}
+	mime->head_seg_count = mime->seg_count;
+	if (!multipart)
+		return 0;
+	for (int i = 0; i < msg->attachment_count; ++i) {
+		if (smtpc_mime_append_attachment(mime, &msg->attachments[i],
+						 msg->allow_8bit) != 0)
+			return -1;
+	}
+	return smtpc_mime_append_str(mime, MULTIPART_END);
+}
+
+/* Composer }}} */
+
+/* {{{ Template */
+
+#define TEMPLATE_OPEN "{{"
+#define TEMPLATE_CLOSE "}}"
+
+/**
+ * Append a piece to the template.
+ */
+static struct smtpc_mime_tpl_piece *
+smtpc_mime_tpl_new_piece(struct smtpc_mime_tpl *tpl)
+{
+	if (tpl->piece_count == tpl->piece_capacity) {
+		int capacity = tpl->piece_capacity > 0 ?
+			       tpl->piece_capacity * 2 : 16;
+		struct smtpc_mime_tpl_piece *pieces =
+			realloc(tpl->pieces, capacity * sizeof(*pieces));
+		if (pieces == NULL) {
+			box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+				      "Can't alloc smtp template");
+			return NULL;
+		}
+		tpl->pieces = pieces;
+		tpl->piece_capacity = capacity;
+	}
+	struct smtpc_mime_tpl_piece *piece = &tpl->pieces[tpl->piece_count++];
+	memset(piece, 0, sizeof(*piece));
+	return piece;
+}
+
+static int
+smtpc_mime_tpl_add(struct smtpc_mime_tpl *tpl, const char *data,
+		   size_t size, bool is_var, bool in_header)
+{
+	if (size == 0 && !is_var)
+		return 0;
+	struct smtpc_mime_tpl_piece *piece = smtpc_mime_tpl_new_piece(tpl);
+	if (piece == NULL)
+		return -1;
+	piece->data = data;
+	piece->size = size;
+	piece->is_var = is_var;
+	piece->in_header = in_header;
+	return 0;
+}
+
+/**
+ * Split the data into static pieces and {{name}} variables.
+ */
+static int
+smtpc_mime_tpl_parse(struct smtpc_mime_tpl *tpl, const char *data,
+		     size_t size, bool in_header)
+{
+	const char *end = data + size;
+	const char *p = data;
+	while (p < end) {
+		const char *open = memmem(p, end - p, TEMPLATE_OPEN,
+					  strlen(TEMPLATE_OPEN));
+		if (open == NULL)
+			break;
+		const char *name = open + strlen(TEMPLATE_OPEN);
+		const char *close = memmem(name, end - name, TEMPLATE_CLOSE,
+					   strlen(TEMPLATE_CLOSE));
+		if (close == NULL)
+			break;
+		/* Braces, which are not a placeholder, are text. */
+		if (close == name || memchr(name, '\n', close - name) != NULL) {
+			if (smtpc_mime_tpl_add(tpl, p, name - p, false,
+					       in_header) != 0)
+				return -1;
+			p = name;
+			continue;
+		}
+		if (smtpc_mime_tpl_add(tpl, p, open - p, false,
+				       in_header) != 0 ||
+		    smtpc_mime_tpl_add(tpl, name, close - name, true,
+				       in_header) != 0)
+			return -1;
+		p = close + strlen(TEMPLATE_CLOSE);
+	}
+	return smtpc_mime_tpl_add(tpl, p, end - p, false, in_header);
+}
+
+int
+smtpc_mime_tpl_create(struct smtpc_mime_tpl *tpl,
+		      const struct smtpc_mime *mime)
+{
+	memset(tpl, 0, sizeof(*tpl));
+	for (int i = 0; i < mime->seg_count; ++i) {
+		const struct smtpc_mime_seg *seg = &mime->segs[i];
+		const char *data = smtpc_mime_seg_data(mime, seg);
+		int rc = 0;
+		switch (seg->type) {
+		case SMTPC_MIME_SEG_STREAM:
+			smtpc_mime_tpl_destroy(tpl);
+			box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+				      "Template body must be a string");
+			return -1;
+		case SMTPC_MIME_SEG_FILE: {
+			struct smtpc_mime_tpl_piece *piece =
+				smtpc_mime_tpl_new_piece(tpl);
+			if (piece == NULL)
+				rc = -1;
+			else
+				piece->file = seg;
+			break;
+		}
+		default:
+			/* Attachments are static. */
+			if (i < mime->head_seg_count)
+				rc = smtpc_mime_tpl_parse(
+					tpl, data, seg->size,
+					seg->type == SMTPC_MIME_SEG_TEXT);
+			else
+				rc = smtpc_mime_tpl_add(tpl, data, seg->size,
+							false, false);
+			break;
+		}
+		if (rc != 0) {
+			smtpc_mime_tpl_destroy(tpl);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void
+smtpc_mime_tpl_destroy(struct smtpc_mime_tpl *tpl)
+{
+	free(tpl->pieces);
+	memset(tpl, 0, sizeof(*tpl));
+}
+
+int
+smtpc_mime_tpl_render(const struct smtpc_mime_tpl *tpl,
+		      struct smtpc_mime *mime, smtpc_mime_var_f lookup,
+		      void *arg)
+{
+	for (int i = 0; i < tpl->piece_count; ++i) {
+		const struct smtpc_mime_tpl_piece *piece = &tpl->pieces[i];
+		if (piece->file != NULL) {
+			if (smtpc_mime_append_file(mime, piece->file->path,
+						   piece->file->base64) != 0)
+				return -1;
+			continue;
+		}
+		if (!piece->is_var) {
+			if (smtpc_mime_append_ref(mime, piece->data,
+						  piece->size) != 0)
+				return -1;
+			continue;
+		}
+		size_t size = 0;
+		const char *value = lookup(piece->data, piece->size, &size,
+					   arg);
+		if (value == NULL) {
+			box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+				      "Template variable %.*s is not set",
+				      (int)piece->size, piece->data);
+			return -1;
+		}
+		if (piece->in_header && (memchr(value, '\r', size) != NULL ||
+					 memchr(value, '\n', size) != NULL)) {
+			box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+				      "Template variable %.*s in a header "
+				      "must not contain line breaks",
+				      (int)piece->size, piece->data);
+			return -1;
+		}
+		if (smtpc_mime_append(mime, value, size) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Template }}} */
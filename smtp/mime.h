@@ -0,0 +1,414 @@
+#ifndef TARANTOOL_SMTP_MIME_H_INCLUDED
+#define TARANTOOL_SMTP_MIME_H_INCLUDED 1
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "base64.h"
+
+/* {{{ Message */
+
+enum smtpc_mime_seg_type {
+	/** Text generated by the composer, kept in the message buffer. */
+	SMTPC_MIME_SEG_TEXT,
+	/** External memory, which is referenced without copying. */
+	SMTPC_MIME_SEG_REF,
+	/** Body supplied by a reader while the message is sent. */
+	SMTPC_MIME_SEG_STREAM,
+	/** File read by chunks while the message is sent. */
+	SMTPC_MIME_SEG_FILE,
+};
+
+/**
+ * A piece of a message.
+ */
+struct smtpc_mime_seg {
+	enum smtpc_mime_seg_type type;
+	/** Data of a SMTPC_MIME_SEG_REF segment. */
+	const char *data;
+	/** Offset of a SMTPC_MIME_SEG_TEXT segment in the buffer. */
+	size_t offset;
+	/** Size of the data. */
+	size_t size;
+	/** Path of a SMTPC_MIME_SEG_FILE segment. */
+	const char *path;
+	/** Whether to base64 encode the file. */
+	bool base64;
+};
+
+/**
+ * A composed message.
+ *
+ * The message is a list of segments: the text generated by the
+ * composer (headers, multipart boundaries and so on) is written
+ * into one growing buffer, while large data (the body and the
+ * attachments) is referenced without copying and must outlive the
+ * message.
+ */
+struct smtpc_mime {
+	/** Buffer for the generated text. */
+	char *buf;
+	/** Used size of the buffer. */
+	size_t buf_size;
+	/** Allocated size of the buffer. */
+	size_t buf_capacity;
+	/** Segments. */
+	struct smtpc_mime_seg *segs;
+	/** The number of segments. */
+	int seg_count;
+	/** The number of allocated segments. */
+	int seg_capacity;
+	/**
+	 * The number of leading segments with the headers and the
+	 * body, the rest are attachments.
+	 */
+	int head_seg_count;
+};
+
+/**
+ * Initialize an empty message.
+ */
+void
+smtpc_mime_create(struct smtpc_mime *mime);
+
+/**
+ * Free the memory of the message.
+ */
+void
+smtpc_mime_destroy(struct smtpc_mime *mime);
+
+/**
+ * Append a copy of the data to the message.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_append(struct smtpc_mime *mime, const char *data, size_t size);
+
+/**
+ * Append base64 encoded data to the message, see smtpc_base64_encode().
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_append_base64(struct smtpc_mime *mime, const char *data,
+			 size_t size);
+
+/**
+ * Append a copy of a zero terminated string to the message.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_append_str(struct smtpc_mime *mime, const char *str);
+
+/**
+ * Append a reference to the data to the message. The data is not
+ * copied and must outlive the message.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_append_ref(struct smtpc_mime *mime, const char *data,
+		      size_t size);
+
+/**
+ * Append a place for a body, which is streamed by a reader.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_append_stream(struct smtpc_mime *mime);
+
+/**
+ * Append a file, which is read by chunks while the message is
+ * sent, see struct smtpc_mime_file. The path is not copied and
+ * must outlive the message.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_append_file(struct smtpc_mime *mime, const char *path,
+		       bool base64);
+
+/**
+ * Insert a copy of the text at the start of the message, e.g. a
+ * header added to a composed message. Nothing may be appended to
+ * the message after that.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_prepend(struct smtpc_mime *mime, const char *data, size_t size);
+
+/**
+ * Get data of a segment.
+ */
+static inline const char *
+smtpc_mime_seg_data(const struct smtpc_mime *mime,
+		    const struct smtpc_mime_seg *seg)
+{
+	if (seg->type == SMTPC_MIME_SEG_TEXT)
+		return mime->buf + seg->offset;
+	return seg->data;
+}
+
+/**
+ * Whether the message has a streamed body.
+ */
+bool
+smtpc_mime_has_stream(const struct smtpc_mime *mime);
+
+/* Message }}} */
+
+/* {{{ File reader */
+
+/** The number of encoded lines in a file chunk. */
+#define SMTPC_MIME_FILE_LINES 1024
+/** The number of file bytes read at once. */
+#define SMTPC_MIME_FILE_CHUNK \
+	(SMTPC_BASE64_LINE_LEN / 4 * 3 * SMTPC_MIME_FILE_LINES)
+
+/**
+ * Reader of a file segment.
+ *
+ * The file is read by chunks in a coio thread, where the chunks
+ * are base64 encoded as well, so neither disk I/O nor encoding
+ * blocks the TX thread and the file never gets to the Lua heap.
+ */
+struct smtpc_mime_file {
+	/** The file segment, NULL if the reader is not in use. */
+	const struct smtpc_mime_seg *seg;
+	/** File descriptor, -1 until the file is opened. */
+	int fd;
+	/** The number of file bytes read. */
+	size_t pos;
+	/** Buffer for the raw and the encoded chunk. */
+	char *buf;
+	/** Size of the current chunk. */
+	size_t chunk_size;
+	/** errno of a failed operation. */
+	int error;
+};
+
+/**
+ * Initialize an unused file reader.
+ */
+void
+smtpc_mime_file_create(struct smtpc_mime_file *file);
+
+/**
+ * Close the file and free the memory of the reader.
+ */
+void
+smtpc_mime_file_destroy(struct smtpc_mime_file *file);
+
+/**
+ * Start reading a file segment.
+ */
+void
+smtpc_mime_file_open(struct smtpc_mime_file *file,
+		     const struct smtpc_mime_seg *seg);
+
+/**
+ * Read the next chunk of the file. The chunk is empty at the end
+ * of the file. The function yields.
+ * @param file file reader
+ * @param[out] data the chunk, valid until the next call
+ * @param[out] size size of the chunk
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_file_read(struct smtpc_mime_file *file, const char **data,
+		     size_t *size);
+
+/* File reader }}} */
+
+/* {{{ Composer */
+
+/**
+ * An attachment.
+ */
+struct smtpc_mime_attachment {
+	/** Attachment body. */
+	const char *body;
+	size_t body_size;
+	/** Path of a file to attach if there is no body. */
+	const char *path;
+	/** Content type, "text/plain" if NULL. */
+	const char *content_type;
+	/** Charset, "UTF-8" if NULL. */
+	const char *charset;
+	/** File name. */
+	const char *filename;
+	/** Whether to base64 encode the body or the file. */
+	bool base64;
+	/**
+	 * Whether to choose the transfer encoding by the content of
+	 * the body, base64 is ignored then. A file is base64 encoded.
+	 */
+	bool auto_encoding;
+};
+
+/**
+ * Message parts to compose a message from. All strings must
+ * outlive the composed message.
+ */
+struct smtpc_mime_message {
+	/** Value of the From header. */
+	const char *from;
+	/** Value of the To header. */
+	const char *to;
+	/** Value of the Cc header, no header if NULL. */
+	const char *cc;
+	/** Value of the Subject header, no header if NULL. */
+	const char *subject;
+	/** Additional header lines. */
+	const char **headers;
+	int header_count;
+	/** Content type of the body, "text/plain" if NULL. */
+	const char *content_type;
+	/** Charset of the body, "UTF-8" if NULL. */
+	const char *charset;
+	/** Body, streamed by a reader if NULL. */
+	const char *body;
+	size_t body_size;
+	/** Attachments. */
+	struct smtpc_mime_attachment *attachments;
+	int attachment_count;
+	/**
+	 * Whether to choose the transfer encoding by the content of
+	 * the body: it is sent as is if it is 7bit text with CRLF line
+	 * breaks, otherwise the shorter of quoted-printable and base64
+	 * is used.
+	 */
+	bool auto_encoding;
+	/**
+	 * Whether 8bit text may be sent as is, the relay must support
+	 * 8BITMIME then.
+	 */
+	bool allow_8bit;
+};
+
+/**
+ * Compose a message: headers, the body and attachments as a
+ * multipart/mixed message if there are attachments. A streamed
+ * body is sent as is.
+ * @param mime an empty message to compose into
+ * @param msg message parts
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_compose(struct smtpc_mime *mime,
+		   const struct smtpc_mime_message *msg);
+
+/* Composer }}} */
+
+/* {{{ Template */
+
+/**
+ * A piece of a message template.
+ */
+struct smtpc_mime_tpl_piece {
+	/** Static data or a variable name if is_var is set. */
+	const char *data;
+	size_t size;
+	/** File segment of an attached file or NULL. */
+	const struct smtpc_mime_seg *file;
+	/** Whether the piece is a variable. */
+	bool is_var;
+	/** Whether the variable is in the headers. */
+	bool in_header;
+};
+
+/**
+ * A message template: a composed message, which headers and body
+ * have {{name}} placeholders. The template is parsed once; a
+ * message is rendered by copying the variable values, while the
+ * static parts (attachments in the first place, which are encoded
+ * already) are referenced. The template message must outlive the
+ * template and the rendered messages.
+ */
+struct smtpc_mime_tpl {
+	struct smtpc_mime_tpl_piece *pieces;
+	int piece_count;
+	int piece_capacity;
+};
+
+/**
+ * Variable lookup callback of smtpc_mime_tpl_render().
+ * @param name variable name, it is not zero terminated
+ * @param name_len length of the name
+ * @param[out] size size of the value
+ * @param arg callback argument
+ * @return the value or NULL if the variable is not set
+ */
+typedef const char *
+(*smtpc_mime_var_f)(const char *name, size_t name_len, size_t *size,
+		    void *arg);
+
+/**
+ * Parse a composed message into a template.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_tpl_create(struct smtpc_mime_tpl *tpl,
+		      const struct smtpc_mime *mime);
+
+/**
+ * Free the memory of the template.
+ */
+void
+smtpc_mime_tpl_destroy(struct smtpc_mime_tpl *tpl);
+
+/**
+ * Render a message from the template. A variable in the headers
+ * must not contain line breaks.
+ * @param tpl template
+ * @param mime an empty message to render into
+ * @param lookup variable lookup callback
+ * @param arg callback argument
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_mime_tpl_render(const struct smtpc_mime_tpl *tpl,
+		      struct smtpc_mime *mime, smtpc_mime_var_f lookup,
+		      void *arg);
+
+/* Template }}} */
+
+#endif /* TARANTOOL_SMTP_MIME_H_INCLUDED */
@@ -0,0 +1,953 @@
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "native.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <curl/curl.h>
+#include <module.h>
+
+#include "base64.h"
+#include "smtpc.h"
+
+/** Default SMTP port. */
+#define SMTPC_NATIVE_PORT "25"
+
+/** Size of the reply buffer, a reply line is 512 bytes at most. */
+#define SMTPC_NATIVE_IN_SIZE 4096
+
+/** Size of a body chunk sent by one BDAT command. */
+#define SMTPC_NATIVE_CHUNK_SIZE 65536
+
+/**
+ * The maximum number of commands (RCPT TO, BDAT) sent ahead of
+ * their replies. The replies are read as the limit is reached, so
+ * the server is not blocked on a full socket buffer while sending
+ * them (RFC 2920, 3.5).
+ */
+#define SMTPC_NATIVE_PIPELINE_MAX 16
+
+/** Server address parsed from the request URL. */
+struct smtpc_native_url {
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	/** The domain to greet the server with. */
+	char domain[NI_MAXHOST];
+};
+
+/**
+ * SMTP session of a request. A session kept for the next request
+ * of a batch remembers the URL and the credentials it was opened
+ * with.
+ */
+struct smtpc_session {
+	struct smtpc_request *req;
+	char *url;
+	char *username;
+	char *password;
+	int fd;
+	/** Deadline of the session in fiber_clock() terms. */
+	double deadline;
+	/** Commands and data to send. */
+	char *out;
+	size_t out_size;
+	size_t out_capacity;
+	/** Received replies: the unparsed ones are [in_pos, in_size). */
+	char in[SMTPC_NATIVE_IN_SIZE];
+	size_t in_pos;
+	size_t in_size;
+	/** ESMTP extensions advertised by the server. */
+	bool pipelining;
+	bool chunking;
+	bool mime8bit;
+	bool auth_plain;
+};
+
+/**
+ * Fail the session with an SMTP level error: the request gets
+ * the status, the libcurl error code and the formatted reason.
+ * @return -1
+ */
+static int
+smtpc_session_fail(struct smtpc_session *s, int code, int status,
+		   const char *format, ...)
+{
+	struct smtpc_request *req = s->req;
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(req->error_buf, sizeof(req->error_buf), format, ap);
+	va_end(ap);
+	req->code = code;
+	req->status = status;
+	req->reason = req->error_buf;
+	return -1;
+}
+
+/**
+ * Check the fiber after a wait: a cancelled one fails the session
+ * with a diag error.
+ */
+static int
+smtpc_session_check_cancel(void)
+{
+	if (!fiber_is_cancelled())
+		return 0;
+	box_error_set(__FILE__, __LINE__, ER_FIBER_IS_CANCELLED,
+		      "fiber is cancelled");
+	return -1;
+}
+
+/**
+ * Wait for the socket to become ready until the deadline.
+ */
+static int
+smtpc_session_wait(struct smtpc_session *s, int events, double deadline)
+{
+	double timeout = deadline - fiber_clock();
+	if (timeout <= 0)
+		return smtpc_session_fail(s, CURLE_OPERATION_TIMEDOUT, -1,
+					  "Timeout was reached");
+	coio_wait(s->fd, events, timeout);
+	return smtpc_session_check_cancel();
+}
+
+/* {{{ Output */
+
+/** Make room for @a size more bytes of output. */
+static char *
+smtpc_session_reserve(struct smtpc_session *s, size_t size)
+{
+	if (s->out_size + size <= s->out_capacity)
+		return s->out + s->out_size;
+	size_t capacity = s->out_capacity > 0 ? s->out_capacity : 1024;
+	while (capacity < s->out_size + size)
+		capacity *= 2;
+	char *out = realloc(s->out, capacity);
+	if (out == NULL) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't allocate smtp session buffer");
+		return NULL;
+	}
+	s->out = out;
+	s->out_capacity = capacity;
+	return s->out + s->out_size;
+}
+
+static int
+smtpc_session_append(struct smtpc_session *s, const char *data, size_t size)
+{
+	char *p = smtpc_session_reserve(s, size);
+	if (p == NULL)
+		return -1;
+	memcpy(p, data, size);
+	s->out_size += size;
+	return 0;
+}
+
+/** Append a formatted command to the output. */
+static int
+smtpc_session_printf(struct smtpc_session *s, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int size = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	char *p = smtpc_session_reserve(s, size + 1);
+	if (p == NULL)
+		return -1;
+	va_start(ap, format);
+	vsnprintf(p, size + 1, format, ap);
+	va_end(ap);
+	s->out_size += size;
+	return 0;
+}
+
+/**
+ * Append a command with an address argument. The address is
+ * enclosed in angle brackets unless it already is, as libcurl
+ * does.
+ */
+static int
+smtpc_session_command_addr(struct smtpc_session *s, const char *command,
+			   const char *addr, const char *params)
+{
+	if (addr[0] == '<')
+		return smtpc_session_printf(s, "%s:%s%s\r\n", command, addr,
+					    params);
+	return smtpc_session_printf(s, "%s:<%s>%s\r\n", command, addr,
+				    params);
+}
+
+/** Send the whole output. */
+static int
+smtpc_session_flush(struct smtpc_session *s)
+{
+	size_t pos = 0;
+	while (pos < s->out_size) {
+		ssize_t n = send(s->fd, s->out + pos, s->out_size - pos,
+				 MSG_NOSIGNAL);
+		if (n >= 0) {
+			pos += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return smtpc_session_fail(s, CURLE_SEND_ERROR, -1,
+						  "Send failure: %s",
+						  strerror(errno));
+		if (smtpc_session_wait(s, COIO_WRITE, s->deadline) != 0)
+			return -1;
+	}
+	s->out_size = 0;
+	return 0;
+}
+
+/* }}} Output */
+
+/* {{{ Replies */
+
+/**
+ * Read the next reply line. The returned line is terminated by
+ * zero instead of CRLF and is valid until the next call.
+ */
+static const char *
+smtpc_session_read_line(struct smtpc_session *s)
+{
+	while (true) {
+		char *begin = s->in + s->in_pos;
+		char *end = memchr(begin, '\n', s->in_size - s->in_pos);
+		if (end != NULL) {
+			s->in_pos = end - s->in + 1;
+			if (end > begin && end[-1] == '\r')
+				--end;
+			*end = '\0';
+			return begin;
+		}
+		if (s->in_pos > 0) {
+			memmove(s->in, begin, s->in_size - s->in_pos);
+			s->in_size -= s->in_pos;
+			s->in_pos = 0;
+		}
+		if (s->in_size == sizeof(s->in)) {
+			smtpc_session_fail(s, CURLE_WEIRD_SERVER_REPLY, -1,
+					   "Too long server reply");
+			return NULL;
+		}
+		ssize_t n = recv(s->fd, s->in + s->in_size,
+				 sizeof(s->in) - s->in_size, 0);
+		if (n > 0) {
+			s->in_size += n;
+			continue;
+		}
+		if (n == 0) {
+			smtpc_session_fail(s, CURLE_RECV_ERROR, -1,
+					   "response reading failed");
+			return NULL;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			smtpc_session_fail(s, CURLE_RECV_ERROR, -1,
+					   "response reading failed "
+					   "(errno: %d)", errno);
+			return NULL;
+		}
+		if (smtpc_session_wait(s, COIO_READ, s->deadline) != 0)
+			return NULL;
+	}
+}
+
+/** Remember an ESMTP extension advertised in an EHLO reply line. */
+static void
+smtpc_session_parse_ehlo(struct smtpc_session *s, const char *line)
+{
+	if (strcasecmp(line, "PIPELINING") == 0) {
+		s->pipelining = true;
+	} else if (strcasecmp(line, "CHUNKING") == 0) {
+		s->chunking = true;
+	} else if (strcasecmp(line, "8BITMIME") == 0) {
+		s->mime8bit = true;
+	} else if (strncasecmp(line, "AUTH", 4) == 0 &&
+		   (line[4] == ' ' || line[4] == '=')) {
+		for (const char *p = line + 5; *p != '\0';) {
+			size_t len = strcspn(p, " ");
+			if (len == 5 && strncasecmp(p, "PLAIN", len) == 0)
+				s->auth_plain = true;
+			p += len;
+			p += strspn(p, " ");
+		}
+	}
+}
+
+/**
+ * Read a reply, possibly a multiline one.
+ * @param ehlo parse the extensions of an EHLO reply
+ * @return the reply code or -1
+ */
+static int
+smtpc_session_read_reply(struct smtpc_session *s, bool ehlo)
+{
+	bool first = true;
+	while (true) {
+		const char *line = smtpc_session_read_line(s);
+		if (line == NULL)
+			return -1;
+		if (strlen(line) < 3 || line[0] < '1' || line[0] > '5' ||
+		    line[1] < '0' || line[1] > '9' ||
+		    line[2] < '0' || line[2] > '9' ||
+		    (line[3] != '\0' && line[3] != ' ' && line[3] != '-'))
+			return smtpc_session_fail(s, CURLE_WEIRD_SERVER_REPLY,
+						  -1, "Weird server reply");
+		/* The first line of an EHLO reply is a greeting. */
+		if (ehlo && !first && line[3] != '\0')
+			smtpc_session_parse_ehlo(s, line + 4);
+		if (line[3] != '-')
+			return atoi(line);
+		first = false;
+	}
+}
+
+/* }}} Replies */
+
+/* {{{ Connection */
+
+/**
+ * Parse a URL: smtp://host[:port][/domain]. The scheme may be
+ * omitted; IPv6 addresses are enclosed in brackets.
+ */
+static int
+smtpc_native_parse_url(const char *url, struct smtpc_native_url *u)
+{
+	const char *p = strstr(url, "://");
+	if (p != NULL) {
+		if (p - url != 4 || strncasecmp(url, "smtp", 4) != 0)
+			goto unsupported;
+		p += 3;
+	} else {
+		p = url;
+	}
+	const char *host = p, *host_end;
+	if (*p == '[') {
+		host = ++p;
+		host_end = strchr(p, ']');
+		if (host_end == NULL)
+			goto invalid;
+		p = host_end + 1;
+	} else {
+		host_end = p + strcspn(p, ":/");
+		p = host_end;
+	}
+	if (host_end == host || memchr(host, '@', host_end - host) != NULL ||
+	    (size_t)(host_end - host) >= sizeof(u->host))
+		goto invalid;
+	memcpy(u->host, host, host_end - host);
+	u->host[host_end - host] = '\0';
+	strcpy(u->port, SMTPC_NATIVE_PORT);
+	if (*p == ':') {
+		size_t len = strcspn(++p, "/");
+		if (len == 0 || len >= sizeof(u->port) ||
+		    strspn(p, "0123456789") != len)
+			goto invalid;
+		memcpy(u->port, p, len);
+		u->port[len] = '\0';
+		p += len;
+	}
+	strcpy(u->domain, "localhost");
+	if (*p == '/' && p[1] != '\0') {
+		if (strlen(p + 1) >= sizeof(u->domain))
+			goto invalid;
+		strcpy(u->domain, p + 1);
+	} else if (*p != '\0' && *p != '/') {
+		goto invalid;
+	}
+	return 0;
+unsupported:
+	box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+		      "SMTP native engine supports smtp:// URLs only");
+	return -1;
+invalid:
+	box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+		      "Invalid SMTP URL: %s", url);
+	return -1;
+}
+
+/**
+ * Connect a new socket to the address.
+ * @retval 0 connected
+ * @retval 1 not connected, the next address may be tried
+ * @retval -1 the fiber is cancelled
+ */
+static int
+smtpc_session_connect_addr(struct smtpc_session *s,
+			   const struct addrinfo *ai, double deadline)
+{
+	s->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (s->fd < 0)
+		return 1;
+	int rc = 1;
+	int flags = fcntl(s->fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		goto fail;
+	if (connect(s->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		goto fail;
+	while (true) {
+		double timeout = deadline - fiber_clock();
+		if (timeout <= 0)
+			goto fail;
+		int revents = coio_wait(s->fd, COIO_WRITE, timeout);
+		if (smtpc_session_check_cancel() != 0) {
+			rc = -1;
+			goto fail;
+		}
+		if (revents != 0)
+			break;
+	}
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 &&
+	    error == 0)
+		return 0;
+fail:
+	coio_close(s->fd);
+	s->fd = -1;
+	return rc;
+}
+
+/**
+ * Connect to the first reachable address of the server. The
+ * timeout bounds the name resolution and the connection.
+ */
+static int
+smtpc_session_connect(struct smtpc_session *s,
+		      const struct smtpc_native_url *u, double timeout)
+{
+	double deadline = fiber_clock() + timeout;
+	if (deadline > s->deadline)
+		deadline = s->deadline;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	struct addrinfo *ai_list = NULL;
+	if (coio_getaddrinfo(u->host, u->port, &hints, &ai_list,
+			     deadline - fiber_clock()) != 0) {
+		if (smtpc_session_check_cancel() != 0)
+			return -1;
+		if (fiber_clock() >= deadline)
+			return smtpc_session_fail(s, CURLE_OPERATION_TIMEDOUT,
+						  -1, "Timeout was reached");
+		return smtpc_session_fail(s, CURLE_COULDNT_RESOLVE_HOST, -1,
+					  "Couldn't resolve host name");
+	}
+	int rc = 1;
+	for (struct addrinfo *ai = ai_list; ai != NULL && rc > 0 &&
+	     fiber_clock() < deadline; ai = ai->ai_next)
+		rc = smtpc_session_connect_addr(s, ai, deadline);
+	freeaddrinfo(ai_list);
+	if (rc < 0)
+		return -1;
+	if (rc > 0) {
+		if (fiber_clock() >= deadline)
+			return smtpc_session_fail(s, CURLE_OPERATION_TIMEDOUT,
+						  -1, "Timeout was reached");
+		return smtpc_session_fail(s, CURLE_COULDNT_CONNECT, -1,
+					  "Couldn't connect to server");
+	}
+	/* Pipelined commands must not wait for delayed ACKs. */
+	int one = 1;
+	setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+/* }}} Connection */
+
+/* {{{ Protocol */
+
+/** Read the greeting and greet the server. */
+static int
+smtpc_session_hello(struct smtpc_session *s, const char *domain)
+{
+	int code = smtpc_session_read_reply(s, false);
+	if (code < 0)
+		return -1;
+	if (code != 220)
+		return smtpc_session_fail(s, CURLE_WEIRD_SERVER_REPLY, code,
+					  "Got unexpected smtp-server "
+					  "response: %d", code);
+	if (smtpc_session_printf(s, "EHLO %s\r\n", domain) != 0 ||
+	    smtpc_session_flush(s) != 0)
+		return -1;
+	code = smtpc_session_read_reply(s, true);
+	if (code < 0)
+		return -1;
+	if (code == 250)
+		return 0;
+	/* The server does not support ESMTP. */
+	if (smtpc_session_printf(s, "HELO %s\r\n", domain) != 0 ||
+	    smtpc_session_flush(s) != 0)
+		return -1;
+	code = smtpc_session_read_reply(s, false);
+	if (code < 0)
+		return -1;
+	if (code != 250)
+		return smtpc_session_fail(s, CURLE_REMOTE_ACCESS_DENIED, code,
+					  "Remote access denied: %d", code);
+	return 0;
+}
+
+/** Authenticate by the PLAIN mechanism (RFC 4616). */
+static int
+smtpc_session_auth(struct smtpc_session *s)
+{
+	struct smtpc_request *req = s->req;
+	if (!s->auth_plain)
+		return smtpc_session_fail(s, CURLE_LOGIN_DENIED, -1,
+					  "No known authentication "
+					  "mechanisms supported");
+	const char *password = req->password != NULL ? req->password : "";
+	size_t username_len = strlen(req->username);
+	size_t password_len = strlen(password);
+	/* authzid NUL authcid NUL passwd, authzid is empty. */
+	size_t size = username_len + password_len + 2;
+	char *plain = malloc(size + smtpc_base64_encoded_size(size));
+	if (plain == NULL) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't allocate smtp session buffer");
+		return -1;
+	}
+	plain[0] = '\0';
+	memcpy(plain + 1, req->username, username_len + 1);
+	memcpy(plain + username_len + 2, password, password_len);
+	char *encoded = plain + size;
+	size_t len = smtpc_base64_encode(plain, size, encoded);
+	/* The response is one line. */
+	size_t encoded_len = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (encoded[i] != '\r' && encoded[i] != '\n')
+			encoded[encoded_len++] = encoded[i];
+	}
+	int rc = smtpc_session_printf(s, "AUTH PLAIN %.*s\r\n",
+				      (int)encoded_len, encoded);
+	free(plain);
+	if (rc != 0 || smtpc_session_flush(s) != 0)
+		return -1;
+	int code = smtpc_session_read_reply(s, false);
+	if (code < 0)
+		return -1;
+	if (code != 235)
+		return smtpc_session_fail(s, CURLE_LOGIN_DENIED, code,
+					  "Authentication failed: %d", code);
+	return 0;
+}
+
+/**
+ * Send the envelope: MAIL FROM, RCPT TO of every recipient and
+ * DATA unless the body is sent by BDAT. With PIPELINING up to
+ * SMTPC_NATIVE_PIPELINE_MAX commands are sent ahead of their
+ * replies, otherwise each command waits for its reply.
+ */
+static int
+smtpc_session_envelope(struct smtpc_session *s)
+{
+	struct smtpc_request *req = s->req;
+	const char *from = req->from != NULL ? req->from : "";
+	const char *params = s->mime8bit ? " BODY=8BITMIME" : "";
+	bool data = !s->chunking;
+	int total = data ? 2 : 1;
+	for (struct curl_slist *rcpt = req->recipients; rcpt != NULL;
+	     rcpt = rcpt->next)
+		++total;
+	int limit = s->pipelining ? SMTPC_NATIVE_PIPELINE_MAX : 1;
+	struct curl_slist *rcpt = req->recipients;
+	int sent = 0;
+	for (int checked = 0; checked < total; ++checked) {
+		for (; sent < total && sent - checked < limit; ++sent) {
+			int rc;
+			if (sent == 0) {
+				rc = smtpc_session_command_addr(s, "MAIL FROM",
+								from, params);
+			} else if (rcpt != NULL) {
+				rc = smtpc_session_command_addr(s, "RCPT TO",
+								rcpt->data, "");
+				rcpt = rcpt->next;
+			} else {
+				rc = smtpc_session_append(s, "DATA\r\n", 6);
+			}
+			if (rc != 0)
+				return -1;
+		}
+		if (smtpc_session_flush(s) != 0)
+			return -1;
+		int code = smtpc_session_read_reply(s, false);
+		if (code < 0)
+			return -1;
+		if (checked == 0) {
+			if (code != 250)
+				return smtpc_session_fail(s, CURLE_SEND_ERROR,
+							  code,
+							  "MAIL failed: %d",
+							  code);
+		} else if (data && checked == total - 1) {
+			if (code != 354)
+				return smtpc_session_fail(s, CURLE_SEND_ERROR,
+							  code,
+							  "DATA failed: %d",
+							  code);
+		} else if (code != 250 && code != 251) {
+			return smtpc_session_fail(s, CURLE_SEND_ERROR, code,
+						  "RCPT failed: %d", code);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Send the body after DATA: dots at line starts are doubled and
+ * the body is terminated by a line with a single dot.
+ * @return the reply code or -1
+ */
+static int
+smtpc_session_send_data(struct smtpc_session *s, char *chunk)
+{
+	/* 2 at a line start, 1 after CR, 0 otherwise. */
+	int eol = 2;
+	while (true) {
+		ssize_t size = smtpc_request_read(s->req, chunk,
+						  SMTPC_NATIVE_CHUNK_SIZE);
+		if (size < 0)
+			return -1;
+		if (size == 0)
+			break;
+		/* A line is 3 bytes at least, so a third more at most. */
+		char *p = smtpc_session_reserve(s, size + size / 3 + 1);
+		if (p == NULL)
+			return -1;
+		for (ssize_t i = 0; i < size; i++) {
+			char c = chunk[i];
+			if (c == '.' && eol == 2)
+				*p++ = '.';
+			*p++ = c;
+			eol = c == '\r' ? 1 : c == '\n' && eol == 1 ? 2 : 0;
+		}
+		s->out_size = p - s->out;
+		if (smtpc_session_flush(s) != 0)
+			return -1;
+	}
+	const char *end = eol == 2 ? ".\r\n" : "\r\n.\r\n";
+	if (smtpc_session_append(s, end, strlen(end)) != 0 ||
+	    smtpc_session_flush(s) != 0)
+		return -1;
+	return smtpc_session_read_reply(s, false);
+}
+
+/**
+ * Send the body by BDAT chunks (RFC 3030). The next chunk is read
+ * ahead, so the last one is marked with LAST without an extra
+ * empty chunk. With PIPELINING the chunks don't wait for the
+ * replies.
+ * @return the reply code of the last chunk or -1
+ */
+static int
+smtpc_session_send_bdat(struct smtpc_session *s, char *chunk)
+{
+	char *next = chunk + SMTPC_NATIVE_CHUNK_SIZE;
+	ssize_t size = smtpc_request_read(s->req, chunk,
+					  SMTPC_NATIVE_CHUNK_SIZE);
+	if (size < 0)
+		return -1;
+	int pending = 0;
+	int code = 0;
+	bool last = false;
+	while (!last) {
+		ssize_t next_size = 0;
+		if (size > 0) {
+			next_size = smtpc_request_read(s->req, next,
+						       SMTPC_NATIVE_CHUNK_SIZE);
+			if (next_size < 0)
+				return -1;
+		}
+		last = next_size == 0;
+		if (smtpc_session_printf(s, "BDAT %zd%s\r\n", size,
+					 last ? " LAST" : "") != 0 ||
+		    smtpc_session_append(s, chunk, size) != 0 ||
+		    smtpc_session_flush(s) != 0)
+			return -1;
+		++pending;
+		int limit = s->pipelining && !last ?
+			    SMTPC_NATIVE_PIPELINE_MAX : 0;
+		while (pending > limit) {
+			code = smtpc_session_read_reply(s, false);
+			if (code != 250)
+				return code;
+			--pending;
+		}
+		char *tmp = chunk;
+		chunk = next;
+		next = tmp;
+		size = next_size;
+	}
+	return code;
+}
+
+/** Send the message and check the final reply. */
+static int
+smtpc_session_message(struct smtpc_session *s)
+{
+	struct smtpc_request *req = s->req;
+	/* BDAT reads the next chunk ahead of the current one. */
+	size_t chunks = s->chunking ? 2 : 1;
+	char *chunk = malloc(chunks * SMTPC_NATIVE_CHUNK_SIZE);
+	if (chunk == NULL) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't allocate smtp session buffer");
+		return -1;
+	}
+	int code = s->chunking ? smtpc_session_send_bdat(s, chunk) :
+		   smtpc_session_send_data(s, chunk);
+	free(chunk);
+	if (code < 0)
+		return -1;
+	if (code != 250)
+		return smtpc_session_fail(s, CURLE_SEND_ERROR, code,
+					  "Message failed: %d", code);
+	req->status = code;
+	req->reason = "Ok";
+	return 0;
+}
+
+/**
+ * Say goodbye. The reply is not awaited: the message is accepted
+ * already.
+ */
+static void
+smtpc_session_quit(struct smtpc_session *s)
+{
+	send(s->fd, "QUIT\r\n", 6, MSG_NOSIGNAL);
+}
+
+/**
+ * Reset a session kept from the previous request. It also checks
+ * that the server has not closed the connection meanwhile.
+ */
+static int
+smtpc_session_reset(struct smtpc_session *s)
+{
+	if (smtpc_session_append(s, "RSET\r\n", 6) != 0 ||
+	    smtpc_session_flush(s) != 0)
+		return -1;
+	int code = smtpc_session_read_reply(s, false);
+	if (code < 0)
+		return -1;
+	if (code != 250)
+		return smtpc_session_fail(s, CURLE_SEND_ERROR, code,
+					  "RSET failed: %d", code);
+	return 0;
+}
+
+/* }}} Protocol */
+
+int
+smtpc_native_check(const struct smtpc_request *req)
+{
+	struct smtpc_native_url u;
+	if (smtpc_native_parse_url(req->url, &u) != 0)
+		return -1;
+	if (req->use_ssl != CURLUSESSL_NONE) {
+		box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+			      "SMTP native engine does not support TLS");
+		return -1;
+	}
+	return 0;
+}
+
+/** Compare optional strings. */
+static bool
+smtpc_native_str_eq(const char *a, const char *b)
+{
+	return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+/** Check if a kept session may send the request. */
+static bool
+smtpc_session_matches(const struct smtpc_session *s,
+		      const struct smtpc_request *req)
+{
+	return strcmp(s->url, req->url) == 0 &&
+	       smtpc_native_str_eq(s->username, req->username) &&
+	       smtpc_native_str_eq(s->password, req->password);
+}
+
+/** Close the connection of the session, if any, without QUIT. */
+static void
+smtpc_session_disconnect(struct smtpc_session *s)
+{
+	if (s->fd >= 0)
+		coio_close(s->fd);
+	s->fd = -1;
+	s->in_pos = 0;
+	s->in_size = 0;
+	s->out_size = 0;
+	s->pipelining = false;
+	s->chunking = false;
+	s->mime8bit = false;
+	s->auth_plain = false;
+}
+
+/** Connect, greet the server and authenticate. */
+static int
+smtpc_session_open(struct smtpc_session *s, const struct smtpc_native_url *u,
+		   double timeout)
+{
+	struct smtpc_request *req = s->req;
+	double connect_timeout = req->connect_timeout > 0 ?
+				 req->connect_timeout : timeout;
+	if (smtpc_session_connect(s, u, connect_timeout) != 0 ||
+	    smtpc_session_hello(s, u->domain) != 0 ||
+	    (req->username != NULL && smtpc_session_auth(s) != 0))
+		return -1;
+	return 0;
+}
+
+/**
+ * Remember the URL and the credentials of the session to check
+ * the next request against them. A session, which can't remember
+ * them, is not kept.
+ */
+static int
+smtpc_session_remember(struct smtpc_session *s,
+		       const struct smtpc_request *req)
+{
+	s->url = strdup(req->url);
+	s->username = req->username != NULL ? strdup(req->username) : NULL;
+	s->password = req->password != NULL ? strdup(req->password) : NULL;
+	if (s->url == NULL || (req->username != NULL && s->username == NULL) ||
+	    (req->password != NULL && s->password == NULL)) {
+		free(s->url);
+		free(s->username);
+		free(s->password);
+		s->url = s->username = s->password = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+smtpc_native_session_close(struct smtpc_session *s)
+{
+	if (s->fd >= 0)
+		smtpc_session_quit(s);
+	smtpc_session_disconnect(s);
+	free(s->out);
+	free(s->url);
+	free(s->username);
+	free(s->password);
+	free(s);
+}
+
+int
+smtpc_native_execute(struct smtpc_request *req, double timeout,
+		     struct smtpc_session **session)
+{
+	struct smtpc_native_url u;
+	if (smtpc_native_parse_url(req->url, &u) != 0)
+		return -1;
+	struct smtpc_session *s = session != NULL ? *session : NULL;
+	if (session != NULL)
+		*session = NULL;
+	if (s != NULL && !smtpc_session_matches(s, req)) {
+		smtpc_native_session_close(s);
+		s = NULL;
+	}
+	if (s == NULL) {
+		s = calloc(1, sizeof(*s));
+		if (s == NULL) {
+			box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+				      "Can't allocate smtp session");
+			return -1;
+		}
+		s->fd = -1;
+	}
+	s->req = req;
+	s->deadline = fiber_clock() + timeout;
+	req->code = CURLE_OK;
+	req->status = -1;
+	req->reason = NULL;
+	int rc = -1;
+	/* The server may have closed a kept connection: open a new one. */
+	if (s->fd >= 0 && smtpc_session_reset(s) != 0) {
+		if (fiber_is_cancelled())
+			goto out;
+		smtpc_session_disconnect(s);
+		req->code = CURLE_OK;
+		req->status = -1;
+		req->reason = NULL;
+	}
+	if ((s->fd < 0 && smtpc_session_open(s, &u, timeout) != 0) ||
+	    smtpc_session_envelope(s) != 0 ||
+	    smtpc_session_message(s) != 0)
+		goto out;
+	rc = 0;
+out:
+	/*
+	 * Only a session after an accepted message is kept: a failed
+	 * one may have pipelined replies left unread.
+	 */
+	if (rc == 0 && session != NULL &&
+	    (s->url != NULL || smtpc_session_remember(s, req) == 0)) {
+		*session = s;
+	} else {
+		/* QUIT only after an accepted message. */
+		if (rc != 0)
+			smtpc_session_disconnect(s);
+		smtpc_native_session_close(s);
+	}
+	/* An SMTP level failure is reported by the status. */
+	if (rc != 0 && req->code != CURLE_OK)
+		rc = 0;
+	return rc;
+}
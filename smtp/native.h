@@ -0,0 +1,94 @@
+#ifndef TARANTOOL_SMTP_NATIVE_H_INCLUDED
+#define TARANTOOL_SMTP_NATIVE_H_INCLUDED 1
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * The native SMTP engine.
+ *
+ * A request is executed in the calling fiber on a non-blocking
+ * socket driven by coio, without libcurl. The engine uses the
+ * ESMTP extensions advertised by the server:
+ *
+ * - PIPELINING (RFC 2920): MAIL FROM, RCPT TO and DATA are sent
+ *   ahead of their replies, up to a window of commands, so a
+ *   message takes a few round trips regardless of the number of
+ *   recipients;
+ * - CHUNKING (RFC 3030): the body is sent by BDAT chunks without
+ *   dot-stuffing;
+ * - 8BITMIME (RFC 6152): the body is declared as 8-bit;
+ * - AUTH PLAIN (RFC 4954) if a username is set.
+ *
+ * TLS is not supported: only smtp:// URLs without use_ssl are
+ * accepted. A connection is used for one request or kept for the
+ * next requests of a batch.
+ */
+
+struct smtpc_request;
+struct smtpc_session;
+
+/**
+ * Check that the request can be executed by the native engine:
+ * the URL is an smtp:// one and TLS is not requested.
+ * @param req request
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_native_check(const struct smtpc_request *req);
+
+/**
+ * Execute the request. The SMTP status and the reason are stored
+ * to the request like libcurl results are: the status is -1 if
+ * there is no reply, the code field is set to the matching
+ * libcurl error code.
+ * @param req request
+ * @param timeout timeout of the whole session in seconds
+ * @param session NULL to open a connection for the request only;
+ *        otherwise the session kept by the previous request or
+ *        NULL, which is replaced with the session to keep for the
+ *        next one (NULL if the message has not been accepted)
+ * @retval 0 on success, check the request status
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_native_execute(struct smtpc_request *req, double timeout,
+		     struct smtpc_session **session);
+
+/**
+ * Say QUIT and close a session kept by smtpc_native_execute().
+ * @param session session
+ */
+void
+smtpc_native_session_close(struct smtpc_session *session);
+
+#endif /* TARANTOOL_SMTP_NATIVE_H_INCLUDED */
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "qp.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#define QP_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/** The number of bytes checked at once. */
+#define QP_BLOCK 16
+
+static const char qp_hex[] = "0123456789ABCDEF";
+
+/**
+ * Whether a block of QP_BLOCK bytes consists of printable ASCII
+ * characters and spaces only, '=' excluded: such a block needs no
+ * encoding and has no line breaks.
+ */
+static inline bool
+qp_block_is_plain(const char *p)
+{
+#ifdef QP_SSE2
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	/* Bytes with the high bit set are negative, so they are less too. */
+	__m128i special = _mm_or_si128(
+		_mm_cmplt_epi8(v, _mm_set1_epi8(' ')),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')),
+			     _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))));
+	return _mm_movemask_epi8(special) == 0;
+#else
+	(void)p;
+	return false;
+#endif
+}
+
+static inline bool
+qp_is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+void
+smtpc_qp_scan(const char *data, size_t size, struct smtpc_qp_scan *scan)
+{
+	memset(scan, 0, sizeof(*scan));
+	size_t line = 0;
+	size_t i = 0;
+	while (i < size) {
+		if (i + QP_BLOCK <= size && qp_block_is_plain(data + i)) {
+			line += QP_BLOCK;
+			i += QP_BLOCK;
+			continue;
+		}
+		unsigned char c = data[i++];
+		if ((c == '\n' || c == '\r') && i > 1 && qp_is_space(data[i - 2])) {
+			/* Whitespace at the end of a line is encoded. */
+			scan->escaped++;
+		}
+		if (c == '\n') {
+			if (i == 1 || data[i - 2] != '\r')
+				scan->bare_lf++;
+			if (line > scan->max_line)
+				scan->max_line = line;
+			line = 0;
+			continue;
+		}
+		if (c == '\r' && i < size && data[i] == '\n')
+			continue;
+		if (c == '\r') {
+			scan->bare_cr++;
+			scan->escaped++;
+		} else if (c == '\0') {
+			scan->nul++;
+			scan->escaped++;
+		} else if (c >= 0x80) {
+			scan->high++;
+			scan->escaped++;
+		} else if ((c < ' ' && c != '\t') || c == '=' || c == 0x7f) {
+			scan->escaped++;
+		}
+		line++;
+	}
+	if (size > 0 && qp_is_space(data[size - 1]))
+		scan->escaped++;
+	if (line > scan->max_line)
+		scan->max_line = line;
+}
+
+size_t
+smtpc_qp_encoded_size(size_t size, const struct smtpc_qp_scan *scan)
+{
+	/* An encoded byte takes 3 characters, a bare LF becomes CRLF. */
+	size_t len = size + scan->escaped * 2 + scan->bare_lf;
+	/* A soft line break follows SMTPC_QP_LINE_LEN - 3 characters at least. */
+	return len + len / (SMTPC_QP_LINE_LEN - 3) * 3;
+}
+
+size_t
+smtpc_qp_encode(const char *in, size_t size, char *out)
+{
+	char *p = out;
+	/* Length of the current line, '=' of a soft break aside. */
+	size_t col = 0;
+	size_t i = 0;
+	while (i < size) {
+		/* A space before the next block may end a line. */
+		if (i + QP_BLOCK <= size &&
+		    col + QP_BLOCK < SMTPC_QP_LINE_LEN &&
+		    qp_block_is_plain(in + i) &&
+		    !qp_is_space(in[i + QP_BLOCK - 1])) {
+			memcpy(p, in + i, QP_BLOCK);
+			p += QP_BLOCK;
+			col += QP_BLOCK;
+			i += QP_BLOCK;
+			continue;
+		}
+		unsigned char c = in[i++];
+		if (c == '\r' && i < size && in[i] == '\n')
+			c = in[i++];
+		if (c == '\n') {
+			*p++ = '\r';
+			*p++ = '\n';
+			col = 0;
+			continue;
+		}
+		bool literal;
+		if (qp_is_space(c))
+			literal = i < size && in[i] != '\n' && in[i] != '\r';
+		else
+			literal = c > ' ' && c < 0x7f && c != '=';
+		size_t len = literal ? 1 : 3;
+		if (col + len >= SMTPC_QP_LINE_LEN) {
+			*p++ = '=';
+			*p++ = '\r';
+			*p++ = '\n';
+			col = 0;
+		}
+		if (literal) {
+			*p++ = c;
+		} else {
+			*p++ = '=';
+			*p++ = qp_hex[c >> 4];
+			*p++ = qp_hex[c & 0xf];
+		}
+		col += len;
+	}
+	return p - out;
+}
@@ -0,0 +1,90 @@
+#ifndef TARANTOOL_SMTP_QP_H_INCLUDED
+#define TARANTOOL_SMTP_QP_H_INCLUDED 1
+/*
+ * Copyright 2010-2023, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+/**
+ * Quoted-printable encoder for text parts (RFC 2045) and a scanner
+ * of the content, which helps to choose a transfer encoding.
+ *
+ * Both skip runs of printable ASCII characters by 16 bytes with
+ * SSE2 when it is available.
+ */
+
+/** Maximum length of an encoded line. */
+#define SMTPC_QP_LINE_LEN 76
+/** Maximum length of a line of 7bit and 8bit data (RFC 5322). */
+#define SMTPC_QP_MAX_LINE 998
+
+/**
+ * What the data consists of.
+ */
+struct smtpc_qp_scan {
+	/** The number of bytes with the high bit set. */
+	size_t high;
+	/** The number of NUL bytes. */
+	size_t nul;
+	/** The number of CR, which are not followed by LF. */
+	size_t bare_cr;
+	/** The number of LF, which are not preceded by CR. */
+	size_t bare_lf;
+	/** The length of the longest line without the line break. */
+	size_t max_line;
+	/** The number of bytes, which are quoted-printable encoded. */
+	size_t escaped;
+};
+
+/**
+ * Scan the data.
+ */
+void
+smtpc_qp_scan(const char *data, size_t size, struct smtpc_qp_scan *scan);
+
+/**
+ * The maximum size of the encoded data, see smtpc_qp_scan().
+ */
+size_t
+smtpc_qp_encoded_size(size_t size, const struct smtpc_qp_scan *scan);
+
+/**
+ * Encode text: line breaks (CRLF or LF) become CRLF, lines are
+ * split by soft line breaks to SMTPC_QP_LINE_LEN characters.
+ * @param in data to encode
+ * @param size size of the data
+ * @param out output buffer of smtpc_qp_encoded_size() bytes
+ * @return the number of bytes written
+ */
+size_t
+smtpc_qp_encode(const char *in, size_t size, char *out);
+
+#endif /* TARANTOOL_SMTP_QP_H_INCLUDED */
@@ -30,12 +30,16 @@
  */
 
 #include "smtpc.h"
+#include "dkim.h"
+#include "native.h"
 
 #include <stdlib.h>
 #include <string.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <dlfcn.h>
+#include <limits.h>
 #include <curl/curl.h>
 
 #include <module.h>
@@ -58,6 +62,8 @@
  */
 #undef curl_easy_getinfo
 #undef curl_easy_setopt
+#undef curl_multi_setopt
+#undef curl_share_setopt
 
 /*
  * Storage for libcurl function pointers.
@@ -67,11 +73,22 @@
 define_func_ptr(curl_easy_cleanup)
 define_func_ptr(curl_easy_getinfo)
 define_func_ptr(curl_easy_init)
-define_func_ptr(curl_easy_perform)
+define_func_ptr(curl_easy_pause)
+define_func_ptr(curl_easy_reset)
 define_func_ptr(curl_easy_setopt)
 define_func_ptr(curl_easy_strerror)
-define_func_ptr(curl_slist_append)
-define_func_ptr(curl_slist_free_all)
+define_func_ptr(curl_multi_add_handle)
+define_func_ptr(curl_multi_assign)
+define_func_ptr(curl_multi_cleanup)
+define_func_ptr(curl_multi_info_read)
+define_func_ptr(curl_multi_init)
+define_func_ptr(curl_multi_remove_handle)
+define_func_ptr(curl_multi_setopt)
+define_func_ptr(curl_multi_socket_action)
+define_func_ptr(curl_multi_strerror)
+define_func_ptr(curl_share_cleanup)
+define_func_ptr(curl_share_init)
+define_func_ptr(curl_share_setopt)
 define_func_ptr(curl_version_info)
 #undef define_func_ptr
 
@@ -79,11 +96,22 @@ define_func_ptr(curl_version_info)
 #define curl_easy_cleanup	curl_easy_cleanup_ptr
 #define curl_easy_getinfo	curl_easy_getinfo_ptr
 #define curl_easy_init		curl_easy_init_ptr
-#define curl_easy_perform	curl_easy_perform_ptr
+#define curl_easy_pause		curl_easy_pause_ptr
+#define curl_easy_reset		curl_easy_reset_ptr
 #define curl_easy_setopt	curl_easy_setopt_ptr
 #define curl_easy_strerror	curl_easy_strerror_ptr
-#define curl_slist_append	curl_slist_append_ptr
-#define curl_slist_free_all	curl_slist_free_all_ptr
+#define curl_multi_add_handle	curl_multi_add_handle_ptr
+#define curl_multi_assign	curl_multi_assign_ptr
+#define curl_multi_cleanup	curl_multi_cleanup_ptr
+#define curl_multi_info_read	curl_multi_info_read_ptr
+#define curl_multi_init		curl_multi_init_ptr
+#define curl_multi_remove_handle	curl_multi_remove_handle_ptr
+#define curl_multi_setopt	curl_multi_setopt_ptr
+#define curl_multi_socket_action	curl_multi_socket_action_ptr
+#define curl_multi_strerror	curl_multi_strerror_ptr
+#define curl_share_cleanup	curl_share_cleanup_ptr
+#define curl_share_init		curl_share_init_ptr
+#define curl_share_setopt	curl_share_setopt_ptr
 #define curl_version_info	curl_version_info_ptr
 
 /* dlopen() handle. Saved to call dlclose(). */
@@ -131,11 +159,22 @@ bind_libcurl_functions(const char *libname, void *libcurl_handle)
 	load_func(libname, libcurl_handle, curl_easy_cleanup);
 	load_func(libname, libcurl_handle, curl_easy_getinfo);
 	load_func(libname, libcurl_handle, curl_easy_init);
-	load_func(libname, libcurl_handle, curl_easy_perform);
+	load_func(libname, libcurl_handle, curl_easy_pause);
+	load_func(libname, libcurl_handle, curl_easy_reset);
 	load_func(libname, libcurl_handle, curl_easy_setopt);
 	load_func(libname, libcurl_handle, curl_easy_strerror);
-	load_func(libname, libcurl_handle, curl_slist_append);
-	load_func(libname, libcurl_handle, curl_slist_free_all);
+	load_func(libname, libcurl_handle, curl_multi_add_handle);
+	load_func(libname, libcurl_handle, curl_multi_assign);
+	load_func(libname, libcurl_handle, curl_multi_cleanup);
+	load_func(libname, libcurl_handle, curl_multi_info_read);
+	load_func(libname, libcurl_handle, curl_multi_init);
+	load_func(libname, libcurl_handle, curl_multi_remove_handle);
+	load_func(libname, libcurl_handle, curl_multi_setopt);
+	load_func(libname, libcurl_handle, curl_multi_socket_action);
+	load_func(libname, libcurl_handle, curl_multi_strerror);
+	load_func(libname, libcurl_handle, curl_share_cleanup);
+	load_func(libname, libcurl_handle, curl_share_init);
+	load_func(libname, libcurl_handle, curl_share_setopt);
 	load_func(libname, libcurl_handle, curl_version_info);
 
 	/* Verify that given libcurl supports smtp(s). */
@@ -210,215 +249,1984 @@ smtpc_init(void)
 
 /* Subsystem initialization }}} */
 
+/* {{{ Multi engine */
+
+/**
+ * A socket libcurl asked to watch.
+ *
+ * Each socket is served by a fiber, which waits for the socket
+ * events using coio_wait() and passes them to libcurl. The
+ * fiber exits and frees the structure once libcurl no longer
+ * needs the socket.
+ */
+struct smtpc_sock {
+	/** Environment, NULL when it is destroyed. */
+	struct smtpc_env *env;
+	/** Socket file descriptor. */
+	curl_socket_t fd;
+	/** COIO_READ and/or COIO_WRITE. */
+	int events;
+	/** Set when libcurl removes the socket. */
+	bool removed;
+	/** Fiber waiting for the socket events. */
+	struct fiber *fiber;
+	/** Neighbours in the list of the environment sockets. */
+	struct smtpc_sock *prev;
+	struct smtpc_sock *next;
+};
+
+/**
+ * libcurl timer.
+ *
+ * Served by a fiber, which calls curl_multi_socket_action()
+ * with CURL_SOCKET_TIMEOUT when the deadline requested by
+ * libcurl is reached.
+ */
+struct smtpc_timer {
+	/** Environment, NULL when it is destroyed. */
+	struct smtpc_env *env;
+	/** Deadline in fiber_clock() terms, < 0 if not armed. */
+	double deadline;
+	/** Signalled when the deadline is changed. */
+	struct fiber_cond *cond;
+};
+
+static int
+smtpc_request_finish(struct smtpc_request *req);
+
+static void
+smtpc_request_complete(struct smtpc_request *req, int rc);
+
+static void
+smtpc_env_check_multi_info(struct smtpc_env *env)
+{
+	CURLMsg *msg;
+	int msgs_left;
+	while ((msg = curl_multi_info_read(env->multi, &msgs_left)) != NULL) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		CURL *easy = msg->easy_handle;
+		struct smtpc_request *req = NULL;
+		curl_easy_getinfo(easy, CURLINFO_PRIVATE, (void *) &req);
+		req->code = msg->data.result;
+		curl_multi_remove_handle(env->multi, easy);
+		req->done = true;
+		fiber_cond_signal(req->cond);
+		/*
+		 * Nobody waits for an asynchronous request, finish it
+		 * here unless the body fiber does it.
+		 */
+		if (req->async && !req->body_fiber)
+			smtpc_request_complete(req,
+					       smtpc_request_finish(req));
+	}
+}
+
+static void
+smtpc_env_socket_action(struct smtpc_env *env, curl_socket_t fd, int action)
+{
+	int still_running = 0;
+	CURLMcode code = curl_multi_socket_action(env->multi, fd, action,
+						  &still_running);
+	if (code != CURLM_OK)
+		say_error("curl_multi_socket_action failed: %s",
+			  curl_multi_strerror(code));
+	smtpc_env_check_multi_info(env);
+}
+
+static int
+smtpc_sock_f(va_list list)
+{
+	struct smtpc_sock *sock = va_arg(list, struct smtpc_sock *);
+	while (!sock->removed) {
+		if (sock->events == 0) {
+			fiber_yield();
+			continue;
+		}
+		/*
+		 * The fiber is woken up without events when libcurl
+		 * changes the events of interest or removes the socket.
+		 */
+		int revents = coio_wait(sock->fd, sock->events,
+					TIMEOUT_INFINITY);
+		if (sock->removed || revents == 0)
+			continue;
+		int action = 0;
+		if (revents & COIO_READ)
+			action |= CURL_CSELECT_IN;
+		if (revents & COIO_WRITE)
+			action |= CURL_CSELECT_OUT;
+		smtpc_env_socket_action(sock->env, sock->fd, action);
+	}
+	free(sock);
+	return 0;
+}
+
+static void
+smtpc_env_unlink_sock(struct smtpc_env *env, struct smtpc_sock *sock)
+{
+	if (sock->prev != NULL)
+		sock->prev->next = sock->next;
+	else
+		env->socks = sock->next;
+	if (sock->next != NULL)
+		sock->next->prev = sock->prev;
+	sock->prev = sock->next = NULL;
+}
+
+/** CURLMOPT_SOCKETFUNCTION */
+static int
+smtpc_socket_cb(CURL *easy, curl_socket_t fd, int what, void *envp,
+		void *sockp)
+{
+	(void) easy;
+	struct smtpc_env *env = (struct smtpc_env *) envp;
+	struct smtpc_sock *sock = (struct smtpc_sock *) sockp;
+
+	if (what == CURL_POLL_REMOVE) {
+		if (sock == NULL)
+			return 0;
+		smtpc_env_unlink_sock(env, sock);
+		sock->env = NULL;
+		sock->removed = true;
+		fiber_wakeup(sock->fiber);
+		return 0;
+	}
+
+	int events = 0;
+	if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+		events |= COIO_READ;
+	if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+		events |= COIO_WRITE;
+
+	if (sock != NULL) {
+		if (sock->events != events) {
+			sock->events = events;
+			fiber_wakeup(sock->fiber);
+		}
+		return 0;
+	}
+
+	sock = calloc(1, sizeof(*sock));
+	if (sock == NULL) {
+		say_error("Can't alloc smtp socket");
+		return -1;
+	}
+	sock->fiber = fiber_new("smtp.sock", smtpc_sock_f);
+	if (sock->fiber == NULL) {
+		free(sock);
+		say_error("Can't create smtp socket fiber");
+		return -1;
+	}
+	sock->env = env;
+	sock->fd = fd;
+	sock->events = events;
+	sock->next = env->socks;
+	if (env->socks != NULL)
+		env->socks->prev = sock;
+	env->socks = sock;
+	curl_multi_assign(env->multi, fd, sock);
+	/* The fiber starts waiting and returns control immediately. */
+	fiber_start(sock->fiber, sock);
+	return 0;
+}
+
+static int
+smtpc_timer_f(va_list list)
+{
+	struct smtpc_timer *timer = va_arg(list, struct smtpc_timer *);
+	while (timer->env != NULL) {
+		double timeout = TIMEOUT_INFINITY;
+		if (timer->deadline >= 0)
+			timeout = timer->deadline - fiber_clock();
+		if (timeout > 0) {
+			fiber_cond_wait_timeout(timer->cond, timeout);
+			continue;
+		}
+		timer->deadline = -1;
+		smtpc_env_socket_action(timer->env, CURL_SOCKET_TIMEOUT, 0);
+	}
+	fiber_cond_delete(timer->cond);
+	free(timer);
+	return 0;
+}
+
+/** CURLMOPT_TIMERFUNCTION */
+static int
+smtpc_timer_cb(CURLM *multi, long timeout_ms, void *envp)
+{
+	(void) multi;
+	struct smtpc_env *env = (struct smtpc_env *) envp;
+	struct smtpc_timer *timer = env->timer;
+	if (timeout_ms < 0)
+		timer->deadline = -1;
+	else
+		timer->deadline = fiber_clock() + timeout_ms / 1000.0;
+	/*
+	 * Don't call libcurl from its own callback, let the
+	 * timer fiber do it.
+	 */
+	fiber_cond_signal(timer->cond);
+	return 0;
+}
+
+static long int
+smtpc_task_multi_cleanup(va_list list)
+{
+	CURLM *multi = va_arg(list, CURLM *);
+	CURLSH *share = va_arg(list, CURLSH *);
+	curl_multi_cleanup(multi);
+	curl_share_cleanup(share);
+	return 0;
+}
+
+static int
+smtpc_reaper_f(va_list list)
+{
+	CURLM *multi = va_arg(list, CURLM *);
+	CURLSH *share = va_arg(list, CURLSH *);
+	/* Let the socket fibers stop watching the sockets first. */
+	fiber_sleep(0);
+	coio_call(smtpc_task_multi_cleanup, multi, share);
+	return 0;
+}
+
+/* Multi engine }}} */
+
+/* {{{ Statistics */
+
+const char *smtpc_phase_strs[] = {
+	"dns",
+	"connect",
+	"tls",
+	"first_byte",
+	"total",
+};
+
+/**
+ * Get the histogram bucket of a value. Values below
+ * 2 * SMTPC_HISTOGRAM_SUB have their own buckets.
+ */
+static int
+smtpc_histogram_bucket(uint64_t value)
+{
+	if (value < 2 * SMTPC_HISTOGRAM_SUB)
+		return (int)value;
+	int msb = 63 - __builtin_clzll(value);
+	int sub = (value >> (msb - SMTPC_HISTOGRAM_SUB_BITS)) &
+		  (SMTPC_HISTOGRAM_SUB - 1);
+	int bucket = (msb - SMTPC_HISTOGRAM_SUB_BITS + 1) *
+		     SMTPC_HISTOGRAM_SUB + sub;
+	return bucket < SMTPC_HISTOGRAM_BUCKETS ?
+	       bucket : SMTPC_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Get the maximum value of a histogram bucket.
+ */
+static uint64_t
+smtpc_histogram_bucket_max(int bucket)
+{
+	if (bucket < 2 * SMTPC_HISTOGRAM_SUB)
+		return bucket;
+	int msb = bucket / SMTPC_HISTOGRAM_SUB + SMTPC_HISTOGRAM_SUB_BITS - 1;
+	int sub = bucket % SMTPC_HISTOGRAM_SUB;
+	int shift = msb - SMTPC_HISTOGRAM_SUB_BITS;
+	return ((uint64_t)(SMTPC_HISTOGRAM_SUB + sub + 1) << shift) - 1;
+}
+
+void
+smtpc_histogram_add(struct smtpc_histogram *hist, uint64_t value)
+{
+	++hist->buckets[smtpc_histogram_bucket(value)];
+	++hist->count;
+}
+
+uint64_t
+smtpc_histogram_percentile(const struct smtpc_histogram *hist,
+			   double percent)
+{
+	if (hist->count == 0)
+		return 0;
+	/* The rank of the value, 1..count. */
+	uint64_t rank = (uint64_t)(percent / 100 * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < SMTPC_HISTOGRAM_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return smtpc_histogram_bucket_max(i);
+	}
+	return smtpc_histogram_bucket_max(SMTPC_HISTOGRAM_BUCKETS - 1);
+}
+
+const char *smtpc_status_class_strs[] = {
+	"2xx",
+	"3xx",
+	"4xx",
+	"5xx",
+};
+
+const char *smtpc_error_class_strs[] = {
+	"timeout",
+	"resolve",
+	"connect",
+	"ssl",
+	"send_recv",
+	"no_response",
+	"aborted",
+	"other",
+};
+
+/** FNV-1a hash of a string. */
+static uint32_t
+smtpc_str_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+	for (; *str != '\0'; ++str) {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Find a slot of a URL: the slot with the URL or a free one.
+ */
+static struct smtpc_dest_stat *
+smtpc_dest_stats_find(struct smtpc_dest_stat *slots, uint32_t capacity,
+		      const char *url, uint32_t hash)
+{
+	uint32_t mask = capacity - 1;
+	for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+		struct smtpc_dest_stat *slot = &slots[i];
+		if (slot->url == NULL ||
+		    (slot->hash == hash && strcmp(slot->url, url) == 0))
+			return slot;
+	}
+}
+
+/**
+ * Double the number of slots.
+ */
+static int
+smtpc_dest_stats_grow(struct smtpc_dest_stats *stats)
+{
+	uint32_t capacity = stats->capacity > 0 ? stats->capacity * 2 : 8;
+	struct smtpc_dest_stat *slots = calloc(capacity, sizeof(*slots));
+	if (slots == NULL)
+		return -1;
+	for (uint32_t i = 0; i < stats->capacity; ++i) {
+		struct smtpc_dest_stat *old = &stats->slots[i];
+		if (old->url == NULL)
+			continue;
+		*smtpc_dest_stats_find(slots, capacity, old->url,
+				       old->hash) = *old;
+	}
+	free(stats->slots);
+	stats->slots = slots;
+	stats->capacity = capacity;
+	return 0;
+}
+
+/**
+ * Find the user info ("user:password@") of a URL. Return its
+ * start and set the end past '@' or return NULL if there is none.
+ */
+static const char *
+smtpc_url_userinfo(const char *url, const char **end)
+{
+	const char *host = strstr(url, "://");
+	if (host == NULL)
+		return NULL;
+	host += 3;
+	const char *at = NULL;
+	for (const char *p = host; *p != '\0' && strchr("/?#", *p) == NULL;
+	     ++p) {
+		if (*p == '@')
+			at = p;
+	}
+	if (at == NULL)
+		return NULL;
+	*end = at + 1;
+	return host;
+}
+
+static struct smtpc_dest_stat *
+smtpc_dest_stats_lookup(struct smtpc_dest_stats *stats, const char *url)
+{
+	/* Keep the load factor below 3/4. */
+	if ((stats->count + 1) * 4 > stats->capacity * 3 &&
+	    smtpc_dest_stats_grow(stats) != 0)
+		return NULL;
+	uint32_t hash = smtpc_str_hash(url);
+	struct smtpc_dest_stat *slot =
+		smtpc_dest_stats_find(stats->slots, stats->capacity, url, hash);
+	if (slot->url != NULL)
+		return slot;
+	slot->url = strdup(url);
+	if (slot->url == NULL)
+		return NULL;
+	slot->hash = hash;
+	++stats->count;
+	return slot;
+}
+
+struct smtpc_dest_stat *
+smtpc_dest_stats_get(struct smtpc_dest_stats *stats, const char *url)
+{
+	const char *end;
+	const char *userinfo = smtpc_url_userinfo(url, &end);
+	if (userinfo == NULL)
+		return smtpc_dest_stats_lookup(stats, url);
+	/* Credentials must not get to the statistics and the logs. */
+	size_t prefix = userinfo - url;
+	size_t rest = strlen(end);
+	char *key = malloc(prefix + rest + 1);
+	if (key == NULL)
+		return NULL;
+	memcpy(key, url, prefix);
+	memcpy(key + prefix, end, rest + 1);
+	struct smtpc_dest_stat *dest = smtpc_dest_stats_lookup(stats, key);
+	free(key);
+	return dest;
+}
+
+void
+smtpc_dest_stats_destroy(struct smtpc_dest_stats *stats)
+{
+	for (uint32_t i = 0; i < stats->capacity; ++i)
+		free(stats->slots[i].url);
+	free(stats->slots);
+	memset(stats, 0, sizeof(*stats));
+}
+
+/**
+ * Get the failure class of a libcurl error code.
+ */
+static enum smtpc_error_class
+smtpc_error_class(int code)
+{
+	switch (code) {
+	case CURLE_OPERATION_TIMEDOUT:
+		return SMTPC_ERROR_TIMEOUT;
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_RESOLVE_PROXY:
+		return SMTPC_ERROR_RESOLVE;
+	case CURLE_COULDNT_CONNECT:
+		return SMTPC_ERROR_CONNECT;
+#if LIBCURL_VERSION_NUM < 0x073e00
+	case CURLE_SSL_CACERT: /* deprecated in libcurl 7.62.0 */
+#endif
+	case CURLE_PEER_FAILED_VERIFICATION:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_SSL_CERTPROBLEM:
+	case CURLE_SSL_CIPHER:
+	case CURLE_SSL_CACERT_BADFILE:
+	case CURLE_USE_SSL_FAILED:
+		return SMTPC_ERROR_SSL;
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+		return SMTPC_ERROR_SEND_RECV;
+	case CURLE_GOT_NOTHING:
+		return SMTPC_ERROR_NO_RESPONSE;
+	default:
+		return SMTPC_ERROR_OTHER;
+	}
+}
+
+/** Weight of the last request in the relay health averages. */
+#define SMTPC_HEALTH_ALPHA 0.2
+
+/**
+ * Update the health of the relay by a finished request. A request
+ * without a reply or with 421 (the service is shutting down) is a
+ * failure of the relay. Other replies, 450/452 included, are about
+ * the message or its recipients and the relay is fine.
+ */
+static void
+smtpc_health_update(struct smtpc_env *env, struct smtpc_health *health,
+		    int status, double latency)
+{
+	bool failed = status < 200 || status == 421;
+	health->latency = health->latency == 0 ? latency :
+			  health->latency +
+			  SMTPC_HEALTH_ALPHA * (latency - health->latency);
+	health->error_rate += SMTPC_HEALTH_ALPHA *
+			      ((failed ? 1 : 0) - health->error_rate);
+	if (!failed) {
+		health->failures = 0;
+		health->ejected_until = 0;
+		return;
+	}
+	++health->failures;
+	/*
+	 * The failure count is kept on ejection, so the first
+	 * failure after it ejects the relay again.
+	 */
+	if (env->eject_failures > 0 &&
+	    health->failures >= env->eject_failures) {
+		health->ejected_until = fiber_clock() + env->eject_time;
+		++health->ejections;
+	}
+}
+
+/**
+ * Account a finished request in the statistics by relay: by the
+ * SMTP reply class if there is a reply or by the failure class.
+ */
+static void
+smtpc_env_account(struct smtpc_env *env, struct smtpc_request *req,
+		  int status, enum smtpc_error_class error)
+{
+	/* The statistics is best effort, skip it on OOM. */
+	struct smtpc_dest_stat *dest =
+		smtpc_dest_stats_get(&env->stat.dests, req->url);
+	if (dest == NULL)
+		return;
+	++dest->requests;
+	if (status >= 200 && status < 600)
+		++dest->status[status / 100 - 2];
+	else
+		++dest->errors[error];
+	/* An aborted request says nothing about the relay. */
+	if (error != SMTPC_ERROR_ABORTED)
+		smtpc_health_update(env, &dest->health, status,
+				    fiber_clock() - req->started);
+}
+
+/* Statistics }}} */
+
+static void
+smtpc_env_free_relays(struct smtpc_env *env)
+{
+	for (int i = 0; i < env->relay_count; i++)
+		free(env->relays[i].url);
+	free(env->relays);
+	env->relays = NULL;
+	env->relay_count = 0;
+}
+
 int
-smtpc_env_create(struct smtpc_env *env)
+smtpc_env_create(struct smtpc_env *env, int max_conns, int max_inflight,
+		 int queue_size)
 {
 	memset(env, 0, sizeof(*env));
+	env->max_conns = max_conns > 0 ? max_conns : 0;
+	env->max_inflight = max_inflight > 0 ? max_inflight : 0;
+	env->queue_size = queue_size >= 0 ? queue_size : -1;
+	env->tls_loaded = fiber_clock();
+
+	env->completed_cond = fiber_cond_new();
+	if (env->completed_cond == NULL) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc smtp completion condition");
+		return -1;
+	}
+	env->timer = calloc(1, sizeof(*env->timer));
+	if (env->timer == NULL) {
+		fiber_cond_delete(env->completed_cond);
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc smtp timer");
+		return -1;
+	}
+	env->timer->env = env;
+	env->timer->deadline = -1;
+	env->timer->cond = fiber_cond_new();
+	if (env->timer->cond == NULL) {
+		free(env->timer);
+		fiber_cond_delete(env->completed_cond);
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc smtp timer condition");
+		return -1;
+	}
+	struct fiber *timer_fiber = fiber_new("smtp.timer", smtpc_timer_f);
+	if (timer_fiber == NULL) {
+		fiber_cond_delete(env->timer->cond);
+		free(env->timer);
+		fiber_cond_delete(env->completed_cond);
+		return -1;
+	}
+
+	/*
+	 * Connections and DNS entries are shared by the easy handles
+	 * of a multi handle, but TLS sessions are not. The share
+	 * handle is used from the TX thread only (and by the final
+	 * cleanup in a coio thread, when no request uses it), so no
+	 * lock callbacks are needed.
+	 */
+	env->share = curl_share_init();
+	if (env->share == NULL) {
+		/* The timer fiber exits right after the start. */
+		env->timer->env = NULL;
+		fiber_start(timer_fiber, env->timer);
+		fiber_cond_delete(env->completed_cond);
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc curl share handle");
+		return -1;
+	}
+	curl_share_setopt(env->share, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(env->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+
+	env->multi = curl_multi_init();
+	if (env->multi == NULL) {
+		curl_share_cleanup(env->share);
+		env->timer->env = NULL;
+		fiber_start(timer_fiber, env->timer);
+		fiber_cond_delete(env->completed_cond);
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc curl multi handle");
+		return -1;
+	}
+	curl_multi_setopt(env->multi, CURLMOPT_SOCKETFUNCTION, smtpc_socket_cb);
+	curl_multi_setopt(env->multi, CURLMOPT_SOCKETDATA, (void *) env);
+	curl_multi_setopt(env->multi, CURLMOPT_TIMERFUNCTION, smtpc_timer_cb);
+	curl_multi_setopt(env->multi, CURLMOPT_TIMERDATA, (void *) env);
+	if (env->max_conns > 0)
+		curl_multi_setopt(env->multi, CURLMOPT_MAXCONNECTS,
+				  (long) env->max_conns);
+
+	fiber_start(timer_fiber, env->timer);
+	return 0;
+}
+
+void
+smtpc_env_destroy(struct smtpc_env *env)
+{
+	assert(env);
+	/* Detach libcurl from the fibers and stop them. */
+	curl_multi_setopt(env->multi, CURLMOPT_SOCKETFUNCTION, NULL);
+	curl_multi_setopt(env->multi, CURLMOPT_TIMERFUNCTION, NULL);
+	while (env->socks != NULL) {
+		struct smtpc_sock *sock = env->socks;
+		smtpc_env_unlink_sock(env, sock);
+		sock->env = NULL;
+		sock->removed = true;
+		fiber_wakeup(sock->fiber);
+	}
+	env->timer->env = NULL;
+	fiber_cond_signal(env->timer->cond);
+	env->timer = NULL;
+
+	/*
+	 * The environment is destroyed from a Lua GC hook, where
+	 * we must not wait for QUIT responses. Close the cached
+	 * connections in background.
+	 */
+	struct fiber *reaper = fiber_new("smtp.reaper", smtpc_reaper_f);
+	if (reaper != NULL) {
+		fiber_start(reaper, env->multi, env->share);
+	} else {
+		curl_multi_cleanup(env->multi);
+		curl_share_cleanup(env->share);
+	}
+	env->multi = NULL;
+	env->share = NULL;
+	while (env->free_requests != NULL) {
+		struct smtpc_request *req = env->free_requests;
+		env->free_requests = req->next_completed;
+		req->env = NULL;
+		smtpc_request_delete(req);
+	}
+	env->free_count = 0;
+	smtpc_dest_stats_destroy(&env->stat.dests);
+	smtpc_dest_stats_destroy(&env->domains);
+	fiber_cond_delete(env->completed_cond);
+	free(env->ca_file);
+	free(env->ca_path);
+	smtpc_env_free_relays(env);
+	while (env->dkim_keys != NULL) {
+		struct smtpc_dkim_key *key = env->dkim_keys;
+		env->dkim_keys = key->next;
+		smtpc_dkim_key_delete(key);
+	}
+}
+
+int
+smtpc_env_set_ca(struct smtpc_env *env, const char *ca_file,
+		 const char *ca_path)
+{
+	char *file = ca_file != NULL ? strdup(ca_file) : NULL;
+	char *path = ca_path != NULL ? strdup(ca_path) : NULL;
+	if ((ca_file != NULL && file == NULL) ||
+	    (ca_path != NULL && path == NULL)) {
+		free(file);
+		free(path);
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc smtp CA path");
+		return -1;
+	}
+	free(env->ca_file);
+	free(env->ca_path);
+	env->ca_file = file;
+	env->ca_path = path;
+	smtpc_env_reload_tls(env);
+	return 0;
+}
+
+void
+smtpc_env_reload_tls(struct smtpc_env *env)
+{
+	env->tls_loaded = fiber_clock();
+}
+
+/**
+ * Get a parsed DKIM key: a cached one or a new one, which evicts
+ * the least recently used key if the cache is full.
+ */
+static struct smtpc_dkim_key *
+smtpc_env_dkim_key(struct smtpc_env *env, const char *pem, size_t pem_size)
+{
+	struct smtpc_dkim_key **prev = &env->dkim_keys;
+	for (struct smtpc_dkim_key *key = *prev; key != NULL;
+	     prev = &key->next, key = key->next) {
+		if (key->pem_size != pem_size ||
+		    memcmp(key->pem, pem, pem_size) != 0)
+			continue;
+		*prev = key->next;
+		key->next = env->dkim_keys;
+		env->dkim_keys = key;
+		return key;
+	}
+	struct smtpc_dkim_key *key = smtpc_dkim_key_new(pem, pem_size);
+	if (key == NULL)
+		return NULL;
+	key->next = env->dkim_keys;
+	env->dkim_keys = key;
+	if (++env->dkim_key_count > SMTPC_DKIM_KEYS_MAX) {
+		struct smtpc_dkim_key **last = &env->dkim_keys;
+		while ((*last)->next != NULL)
+			last = &(*last)->next;
+		smtpc_dkim_key_delete(*last);
+		*last = NULL;
+		--env->dkim_key_count;
+	}
+	return key;
+}
+
+int
+smtpc_env_dkim_sign(struct smtpc_env *env, const char *key, size_t key_size,
+		    const char *domain, const char *selector,
+		    struct smtpc_mime *mime)
+{
+	unsigned char body_hash[SMTPC_DKIM_HASH_SIZE];
+	if (smtpc_dkim_check(domain, selector) != 0 ||
+	    smtpc_dkim_body_hash(mime, body_hash) != 0)
+		return -1;
+	/* The key is not evicted: nothing yields from here on. */
+	struct smtpc_dkim_key *dkim_key = smtpc_env_dkim_key(env, key,
+							      key_size);
+	if (dkim_key == NULL)
+		return -1;
+	return smtpc_dkim_sign(dkim_key, domain, selector, mime, body_hash);
+}
+
+/* {{{ Admission */
+
+/**
+ * A fiber waiting for a free request slot. It lives on the stack
+ * of the waiting fiber.
+ */
+struct smtpc_waiter {
+	/** Signalled when a slot is handed over to the waiter. */
+	struct fiber_cond *cond;
+	/** Set when the waiter owns a slot. */
+	bool granted;
+	struct smtpc_waiter *prev;
+	struct smtpc_waiter *next;
+};
+
+static void
+smtpc_env_unlink_waiter(struct smtpc_env *env, struct smtpc_waiter *waiter)
+{
+	if (waiter->prev != NULL)
+		waiter->prev->next = waiter->next;
+	else
+		env->waiters_first = waiter->next;
+	if (waiter->next != NULL)
+		waiter->next->prev = waiter->prev;
+	else
+		env->waiters_last = waiter->prev;
+	waiter->prev = waiter->next = NULL;
+	--env->stat.queued_requests;
+}
+
+/**
+ * Take a request slot. If max_inflight requests are in progress,
+ * wait for a slot at most timeout seconds after the requests
+ * queued earlier or fail at once if the queue is full.
+ */
+static int
+smtpc_env_admit(struct smtpc_env *env, double timeout)
+{
+	if (env->max_inflight == 0 || (env->inflight < env->max_inflight &&
+				       env->waiters_first == NULL)) {
+		++env->inflight;
+		return 0;
+	}
+	if (env->queue_size >= 0 &&
+	    env->stat.queued_requests >= (uint64_t)env->queue_size) {
+		++env->stat.rejected_requests;
+		box_error_set(__FILE__, __LINE__, ER_SYSTEM,
+			      "SMTP send queue is full");
+		return -1;
+	}
+	struct smtpc_waiter waiter;
+	memset(&waiter, 0, sizeof(waiter));
+	waiter.cond = fiber_cond_new();
+	if (waiter.cond == NULL) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc smtp queue condition");
+		return -1;
+	}
+	waiter.prev = env->waiters_last;
+	if (env->waiters_last != NULL)
+		env->waiters_last->next = &waiter;
+	else
+		env->waiters_first = &waiter;
+	env->waiters_last = &waiter;
+	++env->stat.queued_requests;
+
+	double deadline = fiber_clock() + timeout;
+	while (!waiter.granted) {
+		double delay = deadline - fiber_clock();
+		/* The diag is set by fiber_cond_wait_timeout(). */
+		if (fiber_cond_wait_timeout(waiter.cond,
+					    delay > 0 ? delay : 0) != 0)
+			break;
+	}
+	fiber_cond_delete(waiter.cond);
+	/* The slot may be granted while the fiber is being woken up. */
+	if (waiter.granted)
+		return 0;
+	smtpc_env_unlink_waiter(env, &waiter);
+	return -1;
+}
+
+/**
+ * Free the request slot or hand it over to the first waiter, so
+ * a newcomer can't overtake the queue.
+ */
+static void
+smtpc_env_release(struct smtpc_env *env)
+{
+	struct smtpc_waiter *waiter = env->waiters_first;
+	if (waiter == NULL) {
+		--env->inflight;
+		return;
+	}
+	smtpc_env_unlink_waiter(env, waiter);
+	waiter->granted = true;
+	fiber_cond_signal(waiter->cond);
+}
+
+/* Admission }}} */
+
+/* {{{ Rate limiting */
+
+/**
+ * Fill a rate limit, a burst is at least one request.
+ */
+static void
+smtpc_rate_create(struct smtpc_rate *limit, double rate, double burst)
+{
+	limit->rate = rate > 0 ? rate : 0;
+	limit->burst = burst >= 1 ? burst : (rate > 1 ? rate : 1);
+}
+
+void
+smtpc_env_set_rate_limit(struct smtpc_env *env, double relay_rate,
+			 double relay_burst, double domain_rate,
+			 double domain_burst)
+{
+	smtpc_rate_create(&env->relay_rate, relay_rate, relay_burst);
+	smtpc_rate_create(&env->domain_rate, domain_rate, domain_burst);
+}
+
+/**
+ * Take @a count tokens from the bucket (give them back if negative) or,
+ * if @a delay is set, refill the bucket and raise @a delay to the
+ * time a token is available in.
+ */
+static void
+smtpc_bucket_visit(struct smtpc_bucket *bucket,
+		   const struct smtpc_rate *limit, double now, double *delay,
+		   double count)
+{
+	if (delay == NULL) {
+		bucket->tokens -= count;
+		return;
+	}
+	double tokens = bucket->updated == 0 ? limit->burst :
+			bucket->tokens + (now - bucket->updated) * limit->rate;
+	bucket->tokens = tokens < limit->burst ? tokens : limit->burst;
+	bucket->updated = now;
+	if (bucket->tokens < 1 && (1 - bucket->tokens) / limit->rate > *delay)
+		*delay = (1 - bucket->tokens) / limit->rate;
+}
+
+/**
+ * Check if the bucket has refilled up to the burst, i.e. it is the
+ * same as a new one.
+ */
+static bool
+smtpc_bucket_is_full(const struct smtpc_bucket *bucket,
+		     const struct smtpc_rate *limit, double now)
+{
+	return bucket->updated == 0 || bucket->tokens +
+	       (now - bucket->updated) * limit->rate >= limit->burst;
+}
+
+/**
+ * Copy the lowercased domain of a recipient address to the buffer.
+ */
+static int
+smtpc_recipient_domain(const char *rcpt, char *buf, size_t size)
+{
+	const char *at = strrchr(rcpt, '@');
+	if (at == NULL)
+		return -1;
+	++at;
+	size_t len = strcspn(at, ">");
+	if (len == 0 || len >= size)
+		return -1;
+	for (size_t i = 0; i < len; ++i)
+		buf[i] = tolower((unsigned char)at[i]);
+	buf[len] = '\0';
 	return 0;
 }
 
-void
-smtpc_env_destroy(struct smtpc_env *ctx)
+/**
+ * Drop the rate limiters of the domains, whose buckets are full
+ * again: such a bucket is the same as a new one. Otherwise every
+ * recipient domain ever seen would be kept by the client. The
+ * table is rebuilt, so the slots move.
+ */
+static void
+smtpc_env_prune_domains(struct smtpc_env *env, double now)
+{
+	struct smtpc_dest_stats *stats = &env->domains;
+	const struct smtpc_rate *limit = &env->domain_rate;
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < stats->capacity; ++i) {
+		struct smtpc_dest_stat *slot = &stats->slots[i];
+		if (slot->url != NULL &&
+		    !smtpc_bucket_is_full(&slot->bucket, limit, now))
+			++kept;
+	}
+	uint32_t capacity = 8;
+	while ((kept + 1) * 4 > capacity * 3)
+		capacity *= 2;
+	struct smtpc_dest_stat *slots = calloc(capacity, sizeof(*slots));
+	/* Try again with the next domain on OOM. */
+	if (slots == NULL)
+		return;
+	for (uint32_t i = 0; i < stats->capacity; ++i) {
+		struct smtpc_dest_stat *old = &stats->slots[i];
+		if (old->url == NULL)
+			continue;
+		if (smtpc_bucket_is_full(&old->bucket, limit, now)) {
+			free(old->url);
+			continue;
+		}
+		*smtpc_dest_stats_find(slots, capacity, old->url,
+				       old->hash) = *old;
+	}
+	free(stats->slots);
+	stats->slots = slots;
+	stats->capacity = capacity;
+	stats->count = kept;
+	env->domains_kept = kept;
+}
+
+/**
+ * Visit the rate limiters of the request: the one of the relay and
+ * the ones of the recipient domains, each once. The limiters are
+ * looked up on every visit, because an insertion moves the hash
+ * table slots. A limiter is skipped on OOM.
+ */
+static void
+smtpc_request_visit_buckets(struct smtpc_request *req, double *delay,
+			    double count)
+{
+	struct smtpc_env *env = req->env;
+	double now = fiber_clock();
+	uint64_t stamp = ++env->rate_stamp;
+	struct smtpc_dest_stat *dest;
+	if (env->relay_rate.rate > 0) {
+		dest = smtpc_dest_stats_get(&env->stat.dests, req->url);
+		if (dest != NULL)
+			smtpc_bucket_visit(&dest->bucket, &env->relay_rate,
+					   now, delay, count);
+	}
+	if (env->domain_rate.rate <= 0)
+		return;
+	/*
+	 * The limiters kept by the last pruning are busy, so don't
+	 * prune again until there are twice as many.
+	 */
+	if (delay != NULL && env->domains.count >= SMTPC_DOMAINS_MAX &&
+	    env->domains.count >= env->domains_kept * 2)
+		smtpc_env_prune_domains(env, now);
+	for (struct curl_slist *rcpt = req->recipients; rcpt != NULL;
+	     rcpt = rcpt->next) {
+		char domain[256];
+		if (smtpc_recipient_domain(rcpt->data, domain,
+					   sizeof(domain)) != 0)
+			continue;
+		dest = smtpc_dest_stats_get(&env->domains, domain);
+		if (dest == NULL || dest->bucket.visited == stamp)
+			continue;
+		dest->bucket.visited = stamp;
+		smtpc_bucket_visit(&dest->bucket, &env->domain_rate, now,
+				   delay, count);
+	}
+}
+
+/**
+ * Take a token from each rate limiter of the request and wait
+ * until all of them are available. Tokens are taken in advance,
+ * so the later requests wait longer and keep the arrival order.
+ * Fail at once if the wait would exceed the timeout.
+ */
+static int
+smtpc_request_throttle(struct smtpc_request *req, double timeout)
+{
+	struct smtpc_env *env = req->env;
+	if (env->relay_rate.rate <= 0 && env->domain_rate.rate <= 0)
+		return 0;
+	double delay = 0;
+	smtpc_request_visit_buckets(req, &delay, 0);
+	if (delay > timeout) {
+		box_error_set(__FILE__, __LINE__, ER_TIMEOUT,
+			      "SMTP rate limit delay exceeds the timeout");
+		return -1;
+	}
+	smtpc_request_visit_buckets(req, NULL, 1);
+	if (delay > 0) {
+		++env->stat.throttled_requests;
+		fiber_sleep(delay);
+	}
+	return 0;
+}
+
+/**
+ * Give back the tokens taken by smtpc_request_throttle(), when the
+ * request is not sent after all.
+ */
+static void
+smtpc_request_unthrottle(struct smtpc_request *req)
+{
+	struct smtpc_env *env = req->env;
+	if (env->relay_rate.rate <= 0 && env->domain_rate.rate <= 0)
+		return;
+	smtpc_request_visit_buckets(req, NULL, -1);
+}
+
+/* Rate limiting }}} */
+
+/* {{{ Relays */
+
+int
+smtpc_env_set_relays(struct smtpc_env *env, const char **urls,
+		     const double *weights, int count)
+{
+	if (count > SMTPC_RELAYS_MAX) {
+		box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+			      "Too many SMTP relays, the limit is %d",
+			      SMTPC_RELAYS_MAX);
+		return -1;
+	}
+	struct smtpc_relay *relays = calloc(count, sizeof(*relays));
+	if (relays == NULL && count > 0)
+		goto oom;
+	for (int i = 0; i < count; i++) {
+		relays[i].url = strdup(urls[i]);
+		if (relays[i].url == NULL)
+			goto oom;
+		relays[i].weight = weights[i] > 0 ? weights[i] : 1;
+	}
+	smtpc_env_free_relays(env);
+	env->relays = relays;
+	env->relay_count = count;
+	return 0;
+oom:
+	if (relays != NULL) {
+		for (int i = 0; i < count; i++)
+			free(relays[i].url);
+		free(relays);
+	}
+	box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+		      "Can't alloc SMTP relays");
+	return -1;
+}
+
+void
+smtpc_env_set_breaker(struct smtpc_env *env, int failures,
+		      double eject_time)
+{
+	env->eject_failures = failures > 0 ? failures : 0;
+	env->eject_time = eject_time > 0 ? eject_time : 0;
+}
+
+int
+smtpc_env_pick_relay(struct smtpc_env *env, uint64_t skip, bool ejected)
+{
+	double now = fiber_clock();
+	/*
+	 * The healthy relays are chosen by smooth weighted
+	 * round-robin: the weight is lowered by the failure rate
+	 * and by the latency relative to the fastest relay.
+	 */
+	double min_latency = 0;
+	for (int i = 0; i < env->relay_count; i++) {
+		struct smtpc_dest_stat *dest =
+			smtpc_dest_stats_get(&env->stat.dests,
+					     env->relays[i].url);
+		double latency = dest != NULL ? dest->health.latency : 0;
+		if (latency > 0 && (min_latency == 0 || latency < min_latency))
+			min_latency = latency;
+	}
+	int best = -1, soonest = -1;
+	double total = 0, soonest_until = 0;
+	for (int i = 0; i < env->relay_count; i++) {
+		if ((skip & (1ULL << i)) != 0)
+			continue;
+		struct smtpc_relay *relay = &env->relays[i];
+		struct smtpc_dest_stat *dest =
+			smtpc_dest_stats_get(&env->stat.dests, relay->url);
+		double weight = relay->weight;
+		if (dest != NULL) {
+			const struct smtpc_health *health = &dest->health;
+			if (health->ejected_until > now) {
+				if (soonest < 0 ||
+				    health->ejected_until < soonest_until) {
+					soonest = i;
+					soonest_until = health->ejected_until;
+				}
+				continue;
+			}
+			weight *= 1 - health->error_rate;
+			if (health->latency > 0)
+				weight *= min_latency / health->latency;
+		}
+		/* A relay failing every request is still tried. */
+		if (weight < relay->weight * 0.01)
+			weight = relay->weight * 0.01;
+		relay->current += weight;
+		total += weight;
+		if (best < 0 || relay->current > env->relays[best].current)
+			best = i;
+	}
+	if (best < 0)
+		return ejected ? soonest : -1;
+	env->relays[best].current -= total;
+	return best;
+}
+
+/**
+ * Fail the request at once if its relay is ejected.
+ */
+static int
+smtpc_request_check_relay(struct smtpc_request *req)
+{
+	struct smtpc_env *env = req->env;
+	if (env->eject_failures == 0)
+		return 0;
+	struct smtpc_dest_stat *dest =
+		smtpc_dest_stats_get(&env->stat.dests, req->url);
+	if (dest == NULL || dest->health.ejected_until <= fiber_clock())
+		return 0;
+	box_error_set(__FILE__, __LINE__, ER_SYSTEM,
+		      "SMTP relay is unavailable: %s", dest->url);
+	return -1;
+}
+
+/* Relays }}} */
+
+/* {{{ Arena */
+
+/** Size of the first block of an arena. */
+#define SMTPC_ARENA_BLOCK_SIZE 1024
+
+struct smtpc_arena_block {
+	struct smtpc_arena_block *next;
+	/** Size of the data. */
+	size_t size;
+	/** The number of used data bytes. */
+	size_t used;
+	char data[];
+};
+
+/**
+ * Allocate memory on the arena. It is valid until the arena is
+ * reset or destroyed.
+ */
+static void *
+smtpc_arena_alloc(struct smtpc_arena *arena, size_t size)
+{
+	/* Keep the pointers aligned. */
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	struct smtpc_arena_block *block = arena->last;
+	if (block == NULL || block->size - block->used < size) {
+		size_t block_size = block != NULL ? block->size * 2 :
+				    SMTPC_ARENA_BLOCK_SIZE;
+		while (block_size < size)
+			block_size *= 2;
+		struct smtpc_arena_block *next =
+			malloc(sizeof(*next) + block_size);
+		if (next == NULL)
+			return NULL;
+		next->next = NULL;
+		next->size = block_size;
+		next->used = 0;
+		if (block != NULL)
+			block->next = next;
+		else
+			arena->first = next;
+		arena->last = next;
+		block = next;
+	}
+	void *ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
+
+/**
+ * Free all allocations. The largest block, which is the last
+ * one, is kept for the next allocations.
+ */
+static void
+smtpc_arena_reset(struct smtpc_arena *arena)
+{
+	struct smtpc_arena_block *block = arena->first;
+	while (block != arena->last) {
+		struct smtpc_arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+	arena->first = arena->last;
+	if (block != NULL)
+		block->used = 0;
+}
+
+static void
+smtpc_arena_destroy(struct smtpc_arena *arena)
+{
+	smtpc_arena_reset(arena);
+	free(arena->first);
+	arena->first = NULL;
+	arena->last = NULL;
+}
+
+/* Arena }}} */
+
+static int
+smtpc_body_f(va_list list);
+
+/**
+ * Start a fiber fetching the body chunks of an asynchronous
+ * request. On failure the transfer is aborted by the read callback.
+ */
+static void
+smtpc_request_start_body_fiber(struct smtpc_request *req)
+{
+	struct fiber *fiber = fiber_new("smtp.body", smtpc_body_f);
+	if (fiber == NULL) {
+		say_error("Can't create smtp body fiber");
+		req->body_error = true;
+		return;
+	}
+	req->body_fiber = true;
+	fiber_start(fiber, req);
+}
+
+/**
+ * Switch to the next piece of the body: the next segment of the
+ * message or the chunk supplied by a reader (the body reader or
+ * the file reader).
+ * Return false if no data is available right now: the body is
+ * over or a reader has to be called.
+ */
+static bool
+smtpc_request_next_chunk(struct smtpc_request *req)
+{
+	if (req->body_streaming) {
+		if (!req->body_eof) {
+			/*
+			 * Readers yield, so they can't be called
+			 * from the libcurl callback. Let the request
+			 * fiber fetch the next chunk.
+			 */
+			if (!req->body_wanted) {
+				req->body_wanted = true;
+				if (!req->async)
+					fiber_cond_signal(req->cond);
+				else if (!req->body_fiber)
+					smtpc_request_start_body_fiber(req);
+			}
+			return false;
+		}
+		req->body_streaming = false;
+	}
+	if (req->mime == NULL || req->mime_pos == req->mime->seg_count)
+		return false;
+	const struct smtpc_mime_seg *seg = &req->mime->segs[req->mime_pos++];
+	switch (seg->type) {
+	case SMTPC_MIME_SEG_STREAM:
+		assert(req->body_reader != NULL);
+		break;
+	case SMTPC_MIME_SEG_FILE:
+		smtpc_mime_file_open(&req->body_file, seg);
+		break;
+	default:
+		smtpc_set_body(req, smtpc_mime_seg_data(req->mime, seg),
+			       seg->size);
+		return true;
+	}
+	req->body_streaming = true;
+	req->body_eof = false;
+	req->body_size = req->body_pos = 0;
+	return smtpc_request_next_chunk(req);
+}
+
+static size_t
+smtpc_read_body(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+	struct smtpc_request *req = (struct smtpc_request *)userp;
+
+	/* The next chunk is not installed yet. */
+	if (req->body_fetching)
+		return CURL_READFUNC_PAUSE;
+	size_t total = size * nmemb;
+	size_t copied = 0;
+	while (copied < total) {
+		size_t left = req->body_size - req->body_pos;
+		if (left == 0) {
+			if (!smtpc_request_next_chunk(req))
+				break;
+			continue;
+		}
+		size_t to_read = total - copied < left ? total - copied : left;
+		memcpy((char *)ptr + copied, req->body + req->body_pos,
+		       to_read);
+		req->body_pos += to_read;
+		copied += to_read;
+	}
+	if (copied == 0 && req->body_error)
+		return CURL_READFUNC_ABORT;
+	/* Pause the transfer until the reader supplies a chunk. */
+	if (copied == 0 && req->body_wanted)
+		return CURL_READFUNC_PAUSE;
+	return copied;
+}
+
+/**
+ * Replace a string option of the request with a copy of the
+ * given value. An allocation failure is reported later by
+ * smtpc_execute().
+ */
+static void
+smtpc_request_set_string(struct smtpc_request *req, char **option,
+			 const char *value)
+{
+	free(*option);
+	*option = NULL;
+	if (value == NULL)
+		return;
+	*option = strdup(value);
+	if (*option == NULL)
+		req->options_oom = true;
+}
+
+/** Set the default options of a new or a reused request. */
+static void
+smtpc_request_init(struct smtpc_request *req, struct smtpc_env *env)
 {
-	(void) ctx;
-	assert(ctx);
+	req->env = env;
+	smtpc_mime_file_create(&req->body_file);
+	/* libcurl defaults. */
+	req->verify_host = 2;
+	req->verify_peer = 1;
+	req->use_ssl = CURLUSESSL_NONE;
 }
 
-static size_t
-smtpc_read_body(void *ptr, size_t size, size_t nmemb, void *userp)
+/** Free the options of the request. */
+static void
+smtpc_request_free_options(struct smtpc_request *req)
 {
-	struct smtpc_request *req = (struct smtpc_request *)userp;
-
-	size_t to_read = size * nmemb < req->body_size - (req->body_rpos - req->body) ?
-			 size * nmemb : req->body_size - (req->body_rpos - req->body);
-	if (to_read < 1)
-		return 0;
+	free(req->url);
+	free(req->from);
+	free(req->username);
+	free(req->password);
+	free(req->ca_path);
+	free(req->ca_file);
+	free(req->ssl_key);
+	free(req->ssl_cert);
+	free(req->error_msg);
+	smtpc_mime_file_destroy(&req->body_file);
+}
 
-	memcpy(ptr, req->body_rpos, to_read);
-	req->body_rpos += to_read;
+/**
+ * Return the request to the state of a new one. The easy handle,
+ * the condition and the arena memory are kept.
+ */
+static void
+smtpc_request_reset(struct smtpc_request *req)
+{
+	struct smtpc_env *env = req->env;
+	CURL *easy = req->easy;
+	struct fiber_cond *cond = req->cond;
+	struct smtpc_arena arena = req->arena;
 
-	return to_read;
+	smtpc_request_free_options(req);
+	/* Connections and caches belong to the multi handle. */
+	curl_easy_reset(easy);
+	smtpc_arena_reset(&arena);
+	/* The error buffer is cleared here as well. */
+	memset(req, 0, sizeof(*req));
+	req->easy = easy;
+	req->cond = cond;
+	req->arena = arena;
+	smtpc_request_init(req, env);
 }
 
 struct smtpc_request *
 smtpc_request_new(struct smtpc_env *env, const char *url, const char *from)
 {
-	struct smtpc_request *req = malloc(sizeof(*req));
+	struct smtpc_request *req = env->free_requests;
+	if (req != NULL) {
+		env->free_requests = req->next_completed;
+		env->free_count--;
+		req->next_completed = NULL;
+		smtpc_request_set_string(req, &req->url, url);
+		smtpc_request_set_string(req, &req->from, from);
+		if (req->options_oom) {
+			smtpc_request_delete(req);
+			box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+				      "Can't alloc smtp request url");
+			return NULL;
+		}
+		return req;
+	}
+
+	req = malloc(sizeof(*req));
 	if (req == NULL) {
 		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
 			      "Can't alloc smtp request body");
 		return NULL;
 	}
 	memset(req, 0, sizeof(*req));
+	smtpc_request_init(req, env);
 
-	req->error_buf = calloc(CURL_ERROR_SIZE, sizeof(char));
-	if (req->error_buf == NULL) {
-		free(req);
+	req->cond = fiber_cond_new();
+	if (req->cond == NULL) {
+		smtpc_request_delete(req);
 		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
-					  "Can't alloc error message buffer");
+			      "Can't alloc smtp request condition");
 		return NULL;
 	}
-	req->env = env;
-
 	req->easy = curl_easy_init();
 	if (req->easy == NULL) {
-		free(req);
+		smtpc_request_delete(req);
 		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
 			      "Can't alloc curl handle");
 		return NULL;
 	}
-	curl_easy_setopt(req->easy, CURLOPT_URL, url);
-	curl_easy_setopt(req->easy, CURLOPT_MAIL_FROM, from);
-	curl_easy_setopt(req->easy, CURLOPT_ERRORBUFFER, req->error_buf);
 
+	smtpc_request_set_string(req, &req->url, url);
+	smtpc_request_set_string(req, &req->from, from);
+	if (req->options_oom) {
+		smtpc_request_delete(req);
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc smtp request url");
+		return NULL;
+	}
 	return req;
 }
 
-static long int
-smtpc_task_delete(va_list list)
-{
-	struct smtpc_request *req = va_arg(list, struct smtpc_request *);
-	curl_easy_cleanup(req->easy);
-	return 0;
-}
-
 void
 smtpc_request_delete(struct smtpc_request *req)
 {
+	struct smtpc_env *env = req->env;
+	/*
+	 * Keep the request for reuse: a reset of the easy handle
+	 * is cheaper than a new one, and the request memory is not
+	 * passed back and forth between the allocator arenas of
+	 * the TX and coio threads.
+	 */
+	if (env != NULL && env->multi != NULL && req->easy != NULL &&
+	    req->cond != NULL && env->free_count < SMTPC_FREE_REQUESTS_MAX) {
+		smtpc_request_reset(req);
+		req->next_completed = env->free_requests;
+		env->free_requests = req;
+		env->free_count++;
+		return;
+	}
+	/*
+	 * The connection belongs to the multi handle cache, so
+	 * the cleanup does not wait for the network.
+	 */
 	if (req->easy != NULL)
-		coio_call(smtpc_task_delete, req);
-	free(req->body);
-	free(req->error_buf);
-	if (req->recipients)
-		curl_slist_free_all(req->recipients);
+		curl_easy_cleanup(req->easy);
+	if (req->cond != NULL)
+		fiber_cond_delete(req->cond);
+	smtpc_arena_destroy(&req->arena);
+	smtpc_request_free_options(req);
 
 	free(req);
 }
 
-int
+void
 smtpc_set_body(struct smtpc_request *req, const char *body, size_t size)
 {
-	req->body_rpos = req->body = malloc(size);
-	if (req->body == NULL) {
-		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
-			      "Can't alloc smtp request body");
-		return -1;
-	}
-	memcpy(req->body, body, size);
+	req->body = body;
 	req->body_size = size;
+	req->body_pos = 0;
+}
 
-	return 0;
+void
+smtpc_set_body_mime(struct smtpc_request *req, const struct smtpc_mime *mime)
+{
+	req->mime = mime;
+	req->mime_pos = 0;
+	smtpc_set_body(req, NULL, 0);
+}
+
+void
+smtpc_set_body_reader(struct smtpc_request *req, smtpc_body_reader_f reader,
+		      void *arg)
+{
+	req->body_reader = reader;
+	req->body_reader_arg = arg;
+	req->body_eof = false;
 }
 
 void
 smtpc_set_verbose(struct smtpc_request *req, bool curl_verbose)
 {
-	curl_easy_setopt(req->easy, CURLOPT_VERBOSE, (long)curl_verbose);
+	req->verbose = curl_verbose;
 }
 
 void
 smtpc_set_ca_path(struct smtpc_request *req, const char *ca_path)
 {
-	curl_easy_setopt(req->easy, CURLOPT_CAPATH, ca_path);
+	smtpc_request_set_string(req, &req->ca_path, ca_path);
 }
 
 void
 smtpc_set_ca_file(struct smtpc_request *req, const char *ca_file)
 {
-	curl_easy_setopt(req->easy, CURLOPT_CAINFO, ca_file);
+	smtpc_request_set_string(req, &req->ca_file, ca_file);
 }
 
 void
 smtpc_set_verify_host(struct smtpc_request *req, long verify)
 {
-	curl_easy_setopt(req->easy, CURLOPT_SSL_VERIFYHOST, verify);
+	req->verify_host = verify;
 }
 
 void
 smtpc_set_verify_peer(struct smtpc_request *req, long verify)
 {
-	curl_easy_setopt(req->easy, CURLOPT_SSL_VERIFYPEER, verify);
+	req->verify_peer = verify;
 }
 
 void
 smtpc_set_ssl_key(struct smtpc_request *req, const char *ssl_key)
 {
-	curl_easy_setopt(req->easy, CURLOPT_SSLKEY, ssl_key);
+	smtpc_request_set_string(req, &req->ssl_key, ssl_key);
 }
 
 void
 smtpc_set_ssl_cert(struct smtpc_request *req, const char *ssl_cert)
 {
-	curl_easy_setopt(req->easy, CURLOPT_SSLCERT, ssl_cert);
+	smtpc_request_set_string(req, &req->ssl_cert, ssl_cert);
 }
 
 void
 smtpc_set_use_ssl(struct smtpc_request *req, long use_ssl)
 {
-	curl_easy_setopt(req->easy, CURLOPT_USE_SSL, use_ssl);
+	req->use_ssl = use_ssl;
+}
+
+void
+smtpc_set_connect_timeout(struct smtpc_request *req, double timeout)
+{
+	req->connect_timeout = timeout > 0 ? timeout : 0;
+}
+
+void
+smtpc_set_low_speed(struct smtpc_request *req, long limit, long time)
+{
+	req->low_speed_limit = limit > 0 ? limit : 0;
+	req->low_speed_time = time > 0 ? time : 0;
+}
+
+void
+smtpc_set_deadline(struct smtpc_request *req, double deadline)
+{
+	req->deadline = deadline;
+}
+
+void
+smtpc_set_engine(struct smtpc_request *req, enum smtpc_engine engine)
+{
+	req->engine = engine;
 }
 
 void
 smtpc_set_username(struct smtpc_request *req, const char *username)
 {
-	curl_easy_setopt(req->easy, CURLOPT_USERNAME, username);
+	smtpc_request_set_string(req, &req->username, username);
 }
 
 void
 smtpc_set_password(struct smtpc_request *req, const char *password)
 {
-	curl_easy_setopt(req->easy, CURLOPT_PASSWORD, password);
+	smtpc_request_set_string(req, &req->password, password);
 }
 
 void
 smtpc_set_from(struct smtpc_request *req, const char *from)
 {
-	curl_easy_setopt(req->easy, CURLOPT_MAIL_FROM, from);
+	smtpc_request_set_string(req, &req->from, from);
 }
 
 int
 smtpc_add_recipient(struct smtpc_request *req, const char *recipient)
 {
-	struct curl_slist *l = curl_slist_append(req->recipients, recipient);
+	/*
+	 * libcurl only reads the list, so the nodes are allocated
+	 * on the arena instead of by curl_slist_append().
+	 */
+	size_t len = strlen(recipient);
+	struct curl_slist *l = smtpc_arena_alloc(&req->arena,
+						 sizeof(*l) + len + 1);
 	if (l == NULL)
 		return -1;
-	req->recipients = l;
+	l->data = (char *)(l + 1);
+	memcpy(l->data, recipient, len + 1);
+	l->next = NULL;
+	if (req->recipients_last != NULL)
+		req->recipients_last->next = l;
+	else
+		req->recipients = l;
+	req->recipients_last = l;
 	return 0;
 }
 
-static long int
-smtpc_task_execute(va_list list)
+/**
+ * Fail the request on an error that is not related to the
+ * transfer. Stop the transfer if it is not finished yet.
+ */
+static void
+smtpc_request_abort(struct smtpc_request *req)
 {
-	struct smtpc_request *req = va_arg(list, struct smtpc_request *);
-	req->code = curl_easy_perform(req->easy);
+	struct smtpc_env *env = req->env;
+	if (!req->done)
+		curl_multi_remove_handle(env->multi, req->easy);
+	curl_easy_setopt(req->easy, CURLOPT_SHARE, NULL);
+	--env->stat.active_requests;
+	smtpc_env_release(env);
+	++env->stat.failed_requests;
+	smtpc_env_account(env, req, -1, SMTPC_ERROR_ABORTED);
+}
+
+/**
+ * Add a phase duration to the statistics. libcurl time values
+ * are signed.
+ */
+static void
+smtpc_env_add_latency(struct smtpc_env *env, enum smtpc_phase phase,
+		      curl_off_t usec)
+{
+	smtpc_histogram_add(&env->stat.latency[phase], usec > 0 ? usec : 0);
+}
+
+/**
+ * Record durations of the finished transfer phases.
+ */
+static void
+smtpc_request_record_latency(struct smtpc_request *req)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+	struct smtpc_env *env = req->env;
+	curl_off_t total = 0;
+	if (curl_easy_getinfo(req->easy, CURLINFO_TOTAL_TIME_T,
+			      &total) != CURLE_OK)
+		return;
+	smtpc_env_add_latency(env, SMTPC_PHASE_TOTAL, total);
+
+	/* The times are measured from the start of the transfer. */
+	curl_off_t dns = 0, connect = 0, tls = 0, first_byte = 0;
+	curl_easy_getinfo(req->easy, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+	curl_easy_getinfo(req->easy, CURLINFO_CONNECT_TIME_T, &connect);
+	curl_easy_getinfo(req->easy, CURLINFO_APPCONNECT_TIME_T, &tls);
+	curl_easy_getinfo(req->easy, CURLINFO_STARTTRANSFER_TIME_T,
+			  &first_byte);
+	long new_conns = 0;
+	curl_easy_getinfo(req->easy, CURLINFO_NUM_CONNECTS, &new_conns);
+	curl_off_t connected = connect;
+	if (new_conns > 0 && connect > 0) {
+		smtpc_env_add_latency(env, SMTPC_PHASE_DNS, dns);
+		smtpc_env_add_latency(env, SMTPC_PHASE_CONNECT, connect - dns);
+		if (tls > 0) {
+			smtpc_env_add_latency(env, SMTPC_PHASE_TLS,
+					      tls - connect);
+			connected = tls;
+		}
+	}
+	if (first_byte > 0)
+		smtpc_env_add_latency(env, SMTPC_PHASE_FIRST_BYTE,
+				      first_byte - connected);
+#else
+	(void)req;
+#endif
+}
+
+/**
+ * Fetch the next body chunk from the file or the reader and
+ * resume the transfer paused by smtpc_read_body().
+ */
+static int
+smtpc_request_read_body(struct smtpc_request *req)
+{
+	/*
+	 * The readers yield, while libcurl may call the read
+	 * callback: it is paused until the chunk is installed, so
+	 * the current one (the file buffer in the first place) is
+	 * not replaced before it is consumed.
+	 */
+	req->body_fetching = true;
+	int rc = 0;
+	if (req->body_file.seg != NULL) {
+		const char *data;
+		size_t size;
+		rc = smtpc_mime_file_read(&req->body_file, &data, &size);
+		if (rc == 0) {
+			smtpc_set_body(req, data, size);
+			if (size == 0)
+				smtpc_mime_file_destroy(&req->body_file);
+		}
+	} else {
+		rc = req->body_reader(req, req->body_reader_arg);
+	}
+	req->body_fetching = false;
+	if (rc != 0)
+		return -1;
+	req->body_wanted = false;
+	/* The transfer may have failed while the reader yielded. */
+	if (req->done)
+		return 0;
+	if (req->body_size == 0)
+		req->body_eof = true;
+	if (req->engine == SMTPC_ENGINE_CURL)
+		curl_easy_pause(req->easy, CURLPAUSE_CONT);
 	return 0;
 }
 
-int
-smtpc_execute(struct smtpc_request *req, double timeout)
+ssize_t
+smtpc_request_read(struct smtpc_request *req, char *buf, size_t size)
+{
+	while (true) {
+		size_t n = smtpc_read_body(buf, 1, size, req);
+		if (n == CURL_READFUNC_ABORT) {
+			box_error_set(__FILE__, __LINE__, ER_SYSTEM,
+				      "Can't read smtp body");
+			return -1;
+		}
+		if (n != CURL_READFUNC_PAUSE)
+			return n;
+		if (smtpc_request_read_body(req) != 0)
+			return -1;
+	}
+}
+
+/**
+ * Convert a timeout to milliseconds for libcurl: round it up, so
+ * a short timeout does not turn into 0, which means no timeout.
+ * A timeout, which does not fit, is no timeout.
+ */
+static long
+smtpc_timeout_ms(double timeout)
+{
+	if (timeout >= LONG_MAX / 1000)
+		return 0;
+	long ms = (long)(timeout * 1000);
+	if (ms < timeout * 1000)
+		++ms;
+	return ms > 0 ? ms : 1;
+}
+
+/**
+ * Check the request and wait for the rate limits and for a free
+ * slot. On success the slot is taken and @a timeout is lowered to
+ * the time left before the deadline if needed. A @a timeout <= 0
+ * means no timeout, as 0 does for libcurl.
+ */
+static int
+smtpc_request_admit(struct smtpc_request *req, double *timeout)
+{
+	struct smtpc_env *env = req->env;
+
+	if (req->options_oom) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't alloc smtp request option");
+		return -1;
+	}
+	if (*timeout <= 0)
+		*timeout = TIMEOUT_INFINITY;
+	/* The waits are bounded by the timeout and the deadline. */
+	double now = fiber_clock();
+	double wait_end = now + *timeout;
+	double deadline = req->deadline > 0 ?
+			  now + (req->deadline - fiber_time()) : wait_end;
+	if (deadline < wait_end)
+		wait_end = deadline;
+	if (wait_end <= now) {
+		box_error_set(__FILE__, __LINE__, ER_TIMEOUT,
+			      "SMTP request deadline has expired");
+		return -1;
+	}
+	if (smtpc_request_check_relay(req) != 0)
+		return -1;
+	if (smtpc_request_throttle(req, wait_end - now) != 0)
+		return -1;
+	if (smtpc_env_admit(env, wait_end - fiber_clock()) != 0) {
+		smtpc_request_unthrottle(req);
+		return -1;
+	}
+	/* The transfer gets the whole timeout within the deadline. */
+	if (req->deadline > 0 && deadline - fiber_clock() < *timeout)
+		*timeout = deadline - fiber_clock();
+	return 0;
+}
+
+/**
+ * Apply the options of the request and pass it to the multi
+ * handle.
+ */
+static int
+smtpc_request_start(struct smtpc_request *req, double timeout)
 {
 	struct smtpc_env *env = req->env;
 
-	curl_easy_setopt(req->easy, CURLOPT_PRIVATE,
-			 (void *) &req);
+	if (req->engine != SMTPC_ENGINE_CURL) {
+		box_error_set(__FILE__, __LINE__, ER_ILLEGAL_PARAMS,
+			      "SMTP native engine does not support "
+			      "asynchronous requests");
+		return -1;
+	}
+	if (smtpc_request_admit(req, &timeout) != 0)
+		return -1;
+	curl_easy_setopt(req->easy, CURLOPT_URL, req->url);
+	curl_easy_setopt(req->easy, CURLOPT_MAIL_FROM, req->from);
+	curl_easy_setopt(req->easy, CURLOPT_ERRORBUFFER, req->error_buf);
+	if (env->max_conns == 0)
+		curl_easy_setopt(req->easy, CURLOPT_FORBID_REUSE, 1L);
+	curl_easy_setopt(req->easy, CURLOPT_VERBOSE, (long)req->verbose);
+	if (req->username != NULL)
+		curl_easy_setopt(req->easy, CURLOPT_USERNAME, req->username);
+	if (req->password != NULL)
+		curl_easy_setopt(req->easy, CURLOPT_PASSWORD, req->password);
+	const char *ca_path = req->ca_path != NULL ? req->ca_path :
+			      env->ca_path;
+	const char *ca_file = req->ca_file != NULL ? req->ca_file :
+			      env->ca_file;
+	if (ca_path != NULL)
+		curl_easy_setopt(req->easy, CURLOPT_CAPATH, ca_path);
+	if (ca_file != NULL)
+		curl_easy_setopt(req->easy, CURLOPT_CAINFO, ca_file);
+#if LIBCURL_VERSION_NUM >= 0x075700
+	/*
+	 * The multi handle caches the parsed CA store. The timeout
+	 * is in seconds, so a store, which is older than the last
+	 * reload, is dropped in a second at most.
+	 */
+	curl_easy_setopt(req->easy, CURLOPT_CA_CACHE_TIMEOUT,
+			 (long)(fiber_clock() - env->tls_loaded) + 1);
+#endif
+	if (req->ssl_key != NULL)
+		curl_easy_setopt(req->easy, CURLOPT_SSLKEY, req->ssl_key);
+	if (req->ssl_cert != NULL)
+		curl_easy_setopt(req->easy, CURLOPT_SSLCERT, req->ssl_cert);
+	curl_easy_setopt(req->easy, CURLOPT_SSL_VERIFYHOST, req->verify_host);
+	curl_easy_setopt(req->easy, CURLOPT_SSL_VERIFYPEER, req->verify_peer);
+	curl_easy_setopt(req->easy, CURLOPT_USE_SSL, req->use_ssl);
+
+	curl_easy_setopt(req->easy, CURLOPT_PRIVATE, (void *) req);
+	curl_easy_setopt(req->easy, CURLOPT_SHARE, env->share);
 
 	curl_easy_setopt(req->easy, CURLOPT_READFUNCTION,
 			 smtpc_read_body);
 	curl_easy_setopt(req->easy, CURLOPT_READDATA, req);
 	curl_easy_setopt(req->easy, CURLOPT_UPLOAD, 1L);
+	/* Without a message the reader supplies the whole body. */
+	req->body_streaming = req->mime == NULL && req->body_reader != NULL;
 	curl_easy_setopt(req->easy, CURLOPT_MAIL_RCPT,
 			 req->recipients);
-	curl_easy_setopt(req->easy, CURLOPT_TIMEOUT, (long)timeout);
+	curl_easy_setopt(req->easy, CURLOPT_TIMEOUT_MS,
+			 smtpc_timeout_ms(timeout));
+	if (req->connect_timeout > 0)
+		curl_easy_setopt(req->easy, CURLOPT_CONNECTTIMEOUT_MS,
+				 smtpc_timeout_ms(req->connect_timeout));
+	if (req->low_speed_limit > 0) {
+		curl_easy_setopt(req->easy, CURLOPT_LOW_SPEED_LIMIT,
+				 req->low_speed_limit);
+		curl_easy_setopt(req->easy, CURLOPT_LOW_SPEED_TIME,
+				 req->low_speed_time);
+	}
 
 	++env->stat.total_requests;
 	++env->stat.active_requests;
 
-	if (coio_call(smtpc_task_execute, req) != 0)
+	req->done = false;
+	req->started = fiber_clock();
+	CURLMcode mcode = curl_multi_add_handle(env->multi, req->easy);
+	if (mcode != CURLM_OK) {
+		curl_easy_setopt(req->easy, CURLOPT_SHARE, NULL);
+		--env->stat.active_requests;
+		smtpc_env_release(env);
+		++env->stat.failed_requests;
+		smtpc_env_account(env, req, -1, SMTPC_ERROR_OTHER);
+		box_error_set(__FILE__, __LINE__, ER_SYSTEM,
+			      "curl_multi_add_handle failed: %s",
+			      curl_multi_strerror(mcode));
 		return -1;
+	}
+	return 0;
+}
 
+/**
+ * Fill the status of the finished transfer and account it.
+ */
+static int
+smtpc_request_finish(struct smtpc_request *req)
+{
+	struct smtpc_env *env = req->env;
+	/*
+	 * Detach the finished request from the share handle: it may
+	 * be deleted after the environment, while the share handle
+	 * is cleaned up in a coio thread.
+	 */
+	curl_easy_setopt(req->easy, CURLOPT_SHARE, NULL);
 	--env->stat.active_requests;
+	smtpc_env_release(env);
+	smtpc_request_record_latency(req);
+
+	if (req->body_error) {
+		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
+			      "Can't create smtp body fiber");
+		++env->stat.failed_requests;
+		smtpc_env_account(env, req, -1, SMTPC_ERROR_ABORTED);
+		return -1;
+	}
 
 	long longval = 0;
+	enum smtpc_error_class error = smtpc_error_class(req->code);
 	switch (req->code) {
 	case CURLE_OK:
 		curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &longval);
@@ -457,6 +2265,7 @@ smtpc_execute(struct smtpc_request *req, double timeout)
 		box_error_set(__FILE__, __LINE__, ER_MEMORY_ISSUE,
 			      "Curl internal memory issue");
 		++env->stat.failed_requests;
+		smtpc_env_account(env, req, -1, error);
 		return -1;
 	case CURLE_SEND_ERROR:
 	case CURLE_RECV_ERROR:
@@ -484,9 +2293,266 @@ smtpc_execute(struct smtpc_request *req, double timeout)
 		snprintf(error_msg, sizeof(error_msg), "CURL error %i (os errno %li)", req->code, longval);
 		box_error_set(__FILE__, __LINE__, ER_UNKNOWN, error_msg);
 		++env->stat.failed_requests;
+		smtpc_env_account(env, req, -1, error);
+		return -1;
+	}
+	}
+
+	smtpc_env_account(env, req, req->status, error);
+	return 0;
+}
+
+/**
+ * Execute the request by the native engine in the calling fiber,
+ * see smtpc_native_execute() for @a session.
+ */
+static int
+smtpc_execute_native(struct smtpc_request *req, double timeout,
+		     struct smtpc_session **session)
+{
+	struct smtpc_env *env = req->env;
+
+	if (smtpc_native_check(req) != 0)
+		return -1;
+	if (smtpc_request_admit(req, &timeout) != 0)
+		return -1;
+	/* Without a message the reader supplies the whole body. */
+	req->body_streaming = req->mime == NULL && req->body_reader != NULL;
+
+	++env->stat.total_requests;
+	++env->stat.active_requests;
+	req->done = false;
+	req->started = fiber_clock();
+	int rc = smtpc_native_execute(req, timeout, session);
+	req->done = true;
+	--env->stat.active_requests;
+	smtpc_env_release(env);
+	smtpc_env_add_latency(env, SMTPC_PHASE_TOTAL,
+			      (fiber_clock() - req->started) * 1000000);
+
+	if (rc != 0) {
+		++env->stat.failed_requests;
+		smtpc_env_account(env, req, -1, fiber_is_cancelled() ?
+				  SMTPC_ERROR_ABORTED : SMTPC_ERROR_OTHER);
+		return -1;
+	}
+	/* Raise the errors, which smtpc_request_finish() raises. */
+	switch (req->code) {
+	case CURLE_LOGIN_DENIED:
+	case CURLE_WEIRD_SERVER_REPLY:
+	case CURLE_REMOTE_ACCESS_DENIED:
+		box_error_set(__FILE__, __LINE__, ER_UNKNOWN,
+			      "CURL error %i (os errno 0)", req->code);
+		++env->stat.failed_requests;
+		smtpc_env_account(env, req, -1, smtpc_error_class(req->code));
+		return -1;
+	default:
+		break;
+	}
+	if (req->code != CURLE_OK)
+		++env->stat.failed_requests;
+	smtpc_env_account(env, req, req->status,
+			  smtpc_error_class(req->code));
+	return 0;
+}
+
+int
+smtpc_execute(struct smtpc_request *req, double timeout)
+{
+	if (req->engine == SMTPC_ENGINE_NATIVE)
+		return smtpc_execute_native(req, timeout, NULL);
+	if (smtpc_request_start(req, timeout) != 0)
 		return -1;
+	while (!req->done) {
+		if (req->body_wanted) {
+			if (smtpc_request_read_body(req) != 0) {
+				smtpc_request_abort(req);
+				return -1;
+			}
+			continue;
+		}
+		if (fiber_cond_wait(req->cond) != 0 && fiber_is_cancelled()) {
+			/* The diag is set by fiber_cond_wait(). */
+			smtpc_request_abort(req);
+			return -1;
+		}
+	}
+	return smtpc_request_finish(req);
+}
+
+int
+smtpc_execute_batch(struct smtpc_request **reqs, int count, double timeout)
+{
+	/*
+	 * The connection of a finished transfer is returned into
+	 * the multi handle cache, where the next request of the
+	 * batch picks it up. The native engine keeps its session
+	 * for the next request instead.
+	 */
+	struct smtpc_session *session = NULL;
+	int rc = 0;
+	for (int i = 0; i < count; ++i) {
+		struct smtpc_request *req = reqs[i];
+		if ((req->engine == SMTPC_ENGINE_NATIVE ?
+		     smtpc_execute_native(req, timeout, &session) :
+		     smtpc_execute(req, timeout)) == 0)
+			continue;
+		if (fiber_is_cancelled()) {
+			rc = -1;
+			break;
+		}
+		/*
+		 * Go on with the rest of the batch: the results of the
+		 * sent messages must not be lost, or a caller retrying
+		 * the batch sends them again.
+		 */
+		snprintf(req->error_buf, sizeof(req->error_buf), "%s",
+			 box_error_message(box_error_last()));
+		req->status = -1;
+		req->reason = req->error_buf;
+	}
+	if (session != NULL)
+		smtpc_native_session_close(session);
+	return rc;
+}
+
+/**
+ * Store the result of the asynchronous request and notify about
+ * its completion. The request may be deleted by the callback.
+ */
+static void
+smtpc_request_complete(struct smtpc_request *req, int rc)
+{
+	struct smtpc_env *env = req->env;
+	req->result = rc;
+	if (rc != 0) {
+		box_error_t *e = box_error_last();
+		req->error_code = box_error_code(e);
+		req->error_msg = strdup(box_error_message(e));
 	}
+	req->finished = true;
+	fiber_cond_broadcast(req->cond);
+	if (req->notify) {
+		req->next_completed = NULL;
+		if (env->completed_last != NULL)
+			env->completed_last->next_completed = req;
+		else
+			env->completed_first = req;
+		env->completed_last = req;
+		fiber_cond_signal(env->completed_cond);
+	}
+	if (req->on_done != NULL)
+		req->on_done(req, req->on_done_arg);
+}
+
+/**
+ * Body fiber of an asynchronous request. It is started from the
+ * read callback, when a file attachment chunk is wanted, and
+ * finishes the request if the transfer is over meanwhile.
+ */
+static int
+smtpc_body_f(va_list list)
+{
+	struct smtpc_request *req = va_arg(list, struct smtpc_request *);
+	/* Let the read callback, which has started the fiber, return. */
+	fiber_sleep(0);
+	int rc = 0;
+	while (rc == 0 && req->body_wanted && !req->done)
+		rc = smtpc_request_read_body(req);
+	req->body_fiber = false;
+	if (req->cancelled) {
+		smtpc_request_complete(req, 0);
+	} else if (rc != 0) {
+		smtpc_request_abort(req);
+		req->done = true;
+		smtpc_request_complete(req, -1);
+	} else if (req->done) {
+		smtpc_request_complete(req, smtpc_request_finish(req));
 	}
+	return 0;
+}
+
+void
+smtpc_set_notify(struct smtpc_request *req, bool notify)
+{
+	req->notify = notify;
+}
+
+int
+smtpc_request_start_async(struct smtpc_request *req, double timeout,
+			  smtpc_request_done_f on_done, void *arg)
+{
+	assert(req->mime != NULL || req->body_reader == NULL);
+	req->async = true;
+	req->on_done = on_done;
+	req->on_done_arg = arg;
+	if (smtpc_request_start(req, timeout) != 0)
+		return -1;
+	if (req->notify)
+		++req->env->notify_count;
+	return 0;
+}
 
+int
+smtpc_request_wait(struct smtpc_request *req, double timeout)
+{
+	double deadline = fiber_clock() + timeout;
+	while (!req->finished) {
+		double delay = deadline - fiber_clock();
+		/* The diag is set by fiber_cond_wait_timeout(). */
+		if (fiber_cond_wait_timeout(req->cond,
+					    delay > 0 ? delay : 0) != 0)
+			return req->finished ? 0 : -1;
+	}
 	return 0;
 }
+
+bool
+smtpc_request_cancel(struct smtpc_request *req)
+{
+	/*
+	 * A finished transfer is completed by the body fiber, if
+	 * it is still active.
+	 */
+	if (req->finished || req->cancelled || req->done)
+		return false;
+	req->cancelled = true;
+	smtpc_request_abort(req);
+	req->done = true;
+	req->status = -1;
+	req->reason = "Request cancelled";
+	if (!req->body_fiber)
+		smtpc_request_complete(req, 0);
+	return true;
+}
+
+int
+smtpc_request_result(struct smtpc_request *req)
+{
+	assert(req->finished);
+	if (req->result == 0)
+		return 0;
+	box_error_set(__FILE__, __LINE__, req->error_code, "%s",
+		      req->error_msg != NULL ? req->error_msg :
+		      "Can't alloc smtp error message");
+	return -1;
+}
+
+struct smtpc_request *
+smtpc_env_next_completed(struct smtpc_env *env)
+{
+	while (env->completed_first == NULL) {
+		if (env->notify_count == 0)
+			return NULL;
+		if (fiber_cond_wait(env->completed_cond) != 0 &&
+		    fiber_is_cancelled())
+			return NULL;
+	}
+	struct smtpc_request *req = env->completed_first;
+	env->completed_first = req->next_completed;
+	if (env->completed_first == NULL)
+		env->completed_last = NULL;
+	req->next_completed = NULL;
+	--env->notify_count;
+	return req;
+}
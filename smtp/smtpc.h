@@ -32,9 +32,12 @@
  */
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 #include <curl/curl.h>
 
+#include "mime.h"
+
 /* {{{ Subsystem initialization */
 
 /**
@@ -55,6 +58,193 @@ smtpc_init(void);
 typedef void CURLM;
 typedef void CURL;
 struct curl_slist;
+struct smtpc_dkim_key;
+
+/** log2 of the number of histogram buckets per power of two. */
+#define SMTPC_HISTOGRAM_SUB_BITS 3
+/** The number of histogram buckets per power of two. */
+#define SMTPC_HISTOGRAM_SUB (1 << SMTPC_HISTOGRAM_SUB_BITS)
+/** Values below 2^42 (50 days in microseconds) are distinguished. */
+#define SMTPC_HISTOGRAM_BUCKETS (40 * SMTPC_HISTOGRAM_SUB)
+/** The maximum number of deleted requests kept for reuse. */
+#define SMTPC_FREE_REQUESTS_MAX 64
+
+/**
+ * Histogram with fixed log-scale buckets: each power of two is
+ * split into SMTPC_HISTOGRAM_SUB buckets, so the relative error
+ * of a percentile is below 1 / SMTPC_HISTOGRAM_SUB.
+ */
+struct smtpc_histogram {
+	/** The number of values. */
+	uint64_t count;
+	uint64_t buckets[SMTPC_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Add a value to the histogram.
+ */
+void
+smtpc_histogram_add(struct smtpc_histogram *hist, uint64_t value);
+
+/**
+ * Get a percentile of the histogram values: the upper bound of
+ * the bucket it falls into.
+ * @param hist histogram
+ * @param percent percentile, 0..100
+ * @return the percentile, 0 if the histogram is empty
+ */
+uint64_t
+smtpc_histogram_percentile(const struct smtpc_histogram *hist,
+			   double percent);
+
+/**
+ * Phases of a request measured by the client.
+ */
+enum smtpc_phase {
+	/** Name resolution. */
+	SMTPC_PHASE_DNS,
+	/** TCP connection establishment. */
+	SMTPC_PHASE_CONNECT,
+	/** TLS handshake. */
+	SMTPC_PHASE_TLS,
+	/** Waiting for the first server reply after connecting. */
+	SMTPC_PHASE_FIRST_BYTE,
+	/** The whole transfer. */
+	SMTPC_PHASE_TOTAL,
+	smtpc_phase_MAX,
+};
+
+/** Names of the phases. */
+extern const char *smtpc_phase_strs[];
+
+/**
+ * Classes of SMTP replies to requests.
+ */
+enum smtpc_status_class {
+	SMTPC_STATUS_2XX,
+	SMTPC_STATUS_3XX,
+	SMTPC_STATUS_4XX,
+	SMTPC_STATUS_5XX,
+	smtpc_status_class_MAX,
+};
+
+/** Names of the reply classes. */
+extern const char *smtpc_status_class_strs[];
+
+/**
+ * Classes of requests failed without an SMTP reply.
+ */
+enum smtpc_error_class {
+	/** The request timed out. */
+	SMTPC_ERROR_TIMEOUT,
+	/** The relay host name can't be resolved. */
+	SMTPC_ERROR_RESOLVE,
+	/** The relay can't be connected. */
+	SMTPC_ERROR_CONNECT,
+	/** TLS handshake or certificate verification failed. */
+	SMTPC_ERROR_SSL,
+	/** The connection broke while sending or receiving. */
+	SMTPC_ERROR_SEND_RECV,
+	/** The relay closed the connection without a reply. */
+	SMTPC_ERROR_NO_RESPONSE,
+	/** The request was cancelled or its body reader failed. */
+	SMTPC_ERROR_ABORTED,
+	/** Any other error. */
+	SMTPC_ERROR_OTHER,
+	smtpc_error_class_MAX,
+};
+
+/** Names of the error classes. */
+extern const char *smtpc_error_class_strs[];
+
+/**
+ * Token bucket limiting the request rate to a destination.
+ */
+struct smtpc_bucket {
+	/** Available tokens, negative if taken in advance. */
+	double tokens;
+	/** Time of the last refill in fiber_clock() terms, 0 if never. */
+	double updated;
+	/** Stamp of the last request, which has visited the bucket. */
+	uint64_t visited;
+};
+
+/**
+ * Rate limit of a kind of destinations.
+ */
+struct smtpc_rate {
+	/** Requests per second, <= 0 if unlimited. */
+	double rate;
+	/** The maximum number of requests sent at once. */
+	double burst;
+};
+
+/**
+ * Passive health of a relay, which is estimated from the
+ * finished requests.
+ */
+struct smtpc_health {
+	/** Moving average of the request latency in seconds. */
+	double latency;
+	/** Moving average of the failure rate, from 0 to 1. */
+	double error_rate;
+	/** The number of failed requests in a row. */
+	int failures;
+	/**
+	 * The relay is ejected until this time in fiber_clock()
+	 * terms, 0 if it is not ejected.
+	 */
+	double ejected_until;
+	/** The number of ejections. */
+	uint64_t ejections;
+};
+
+/**
+ * Statistics of requests to one relay.
+ */
+struct smtpc_dest_stat {
+	/** Relay URL, NULL if the hash table slot is free. */
+	char *url;
+	/** Hash of the URL. */
+	uint32_t hash;
+	/** The number of finished requests. */
+	uint64_t requests;
+	/** The number of requests by SMTP reply class. */
+	uint64_t status[smtpc_status_class_MAX];
+	/** The number of requests by failure class. */
+	uint64_t errors[smtpc_error_class_MAX];
+	/** Rate limiter of the destination. */
+	struct smtpc_bucket bucket;
+	/** Health of the relay. */
+	struct smtpc_health health;
+};
+
+/**
+ * Statistics by relay: an open addressing hash table keyed by
+ * the relay URL.
+ */
+struct smtpc_dest_stats {
+	/** Hash table slots, the number is a power of two. */
+	struct smtpc_dest_stat *slots;
+	/** The number of slots. */
+	uint32_t capacity;
+	/** The number of used slots. */
+	uint32_t count;
+};
+
+/**
+ * Find the statistics of a relay, create it if there is none.
+ * The user info (credentials) of the URL is not a part of the key.
+ * Return NULL on memory allocation error.
+ */
+struct smtpc_dest_stat *
+smtpc_dest_stats_get(struct smtpc_dest_stats *stats, const char *url);
+
+/**
+ * Free the memory of the statistics by relay.
+ */
+void
+smtpc_dest_stats_destroy(struct smtpc_dest_stats *stats);
 
 /**
  * SMTP Client Statistics
@@ -63,25 +253,165 @@ struct smtpc_stat {
 	uint64_t active_requests;
 	uint64_t total_requests;
 	uint64_t failed_requests;
+	/** Requests waiting for a free slot. */
+	uint64_t queued_requests;
+	/** Requests rejected because the wait queue is full. */
+	uint64_t rejected_requests;
+	/** Requests delayed by a rate limit. */
+	uint64_t throttled_requests;
+	/**
+	 * Durations of the request phases in microseconds.
+	 * Connection phases are only recorded for requests,
+	 * which open a new connection.
+	 */
+	struct smtpc_histogram latency[smtpc_phase_MAX];
+	/** Statistics by relay. */
+	struct smtpc_dest_stats dests;
 };
 
+struct smtpc_sock;
+struct smtpc_timer;
+struct smtpc_waiter;
+struct fiber_cond;
+
+/**
+ * Relay of a client, which is chosen by smtpc_env_pick_relay().
+ */
+struct smtpc_relay {
+	/** Relay URL. */
+	char *url;
+	/** Share of the requests sent to the relay. */
+	double weight;
+	/** Current weight of the smooth weighted round-robin. */
+	double current;
+};
+
+/** The maximum number of relays of a client. */
+#define SMTPC_RELAYS_MAX 64
+/** The maximum number of parsed DKIM keys kept by a client. */
+#define SMTPC_DKIM_KEYS_MAX 16
+/**
+ * The number of domain rate limiters, at which the idle ones are
+ * dropped.
+ */
+#define SMTPC_DOMAINS_MAX 1024
+
 /**
  * SMTP Client Environment
  */
 struct smtpc_env {
 	/** Statistics */
 	struct smtpc_stat stat;
+	/**
+	 * Curl multi handle. It drives all requests of the
+	 * environment from the TX thread and owns the connection
+	 * cache.
+	 */
+	CURLM *multi;
+	/** Curl share handle: the TLS session and DNS caches. */
+	CURLSH *share;
+	/**
+	 * The maximum number of idle connections to keep. The
+	 * least recently used one is closed when the cache is
+	 * full.
+	 */
+	int max_conns;
+	/** libcurl timer. */
+	struct smtpc_timer *timer;
+	/** Sockets libcurl asked to watch. */
+	struct smtpc_sock *socks;
+	/**
+	 * Completion queue: finished asynchronous requests, which
+	 * asked for a notification.
+	 */
+	struct smtpc_request *completed_first;
+	struct smtpc_request *completed_last;
+	/** Signalled when a request is put to the completion queue. */
+	struct fiber_cond *completed_cond;
+	/**
+	 * The number of asynchronous requests, which asked for a
+	 * notification and are not taken from the queue yet.
+	 */
+	int notify_count;
+	/**
+	 * The maximum number of requests in progress, <= 0 if
+	 * unlimited.
+	 */
+	int max_inflight;
+	/**
+	 * The maximum number of requests waiting for a free slot,
+	 * < 0 if unlimited.
+	 */
+	int queue_size;
+	/** The number of requests holding a slot. */
+	int inflight;
+	/** Requests waiting for a slot, in the arrival order. */
+	struct smtpc_waiter *waiters_first;
+	struct smtpc_waiter *waiters_last;
+	/** Rate limit of requests to one relay. */
+	struct smtpc_rate relay_rate;
+	/** Rate limit of requests to one recipient domain. */
+	struct smtpc_rate domain_rate;
+	/**
+	 * Rate limiters by recipient domain. Only the bucket of
+	 * an entry is used.
+	 */
+	struct smtpc_dest_stats domains;
+	/** The number of domain rate limiters left by the last pruning. */
+	uint32_t domains_kept;
+	/** Stamp of the last request, which has visited rate limiters. */
+	uint64_t rate_stamp;
+	/** CA bundle of the requests, which don't set their own. */
+	char *ca_file;
+	/** CA directory of the requests, which don't set their own. */
+	char *ca_path;
+	/**
+	 * Time of the last smtpc_env_reload_tls() in fiber_clock()
+	 * terms: the cached CA store must not be older.
+	 */
+	double tls_loaded;
+	/**
+	 * Deleted requests kept for reuse, linked by
+	 * next_completed. Their easy handles, conditions and
+	 * arenas are reused by smtpc_request_new().
+	 */
+	struct smtpc_request *free_requests;
+	/** The number of requests in the free list. */
+	int free_count;
+	/** Relays to choose from, see smtpc_env_pick_relay(). */
+	struct smtpc_relay *relays;
+	/** The number of relays. */
+	int relay_count;
+	/**
+	 * The number of failed requests in a row, which ejects a
+	 * relay, 0 if relays are never ejected.
+	 */
+	int eject_failures;
+	/** For how long a relay is ejected, in seconds. */
+	double eject_time;
+	/**
+	 * Parsed DKIM keys, the most recently used first, see
+	 * smtpc_env_dkim_sign().
+	 */
+	struct smtpc_dkim_key *dkim_keys;
+	/** The number of DKIM keys. */
+	int dkim_key_count;
 };
 
 /**
  * @brief Creates  new SMTP client environment
  * @param env pointer to a structure to initialize
- * @param max_conn The maximum number of entries in connection cache
+ * @param max_conns The maximum number of entries in connection cache
+ * @param max_inflight The maximum number of requests in progress,
+ *        <= 0 if unlimited
+ * @param queue_size The maximum number of requests waiting for a
+ *        slot when max_inflight is reached, < 0 if unlimited
  * @retval 0 on success
  * @retval -1 on error, check diag
  */
 int
-smtpc_env_create(struct smtpc_env *ctx);
+smtpc_env_create(struct smtpc_env *env, int max_conns, int max_inflight,
+		 int queue_size);
 
 /**
  * Destroy SMTP client environment
@@ -90,10 +420,151 @@ smtpc_env_create(struct smtpc_env *ctx);
 void
 smtpc_env_destroy(struct smtpc_env *env);
 
+/**
+ * Limit the rate of requests to one relay URL and to one recipient
+ * domain. A request, which would exceed a limit, is delayed before
+ * a connection is opened.
+ * @param env environment
+ * @param relay_rate requests per second to a relay, <= 0 if unlimited
+ * @param relay_burst requests, which may be sent to a relay at once
+ * @param domain_rate requests per second to a domain, <= 0 if unlimited
+ * @param domain_burst requests, which may be sent to a domain at once
+ */
+void
+smtpc_env_set_rate_limit(struct smtpc_env *env, double relay_rate,
+			 double relay_burst, double domain_rate,
+			 double domain_burst);
+
+/**
+ * Set the relays to choose from by smtpc_env_pick_relay().
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_env_set_relays(struct smtpc_env *env, const char **urls,
+		     const double *weights, int count);
+
+/**
+ * Configure the circuit breaker: a relay, which has failed
+ * @a failures requests in a row (no reply or a 4xx one), is
+ * ejected for @a eject_time seconds. Requests to an ejected relay
+ * fail at once. After the ejection the relay is tried again and is
+ * ejected by the next failure. @a failures <= 0 disables it.
+ */
+void
+smtpc_env_set_breaker(struct smtpc_env *env, int failures,
+		      double eject_time);
+
+/**
+ * Choose a relay for the next request by the weights of the
+ * relays, adjusted by their health. Ejected relays are skipped
+ * unless all of them are ejected and @a ejected is set: then the
+ * one, which is ejected for the shortest time, is returned.
+ * @param skip bit mask of the relays not to choose, e.g. the
+ *        ones, which have been tried already
+ * @param ejected whether an ejected relay may be chosen
+ * @retval index of the relay
+ * @retval -1 if all relays are skipped
+ */
+int
+smtpc_env_pick_relay(struct smtpc_env *env, uint64_t skip, bool ejected);
+
+/**
+ * Set the CA bundle file and directory used by the requests,
+ * which don't set their own. The parsed CA store is cached by the
+ * environment (libcurl 7.87.0 or newer is required for that), so
+ * the bundle is not parsed for every connection.
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_env_set_ca(struct smtpc_env *env, const char *ca_file,
+		 const char *ca_path);
+
+/**
+ * Drop the cached CA store, the CA bundle is read again by the
+ * next connection.
+ */
+void
+smtpc_env_reload_tls(struct smtpc_env *env);
+
+/**
+ * Sign a composed message by DKIM and prepend the DKIM-Signature
+ * header to it, see dkim.h. The key is parsed once and cached by
+ * the environment. The body is hashed first: attached files are
+ * read for that, the function yields then.
+ * @param env environment
+ * @param key PEM encoded RSA private key
+ * @param key_size size of the key
+ * @param domain signing domain
+ * @param selector selector of the key
+ * @param mime message
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_env_dkim_sign(struct smtpc_env *env, const char *key, size_t key_size,
+		    const char *domain, const char *selector,
+		    struct smtpc_mime *mime);
+
 /** Environment }}} */
 
 /** {{{ Request */
 
+struct smtpc_request;
+
+/**
+ * Completion callback of an asynchronous request. It is the last
+ * access to the request by the client, so the callback may let the
+ * request be deleted.
+ */
+typedef void
+(*smtpc_request_done_f)(struct smtpc_request *req, void *arg);
+
+/**
+ * Body reader.
+ *
+ * It is called from the fiber executing the request, when libcurl
+ * has consumed the current body chunk. The reader should set the
+ * next chunk using smtpc_set_body() or set an empty body at the
+ * end of the message. The chunk must stay valid until the next
+ * call of the reader or deletion of the request. The reader may
+ * yield.
+ *
+ * Return 0 on success, -1 on error (and set an error into the
+ * diagnostics area).
+ */
+typedef int
+(*smtpc_body_reader_f)(struct smtpc_request *req, void *arg);
+
+struct smtpc_arena_block;
+
+/**
+ * Region of memory, which is freed all at once. It keeps its
+ * largest block on reset, so a reused request does not allocate
+ * again.
+ */
+struct smtpc_arena {
+	/** Blocks in the allocation order. */
+	struct smtpc_arena_block *first;
+	/** The block to allocate from, the last one. */
+	struct smtpc_arena_block *last;
+};
+
+/**
+ * SMTP protocol engine of a request.
+ */
+enum smtpc_engine {
+	/** libcurl driven by the multi handle of the environment. */
+	SMTPC_ENGINE_CURL,
+	/**
+	 * The built-in engine on coio sockets, see native.h. It
+	 * pipelines commands and sends the body with BDAT when the
+	 * server supports it.
+	 */
+	SMTPC_ENGINE_NATIVE,
+};
+
 /**
  * SMTP request
  */
@@ -104,14 +575,90 @@ struct smtpc_request {
 	CURL *easy;
 	/** Internal libcurl status code. */
 	int code;
-	/** Recipients. */
+	/** Set when the transfer is finished. */
+	bool done;
+	/** Signalled when the transfer is finished. */
+	struct fiber_cond *cond;
+	/** Time the transfer is started in fiber_clock() terms. */
+	double started;
+	/**
+	 * Request options. They are applied to the easy handle
+	 * at smtpc_execute().
+	 */
+	char *url;
+	char *from;
+	char *username;
+	char *password;
+	char *ca_path;
+	char *ca_file;
+	char *ssl_key;
+	char *ssl_cert;
+	long verify_host;
+	long verify_peer;
+	long use_ssl;
+	bool verbose;
+	/** Connect timeout in seconds, 0 if not set. */
+	double connect_timeout;
+	/** Low speed limit in bytes per second, 0 if not set. */
+	long low_speed_limit;
+	/** Low speed time in seconds. */
+	long low_speed_time;
+	/** Deadline in fiber_time() terms, 0 if not set. */
+	double deadline;
+	/** Protocol engine. */
+	enum smtpc_engine engine;
+	/**
+	 * Set when a copy of an option can't be allocated. The
+	 * error is reported by smtpc_execute().
+	 */
+	bool options_oom;
+	/** Recipients, allocated on the arena. */
 	struct curl_slist *recipients;
-	/** Buffer for the mail body. */
-	char *body;
+	/** The last recipient to append the next one to. */
+	struct curl_slist *recipients_last;
+	/** Memory of the recipients, which is reset on reuse. */
+	struct smtpc_arena arena;
+	/**
+	 * The current body chunk. It is not copied: the memory is
+	 * owned by the caller and must outlive the request.
+	 */
+	const char *body;
 	/** Body size. */
-	int body_size;
-	/** Buffer read position. */
-	char *body_rpos;
+	size_t body_size;
+	/** The number of body bytes passed to libcurl. */
+	size_t body_pos;
+	/**
+	 * Composed message, which is sent segment by segment.
+	 * NULL if the body is set by smtpc_set_body() or is
+	 * supplied by the reader.
+	 */
+	const struct smtpc_mime *mime;
+	/** Index of the next message segment to send. */
+	int mime_pos;
+	/** Reader of the file segment being sent. */
+	struct smtpc_mime_file body_file;
+	/**
+	 * Body reader, which supplies the body chunk by chunk:
+	 * the whole body or the streamed part of the message.
+	 */
+	smtpc_body_reader_f body_reader;
+	/** Reader argument. */
+	void *body_reader_arg;
+	/** Set while the body is supplied by a reader. */
+	bool body_streaming;
+	/**
+	 * Set when libcurl waits for the next body chunk. It is
+	 * cleared when the chunk is installed.
+	 */
+	bool body_wanted;
+	/**
+	 * Set while the next body chunk is being fetched: the
+	 * current one is consumed, but the reader has not returned
+	 * yet, so the transfer is paused.
+	 */
+	bool body_fetching;
+	/** Set when the reader reports the end of the body. */
+	bool body_eof;
 	/**
 	 * SMTP status code.
 	 * It takes the value of -1 if there is some problem,
@@ -127,12 +674,39 @@ struct smtpc_request {
 	const char *reason;
 	/**
 	 * Error buffer for receiving messages.
-	 * It should exist during a request lifetime and
-	 * must be freed at freeing the request structure.
 	 * This field is not for reading directly, cause
 	 * reason field points to it, when appropriate.
 	 */
-	char *error_buf;
+	char error_buf[CURL_ERROR_SIZE];
+	/** Set for a request started by smtpc_request_start_async(). */
+	bool async;
+	/** Put the request to the completion queue when finished. */
+	bool notify;
+	/** Set when the request is cancelled. */
+	bool cancelled;
+	/** Set while a fiber reads the body of the request. */
+	bool body_fiber;
+	/** Set when the body can't be read. */
+	bool body_error;
+	/** Set when the asynchronous request is finished. */
+	bool finished;
+	/**
+	 * Result of the asynchronous request: 0 or -1 if it has
+	 * failed with the error below.
+	 */
+	int result;
+	/** Error code of a failed asynchronous request. */
+	uint32_t error_code;
+	/** Error message of a failed asynchronous request. */
+	char *error_msg;
+	/** Completion callback and its argument. */
+	smtpc_request_done_f on_done;
+	void *on_done_arg;
+	/**
+	 * Next request in the completion queue or in the free
+	 * list of the environment.
+	 */
+	struct smtpc_request *next_completed;
 };
 
 /**
@@ -146,7 +720,9 @@ smtpc_request_new(struct smtpc_env *env, const char *url, const char *from);
 /**
  * @brief Delete SMTP request
  * @param request - reference to object
- * @details Should be called even if error in execute appeared
+ * @details Should be called even if error in execute appeared.
+ * The request may be kept in the free list of the environment
+ * and returned by the next smtpc_request_new().
  */
 void
 smtpc_request_delete(struct smtpc_request *req);
@@ -164,14 +740,31 @@ smtpc_add_recipient(struct smtpc_request *req, const char *recipient);
 /**
  * Sets body of request
  * @param req request
- * @param body body
+ * @param body body, it is not copied and must outlive the request
  * @param bytes sizeof body
- * @retval 0 on success
- * @retval -1 on error, check diag
  */
-int
+void
 smtpc_set_body(struct smtpc_request *req, const char *body, size_t size);
 
+/**
+ * Sets a composed message as body of request
+ * @param req request
+ * @param mime message, it is not copied and must outlive the request
+ */
+void
+smtpc_set_body_mime(struct smtpc_request *req, const struct smtpc_mime *mime);
+
+/**
+ * Sets a reader to stream the body of request by chunks: the
+ * whole body or the streamed part of the composed message
+ * @param req request
+ * @param reader function that supplies body chunks
+ * @param arg reader argument
+ */
+void
+smtpc_set_body_reader(struct smtpc_request *req, smtpc_body_reader_f reader,
+		      void *arg);
+
 void
 smtpc_set_username(struct smtpc_request *req, const char *username);
 
@@ -260,15 +853,147 @@ smtpc_set_ssl_cert(struct smtpc_request *req, const char *ssl_cert);
 void
 smtpc_set_use_ssl(struct smtpc_request *req, long use_ssl);
 
+/**
+ * Set the maximum time of connecting to the server including
+ * name resolution and TLS handshake.
+ * @param req request
+ * @param timeout timeout in seconds, millisecond precision
+ * @see https://curl.se/libcurl/c/CURLOPT_CONNECTTIMEOUT_MS.html
+ */
+void
+smtpc_set_connect_timeout(struct smtpc_request *req, double timeout);
+
+/**
+ * Abort the transfer if it is slower than @a limit bytes per
+ * second for @a time seconds.
+ * @see https://curl.se/libcurl/c/CURLOPT_LOW_SPEED_LIMIT.html
+ */
+void
+smtpc_set_low_speed(struct smtpc_request *req, long limit, long time);
+
+/**
+ * Set an absolute deadline of the request. Unlike the timeout it
+ * covers waiting for a rate limit and for a free slot.
+ * @param req request
+ * @param deadline time in fiber_time() terms
+ */
+void
+smtpc_set_deadline(struct smtpc_request *req, double deadline);
+
+/**
+ * Choose the protocol engine of the request. The native engine
+ * supports plain smtp:// URLs only, the requests are executed by
+ * smtpc_execute() and smtpc_execute_batch().
+ * @param req request
+ * @param engine engine
+ */
+void
+smtpc_set_engine(struct smtpc_request *req, enum smtpc_engine engine);
+
+/**
+ * Copy the next piece of the message to the buffer. Streamed
+ * parts are read as needed, the function yields then. It is used
+ * by the native engine instead of the libcurl read callback.
+ * @param req request
+ * @param buf buffer
+ * @param size size of the buffer
+ * @return the number of bytes copied, 0 at the end of the message
+ *         or -1 on error (check diag)
+ */
+ssize_t
+smtpc_request_read(struct smtpc_request *req, char *buf, size_t size);
+
 /**
  * This function does async SMTP request
  * @param request - reference to request object with filled fields
- * @param timeout - timeout of waiting for libcurl api
+ * @param timeout - timeout of the transfer in seconds, millisecond
+ *        precision; it bounds waiting for a rate limit and for a free
+ *        slot as well
  * @return 0 for success or NULL
  */
 int
 smtpc_execute(struct smtpc_request *req, double timeout);
 
+/**
+ * Execute several requests to the same server one by one.
+ *
+ * The requests are expected to share the URL, credentials and
+ * TLS settings, so all of them are sent over one cached
+ * connection: each next MAIL FROM / RCPT TO / DATA transaction
+ * goes right after the previous one without a new connect, TLS
+ * handshake and authorization.
+ *
+ * A result of each request is stored in its status and reason
+ * fields. An error of a request (a failed login, a file, which
+ * can't be read, OOM) is stored there as status -1 with the error
+ * message as the reason, and the rest of the batch is sent.
+ *
+ * @param reqs - requests to execute
+ * @param count - number of requests
+ * @param timeout - timeout of each request
+ * @retval 0 on success
+ * @retval -1 if the fiber is cancelled, check diag
+ */
+int
+smtpc_execute_batch(struct smtpc_request **reqs, int count, double timeout);
+
+/**
+ * Put the asynchronous request to the completion queue of the
+ * environment when it is finished, see smtpc_env_next_completed().
+ */
+void
+smtpc_set_notify(struct smtpc_request *req, bool notify);
+
+/**
+ * Start an asynchronous request. The request is executed by the
+ * environment without a fiber waiting for it (a fiber is created
+ * only while a file attachment is read). A body reader is not
+ * supported.
+ *
+ * @param req request
+ * @param timeout timeout of the request
+ * @param on_done completion callback, may be NULL
+ * @param arg callback argument
+ * @retval 0 on success
+ * @retval -1 on error, check diag
+ */
+int
+smtpc_request_start_async(struct smtpc_request *req, double timeout,
+			  smtpc_request_done_f on_done, void *arg);
+
+/**
+ * Wait until the asynchronous request is finished.
+ * @retval 0 the request is finished
+ * @retval -1 timeout or fiber cancellation, check diag
+ */
+int
+smtpc_request_wait(struct smtpc_request *req, double timeout);
+
+/**
+ * Cancel the asynchronous request. Its status is -1 then.
+ * @return false if the request is already finished
+ */
+bool
+smtpc_request_cancel(struct smtpc_request *req);
+
+/**
+ * Get the result of the finished asynchronous request. The status
+ * and reason fields are filled on success.
+ * @retval 0 on success
+ * @retval -1 if the request has failed, check diag
+ */
+int
+smtpc_request_result(struct smtpc_request *req);
+
+/**
+ * Take the next request from the completion queue. Wait if the
+ * queue is empty, but there are requests to be finished.
+ * @return request or NULL if there are no such requests or the
+ *         fiber is cancelled
+ */
+struct smtpc_request *
+smtpc_env_next_completed(struct smtpc_env *env);
+
 /** Request }}} */
 
 /* {{{ Version */
@@ -0,0 +1,353 @@
+--
+--  Copyright (C) 2016-2023 Tarantool AUTHORS: please see AUTHORS file.
+--
+--  Redistribution and use in source and binary forms, with or
+--  without modification, are permitted provided that the following
+--  conditions are met:
+--
+--  1. Redistributions of source code must retain the above
+--   copyright notice, this list of conditions and the
+--   following disclaimer.
+--
+--  2. Redistributions in binary form must reproduce the above
+--   copyright notice, this list of conditions and the following
+--   disclaimer in the documentation and/or other materials
+--   provided with the distribution.
+--
+--  THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+--  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+--  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+--  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+--  <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+--  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+--  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+--  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+--  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+--  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+--  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+--  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+--  SUCH DAMAGE.
+--
+
+-- Outbound spool: composed messages are stored in a space and
+-- delivered by a pool of fibers, which retry temporary failures
+-- with exponential backoff.
+
+local fiber = require('fiber')
+local log = require('log')
+local uuid = require('uuid')
+
+local driver = require('smtp.lib')
+
+-- Fields of a spooled message.
+local F_ID = 1
+local F_STATE = 2
+local F_NEXT_ATTEMPT = 3
+local F_ATTEMPTS = 4
+local F_URL = 5
+local F_FROM = 6
+local F_RECIPIENTS = 7
+local F_TEXT = 8
+local F_OPTIONS = 9
+local F_LAST_STATUS = 10
+local F_LAST_REASON = 11
+
+local FORMAT = {
+    {name = 'id', type = 'string'},
+    {name = 'state', type = 'string'},
+    {name = 'next_attempt', type = 'number'},
+    {name = 'attempts', type = 'unsigned'},
+    {name = 'url', type = 'string', is_nullable = true},
+    {name = 'from', type = 'string'},
+    {name = 'recipients', type = 'array'},
+    {name = 'text', type = 'string'},
+    {name = 'options', type = 'map'},
+    {name = 'last_status', type = 'integer'},
+    {name = 'last_reason', type = 'string'},
+}
+
+-- Message states.
+local PENDING = 'pending'
+local SENDING = 'sending'
+local SENT = 'sent'
+local FAILED = 'failed'
+
+-- request() options stored with a message: the connection ones,
+-- the others are applied when the message is composed. The
+-- credentials are options of the spool, so they are not written
+-- to the space, its WAL and replicas.
+local CONNECTION_OPTIONS = {
+    'ca_path', 'ca_file', 'verify_host', 'verify_peer', 'ssl_key',
+    'ssl_cert', 'use_ssl', 'timeout', 'connect_timeout', 'low_speed_limit',
+    'low_speed_time', 'verbose', 'engine',
+}
+
+local spool_mt
+
+-- Delay before the next attempt: the base delay doubled for each
+-- failed attempt, capped and spread by a random jitter, so
+-- messages deferred by one relay outage don't come back at once.
+local function backoff(self, attempts)
+    local delay = math.min(self.backoff_max,
+                           self.backoff_base * 2 ^ (attempts - 1))
+    return delay * (0.5 + math.random() / 2)
+end
+
+-- Take the earliest due message and mark it as being sent.
+local function claim(self)
+    local ok, t = pcall(function()
+        box.begin()
+        local t = self.space.index.schedule:select({PENDING},
+                                                   {limit = 1})[1]
+        if t ~= nil and t[F_NEXT_ATTEMPT] <= fiber.time() then
+            t = self.space:update(t[F_ID], {{'=', F_STATE, SENDING}})
+        else
+            t = nil
+        end
+        box.commit()
+        return t
+    end)
+    if not ok then
+        -- Aborted by a concurrent worker (vinyl), try later.
+        box.rollback()
+        return nil
+    end
+    return t
+end
+
+-- Delay until the earliest pending message is due.
+local function next_delay(self)
+    local t = self.space.index.schedule:select({PENDING}, {limit = 1})[1]
+    if t == nil then
+        return self.poll_interval
+    end
+    return math.min(self.poll_interval,
+                    math.max(0, t[F_NEXT_ATTEMPT] - fiber.time()))
+end
+
+local function deliver(self, t)
+    local options = t[F_OPTIONS]
+    options.username = self.username
+    options.password = self.password
+    local url = t[F_URL]
+    if url == box.NULL then
+        url = nil
+    end
+    local ok, resp = pcall(self.transmit, url, t[F_FROM], t[F_RECIPIENTS],
+                           t[F_TEXT], options)
+    local status, reason
+    if ok then
+        status, reason = resp.status, resp.reason or ''
+    else
+        status, reason = -1, tostring(resp)
+    end
+    local attempts = t[F_ATTEMPTS] + 1
+    local state, next_attempt
+    if status >= 200 and status < 300 then
+        state, next_attempt = SENT, 0
+    elseif (status >= 500 and status < 600) or
+            attempts >= self.max_attempts then
+        -- A permanent failure is not retried.
+        state, next_attempt = FAILED, 0
+    else
+        state = PENDING
+        next_attempt = fiber.time() + backoff(self, attempts)
+    end
+    if state ~= SENT then
+        log.warn('smtp spool: message %s: %s %s', t[F_ID], status, reason)
+    end
+    self.space:update(t[F_ID], {
+        {'=', F_STATE, state},
+        {'=', F_NEXT_ATTEMPT, next_attempt},
+        {'=', F_ATTEMPTS, attempts},
+        {'=', F_LAST_STATUS, status},
+        {'=', F_LAST_REASON, reason},
+    })
+end
+
+local function worker_f(self)
+    while not self.stopped do
+        local t = claim(self)
+        if t ~= nil then
+            deliver(self, t)
+        else
+            self.wakeup:get(next_delay(self))
+        end
+    end
+end
+
+--
+--  <spool> Create an outbound spool of the client.
+--
+--  Must be called after box.cfg(). The messages are stored in the
+--  space, so they survive a restart; the ones interrupted while being
+--  sent are sent again.
+--
+--  Parameters:
+--
+--  opts - a table of options:
+--      space - a space name (defaults to 'smtp_spool'), it is created
+--          if it does not exist;
+--
+--      engine - an engine of the space, 'memtx' or 'vinyl' (defaults to
+--          'memtx');
+--
+--      workers - the number of fibers sending messages (defaults to 4);
+--
+--      max_attempts - the number of attempts before a message is
+--          failed (defaults to 10);
+--
+--      backoff_base - the delay before the second attempt in seconds, it
+--          is doubled for every next one (defaults to 1);
+--
+--      backoff_max - the maximum delay between attempts in seconds
+--          (defaults to 3600);
+--
+--      username, password - credentials for server authorization of
+--          every spooled message; they are kept in memory only.
+--
+--  Returns:
+--      spool object or raise error()
+--
+local function spool_new(client, compose, transmit, opts)
+    opts = opts or {}
+    if type(box.cfg) == 'function' then
+        error('spool: box.cfg() must be called first')
+    end
+    local name = opts.space or 'smtp_spool'
+    local space = box.schema.space.create(name, {
+        engine = opts.engine or 'memtx',
+        format = FORMAT,
+        if_not_exists = true,
+    })
+    space:create_index('primary', {
+        parts = {F_ID, 'string'},
+        if_not_exists = true,
+    })
+    space:create_index('schedule', {
+        parts = {F_STATE, 'string', F_NEXT_ATTEMPT, 'number'},
+        unique = false,
+        if_not_exists = true,
+    })
+
+    local self = setmetatable({
+        client = client,
+        compose = compose,
+        transmit = transmit,
+        space = space,
+        max_attempts = opts.max_attempts or 10,
+        backoff_base = opts.backoff_base or 1,
+        backoff_max = opts.backoff_max or 3600,
+        username = opts.username,
+        password = opts.password,
+        poll_interval = 1,
+        wakeup = fiber.channel(1),
+        workers = {},
+    }, spool_mt)
+
+    -- The worker died with the instance, send the message again.
+    for _, t in ipairs(space.index.schedule:select({SENDING})) do
+        space:update(t[F_ID], {{'=', F_STATE, PENDING}})
+    end
+
+    for i = 1, opts.workers or 4 do
+        local f = fiber.create(worker_f, self)
+        f:name('smtp.spool')
+        self.workers[i] = f
+    end
+    return self
+end
+
+spool_mt = {
+    __index = {
+        --
+        --  <send> Compose a message and store it for delivery.
+        --
+        --  Parameters: the same as request(). The body must be a string
+        --      and attachments must have a body. username and password
+        --      are options of the spool, not of a message. Without url
+        --      the message is sent to the relays of the client, with
+        --      failover, on every attempt.
+        --
+        --  Returns:
+        --      an id of the message
+        --
+        send = function(self, url, from, to, body, opts)
+            opts = opts or {}
+            if not body or not from or
+                    (not url and not self.client.relays) then
+                error('send(url, from, to, body [, options]])')
+            end
+            if type(body) ~= 'string' and type(body) ~= 'number' then
+                error('spool: body must be a string')
+            end
+            if opts.username ~= nil or opts.password ~= nil then
+                error('spool: username and password are options of ' ..
+                      'the spool')
+            end
+            local message, from_addr, recipients_addr =
+                self.compose(from, to or {}, body, opts)
+            local options = {}
+            for _, key in ipairs(CONNECTION_OPTIONS) do
+                options[key] = opts[key]
+            end
+            local id = uuid.str()
+            self.space:insert({
+                id, PENDING, 0, 0, url or box.NULL, from_addr,
+                recipients_addr,
+                driver.message_text(message),
+                setmetatable(options, {__serialize = 'map'}), 0, '',
+            })
+            self.wakeup:put(true, 0)
+            return id
+        end,
+
+        --
+        --  <status> Get the delivery state of a message.
+        --
+        --  Returns:
+        --      {
+        --          state=STRING ('pending', 'sending', 'sent' or 'failed'),
+        --          attempts=NUMBER,
+        --          next_attempt=NUMBER (time of the next attempt),
+        --          status=NUMBER (the status of the last attempt),
+        --          reason=STRING
+        --      }
+        --      or nil if there is no such message
+        --
+        status = function(self, id)
+            local t = self.space:get(id)
+            if t == nil then
+                return nil
+            end
+            return {
+                state = t[F_STATE],
+                attempts = t[F_ATTEMPTS],
+                next_attempt = t[F_NEXT_ATTEMPT],
+                status = t[F_LAST_STATUS],
+                reason = t[F_LAST_REASON],
+            }
+        end,
+
+        --
+        --  <delete> Remove a message from the spool.
+        --
+        delete = function(self, id)
+            self.space:delete(id)
+        end,
+
+        --
+        --  <stop> Stop sending messages. The stored ones are sent
+        --      when a spool is created on the space again.
+        --
+        stop = function(self)
+            self.stopped = true
+            self.wakeup:close()
+        end,
+    },
+}
+
+return {
+    new = spool_new,
+}
+-- vim: ts=4 sts=4 sw=4 et